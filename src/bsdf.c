@@ -0,0 +1,299 @@
+
+#include <math.h>
+
+#include "bsdf.h"
+
+Vec3 sampleLambert(Vec3 normal, float u0, float u1) {
+    return fromCosineAndAzimuthal(normal, sqrtf(1 - u1), 2 * PI * u0);
+}
+
+float lambertPdf(Vec3 normal, Vec3 direction) {
+    float cos = dotVec3(normal, direction);
+    return cos > 0 ? cos / PI : 0;
+}
+
+Color evalLambert(Color albedo, Vec3 normal, Vec3 direction) {
+    return scaleVec3(albedo, lambertPdf(normal, direction));
+}
+
+Vec3 samplePhong(Vec3 axis, float exponent, float u0, float u1) {
+    return sampleCosinePowerDirection(axis, exponent, u0, u1);
+}
+
+float phongPdf(Vec3 axis, float exponent, Vec3 direction) {
+    float cos = dotVec3(axis, direction);
+    return cos > 0 ? (exponent + 1) / (2 * PI) * fastPow(cos, exponent) : 0;
+}
+
+// The distribution is normalized like the pdf, so the weight of a sample is the albedo times
+// the ratio of the cosines, which is close to one for sharp lobes
+Color evalPhong(Color albedo, float exponent, float cos_lobe, float cos_incoming, float cos_direction) {
+    if (cos_lobe > 0 && cos_incoming > 0 && cos_direction > 0) {
+        float distribution = (exponent + 1) / (2 * PI) * fastPow(cos_lobe, exponent);
+        return scaleVec3(albedo, distribution * cos_direction / fmaxf(cos_incoming, cos_direction));
+    } else {
+        return createVec3(0, 0, 0);
+    }
+}
+
+// Going into the optically thinner medium, the approximation has to use the angle of the
+// transmitted ray, which is the larger one.
+float fresnelReflectance(float cos, float r0, float eta) {
+    if (eta > 1) {
+        float sin2 = eta * eta * (1 - cos * cos);
+        if (sin2 >= 1) {
+            return 1;
+        }
+        cos = sqrtf(1 - sin2);
+    }
+    float x = 1 - cos;
+    float x2 = x * x;
+    return r0 + (1 - r0) * x2 * x2 * x;
+}
+
+Vec3 reflectionDirection(Vec3 incoming, Vec3 normal) {
+    return subVec3(incoming, scaleVec3(normal, 2 * dotVec3(incoming, normal)));
+}
+
+Vec3 refractionDirection(Vec3 incoming, Vec3 normal, float cos, float eta) {
+    float cos2 = 1 - eta * eta * (1 - cos * cos);
+    if (cos2 < 0) {
+        return reflectionDirection(incoming, normal);
+    }
+    Vec3 transmition = addVec3(scaleVec3(incoming, eta), scaleVec3(normal, eta * cos - sqrtf(cos2)));
+    return normalizeVec3(transmition);
+}
+
+bool refractPhongMicrofacet(Vec3 incoming, Vec3 microfacet, float eta, Vec3* direction) {
+    float cos = -dotVec3(incoming, microfacet);
+    if (cos <= 0 || eta * eta * (1 - cos * cos) >= 1) {
+        return false;
+    }
+    *direction = refractionDirection(incoming, microfacet, cos, eta);
+    return true;
+}
+
+// The microfacet normal that refracts incoming into the direction, on the side of the normal.
+// Returns false if no microfacet does.
+static bool transmissionHalfVector(Vec3 incoming, Vec3 normal, float eta, Vec3 direction, Vec3* out) {
+    if (dotVec3(incoming, normal) >= 0 || dotVec3(direction, normal) >= 0) {
+        return false;
+    }
+    Vec3 half = subVec3(scaleVec3(incoming, eta), direction);
+    float length = magnitudeVec3(half);
+    if (length <= 0) {
+        return false;
+    }
+    half = scaleVec3(half, dotVec3(half, normal) < 0 ? -1 / length : 1 / length);
+    // Both directions have to be on the right side of the microfacet
+    if (dotVec3(incoming, half) >= 0 || dotVec3(direction, half) >= 0) {
+        return false;
+    }
+    *out = half;
+    return true;
+}
+
+// The density of the microfacet normals times the Jacobian of the refraction,
+// |o.h| / (eta (i.h) + (o.h))^2 with both directions pointing away from the surface
+float phongTransmissionPdf(Vec3 incoming, Vec3 normal, float eta, float exponent, Vec3 direction) {
+    Vec3 half;
+    if (!transmissionHalfVector(incoming, normal, eta, direction, &half)) {
+        return 0;
+    }
+    float cos_i = -dotVec3(incoming, half);
+    float cos_o = dotVec3(direction, half);
+    float denom = eta * cos_i + cos_o;
+    return phongPdf(normal, exponent, half) * -cos_o / (denom * denom);
+}
+
+Color evalPhongTransmission(Color albedo, float exponent, Vec3 incoming, Vec3 normal, float eta, Vec3 direction) {
+    Vec3 half;
+    if (!transmissionHalfVector(incoming, normal, eta, direction, &half)) {
+        return createVec3(0, 0, 0);
+    }
+    float cos_i = -dotVec3(incoming, half);
+    float cos_o = dotVec3(direction, half);
+    float denom = eta * cos_i + cos_o;
+    float cos_h = dotVec3(normal, half);
+    float cos_incoming = -dotVec3(incoming, normal);
+    // The Phong pdf already includes one cosine of the microfacet normal
+    float distribution = phongPdf(normal, exponent, half) / cos_h;
+    return scaleVec3(albedo, eta * distribution * cos_i * -cos_o / (cos_incoming * denom * denom));
+}
+
+static float maxComponent(Color color) {
+    return fmaxf(color.x, fmaxf(color.y, color.z));
+}
+
+// Probability of choosing the diffuse lobe, and the Fresnel reflectance of dielectrics (1 for
+// other materials). Returns false if no allowed lobe reflects any light.
+static bool lobeProbabilities(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes,
+    float* diffuse_probability, float* reflectance
+) {
+    MaterialKind kind = material->kind;
+    if (kind == MATERIAL_EMITTER) {
+        return false;
+    }
+    bool diffuse = (allowed_lobes & BSDF_LOBE_DIFFUSE) != 0 && kind != MATERIAL_GLOSSY;
+    bool dielectric = kind == MATERIAL_DIELECTRIC;
+    bool specular = dielectric || (
+        (allowed_lobes & BSDF_LOBE_SPECULAR) != 0 && (kind == MATERIAL_GLOSSY || kind == MATERIAL_PLASTIC)
+    );
+    Color transmition_color = scaleVec3(material->transmition_color, material->transmitability);
+    float eta = outside ? 1 / material->index_of_refraction : material->index_of_refraction;
+    float cosO = -dotVec3(incoming, normal);
+    float refl = dielectric ? fresnelReflectance(cosO, material->fresnel_r0, eta) : 1;
+    float diffuse_weight = diffuse ? maxComponent(material->diffuse_color) : 0;
+    float specular_weight = 0;
+    if (specular) {
+        specular_weight = refl * maxComponent(material->specular_color);
+        if (dielectric) {
+            specular_weight += (1 - refl) * maxComponent(transmition_color);
+        }
+    }
+    if (diffuse_weight + specular_weight <= 0) {
+        return false;
+    }
+    *diffuse_probability = diffuse_weight / (diffuse_weight + specular_weight);
+    *reflectance = refl;
+    return true;
+}
+
+bool chooseBsdfLobe(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes,
+    Sampler* sampler, BsdfLobeChoice* out
+) {
+    float diffuse_probability, refl;
+    if (!lobeProbabilities(material, incoming, normal, outside, allowed_lobes, &diffuse_probability, &refl)) {
+        return false;
+    }
+    bool dielectric = material->kind == MATERIAL_DIELECTRIC;
+    float eta = outside ? 1 / material->index_of_refraction : material->index_of_refraction;
+    float u_lobe = sampleFloat(sampler);
+    sample2D(sampler, &out->u0, &out->u1);
+    out->incoming = incoming;
+    out->eta = eta;
+    if (u_lobe < diffuse_probability) {
+        out->lobe = BSDF_LOBE_DIFFUSE;
+        out->axis = normal;
+        out->exponent = 1;
+        out->albedo = material->diffuse_color;
+        out->normal = normal;
+        out->probability = diffuse_probability;
+    } else if (!dielectric || refl > sampleFloat(sampler)) {
+        if (dielectric && (allowed_lobes & BSDF_LOBE_SPECULAR) == 0) {
+            return false;
+        }
+        out->lobe = BSDF_LOBE_SPECULAR;
+        out->axis = reflectionDirection(incoming, normal);
+        out->exponent = material->specular_sharpness;
+        out->albedo = material->specular_color;
+        out->normal = normal;
+        out->probability = 1 - diffuse_probability;
+    } else {
+        if ((allowed_lobes & BSDF_LOBE_TRANSMISSION) == 0) {
+            return false;
+        }
+        out->lobe = BSDF_LOBE_TRANSMISSION;
+        out->axis = normal;
+        out->exponent = material->specular_sharpness;
+        out->albedo = scaleVec3(material->transmition_color, material->transmitability);
+        out->normal = scaleVec3(normal, -1);
+        out->probability = 1 - diffuse_probability;
+    }
+    return true;
+}
+
+bool finishBsdfSample(const BsdfLobeChoice* choice, Vec3 direction, BsdfSample* out) {
+    Color eval;
+    float pdf;
+    if (choice->lobe == BSDF_LOBE_DIFFUSE) {
+        eval = evalLambert(choice->albedo, choice->normal, direction);
+        pdf = lambertPdf(choice->normal, direction) * choice->probability;
+    } else if (choice->lobe == BSDF_LOBE_SPECULAR) {
+        float cos_incoming = -dotVec3(choice->incoming, choice->normal);
+        float cos_direction = dotVec3(choice->normal, direction);
+        eval = evalPhong(choice->albedo, choice->exponent, dotVec3(choice->axis, direction), cos_incoming, cos_direction);
+        pdf = phongPdf(choice->axis, choice->exponent, direction) * choice->probability;
+    } else {
+        // The drawn direction is the microfacet normal, the axis is the normal on the near side
+        if (!refractPhongMicrofacet(choice->incoming, direction, choice->eta, &direction)) {
+            return false;
+        }
+        eval = evalPhongTransmission(choice->albedo, choice->exponent, choice->incoming, choice->axis, choice->eta, direction);
+        pdf = phongTransmissionPdf(choice->incoming, choice->axis, choice->eta, choice->exponent, direction) * choice->probability;
+    }
+    out->lobe = choice->lobe;
+    out->direction = direction;
+    if (pdf > 0 && !isVec3Null(eval)) {
+        out->weight = scaleVec3(eval, 1 / pdf);
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool sampleBsdf(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes,
+    Sampler* sampler, BsdfSample* out
+) {
+    BsdfLobeChoice choice;
+    if (!chooseBsdfLobe(material, incoming, normal, outside, allowed_lobes, sampler, &choice)) {
+        return false;
+    }
+    Vec3 direction;
+    if (choice.lobe == BSDF_LOBE_DIFFUSE) {
+        direction = sampleLambert(choice.axis, choice.u0, choice.u1);
+    } else {
+        direction = samplePhong(choice.axis, choice.exponent, choice.u0, choice.u1);
+    }
+    return finishBsdfSample(&choice, direction, out);
+}
+
+float bsdfPdf(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes, Vec3 direction
+) {
+    float diffuse_probability, refl;
+    if (!lobeProbabilities(material, incoming, normal, outside, allowed_lobes, &diffuse_probability, &refl)) {
+        return 0;
+    }
+    float pdf = diffuse_probability * lambertPdf(normal, direction);
+    if ((allowed_lobes & BSDF_LOBE_SPECULAR) != 0) {
+        Vec3 reflection = reflectionDirection(incoming, normal);
+        pdf += (1 - diffuse_probability) * refl * phongPdf(reflection, material->specular_sharpness, direction);
+    }
+    if (material->kind == MATERIAL_DIELECTRIC && (allowed_lobes & BSDF_LOBE_TRANSMISSION) != 0) {
+        float eta = outside ? 1 / material->index_of_refraction : material->index_of_refraction;
+        pdf += (1 - diffuse_probability) * (1 - refl) * phongTransmissionPdf(incoming, normal, eta, material->specular_sharpness, direction);
+    }
+    return pdf;
+}
+
+Color evalBsdf(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes, Vec3 direction
+) {
+    Color ret = createVec3(0, 0, 0);
+    MaterialKind kind = material->kind;
+    if ((allowed_lobes & BSDF_LOBE_DIFFUSE) != 0 && kind != MATERIAL_EMITTER && kind != MATERIAL_GLOSSY) {
+        ret = addVec3(ret, evalLambert(material->diffuse_color, normal, direction));
+    }
+    float refl = 1;
+    if (kind == MATERIAL_DIELECTRIC) {
+        float eta = outside ? 1 / material->index_of_refraction : material->index_of_refraction;
+        float cosO = -dotVec3(incoming, normal);
+        refl = fresnelReflectance(cosO, material->fresnel_r0, eta);
+        if ((allowed_lobes & BSDF_LOBE_TRANSMISSION) != 0) {
+            Color transmition_color = scaleVec3(material->transmition_color, material->transmitability);
+            Color eval = evalPhongTransmission(transmition_color, material->specular_sharpness, incoming, normal, eta, direction);
+            ret = addVec3(ret, scaleVec3(eval, 1 - refl));
+        }
+    }
+    if ((allowed_lobes & BSDF_LOBE_SPECULAR) != 0 && (kind == MATERIAL_GLOSSY || kind == MATERIAL_PLASTIC || kind == MATERIAL_DIELECTRIC)) {
+        Vec3 reflection = reflectionDirection(incoming, normal);
+        float cos_lobe = dotVec3(reflection, direction);
+        Color eval = evalPhong(material->specular_color, material->specular_sharpness, cos_lobe, -dotVec3(incoming, normal), dotVec3(normal, direction));
+        ret = addVec3(ret, scaleVec3(eval, refl));
+    }
+    return ret;
+}
@@ -0,0 +1,119 @@
+#ifndef _BSDF_H_
+#define _BSDF_H_
+
+#include <stdbool.h>
+
+#include "vec.h"
+#include "scene.h"
+#include "sampler.h"
+
+// All directions are normalized and point away from the surface. The eval functions return the
+// value of the bsdf times the cosine between the normal and direction, so that eval / pdf is the
+// weight of a sample. Dividing by that cosine gives the bsdf itself.
+
+// Cosine weighted Lambertian lobe around the normal
+Vec3 sampleLambert(Vec3 normal, float u0, float u1);
+
+float lambertPdf(Vec3 normal, Vec3 direction);
+
+Color evalLambert(Color albedo, Vec3 normal, Vec3 direction);
+
+// Phong lobe around the mirror direction, the exponent is the specular sharpness (Ns) of the
+// material. Directions are sampled from the normalized Phong distribution around the axis, and
+// cos_lobe is the cosine between the direction and the axis. The bsdf is that distribution
+// divided by the larger of the cosines of the two directions to the normal, so it is the same for
+// light going either way, never reflects more than the albedo, and a very sharp lobe behaves like
+// a perfect mirror.
+Vec3 samplePhong(Vec3 axis, float exponent, float u0, float u1);
+
+float phongPdf(Vec3 axis, float exponent, Vec3 direction);
+
+Color evalPhong(Color albedo, float exponent, float cos_lobe, float cos_incoming, float cos_direction);
+
+// Rough refraction, the normal is on the side of incoming and eta is n1 / n2. The normals of the
+// microfacets follow the Phong distribution around the normal, and a direction is sampled by
+// drawing one with samplePhong(normal, exponent, ...) and refracting incoming through it. The
+// bsdf is the microfacet bsdf of Walter et al. without shadowing, scaled by n1 * n2 instead of
+// n2^2 so that it is the same for light going either way. A very sharp lobe behaves like a perfect
+// refraction whose weight eta is undone when the path leaves the medium again.
+bool refractPhongMicrofacet(Vec3 incoming, Vec3 microfacet, float eta, Vec3* direction);
+
+float phongTransmissionPdf(Vec3 incoming, Vec3 normal, float eta, float exponent, Vec3 direction);
+
+Color evalPhongTransmission(Color albedo, float exponent, Vec3 incoming, Vec3 normal, float eta, Vec3 direction);
+
+// Schlick's approximation of the fraction of reflected light. cos is measured on the side of n1,
+// r0 is the reflectance at normal incidence and eta is n1 / n2. Returns 1 for total internal
+// reflection.
+float fresnelReflectance(float cos, float r0, float eta);
+
+// The incoming direction points towards the surface, the normal against it
+Vec3 reflectionDirection(Vec3 incoming, Vec3 normal);
+
+// cos is measured on the incoming side and eta is n1 / n2. Falls back to the reflection direction
+// for total internal reflection.
+Vec3 refractionDirection(Vec3 incoming, Vec3 normal, float cos, float eta);
+
+typedef enum {
+    BSDF_LOBE_DIFFUSE = 1 << 0,
+    BSDF_LOBE_SPECULAR = 1 << 1,
+    BSDF_LOBE_TRANSMISSION = 1 << 2,
+} BsdfLobe;
+
+typedef struct {
+    Vec3 direction;
+    Color weight;
+    BsdfLobe lobe;
+} BsdfSample;
+
+// Sample a single lobe of the material, for integrators that follow only one path per hit. The
+// lobe is chosen proportional to its albedo and the weight includes the selection probability.
+// Lobes not in allowed_lobes contribute nothing. Returns false if the path ends here.
+bool sampleBsdf(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes,
+    Sampler* sampler, BsdfSample* out
+);
+
+// Probability density of sampleBsdf returning the direction, summed over all of the lobes
+float bsdfPdf(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes, Vec3 direction
+);
+
+// Sum of the allowed lobes of the material as the path integrator shades it, i.e. the specular
+// lobe of dielectrics is weighted by the Fresnel term and the transmission lobe by the rest.
+// Integrators that follow paths from the lights use it with the incoming direction of the camera
+// side, so that they converge to the same image.
+Color evalBsdf(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes, Vec3 direction
+);
+
+// The lobe chosen by the first half of sampleBsdf, from which the direction is drawn as
+// sampleCosinePowerDirection(axis, exponent, u0, u1). The diffuse lobe has the exponent 1. For
+// the transmission lobe this draws the microfacet normal, which finishBsdfSample refracts.
+// Splitting sampleBsdf lets integrators that shade many paths at once draw all of their
+// directions in one batch.
+typedef struct {
+    BsdfLobe lobe;
+    Vec3 axis;
+    float exponent;
+    float u0;
+    float u1;
+    // Normal on the side of the lobe
+    Vec3 normal;
+    Color albedo;
+    float probability;
+    // Needed to refract through the microfacet
+    Vec3 incoming;
+    float eta;
+} BsdfLobeChoice;
+
+// Choose the lobe and draw the random numbers like sampleBsdf, returns false if the path ends
+bool chooseBsdfLobe(
+    const MaterialProperties* material, Vec3 incoming, Vec3 normal, bool outside, int allowed_lobes,
+    Sampler* sampler, BsdfLobeChoice* out
+);
+
+// Weight of the direction drawn from the chosen lobe, returns false if the path ends
+bool finishBsdfSample(const BsdfLobeChoice* choice, Vec3 direction, BsdfSample* out);
+
+#endif
@@ -2,8 +2,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "bvh.h"
+#include "numa.h"
+#include "trace.h"
 
 static BvhNode* createBVHLeaf(Vec3 verts[3], int triangle_id) {
     BvhNodeTriangle* ret = (BvhNodeTriangle*)malloc(sizeof(BvhNodeTriangle));
@@ -15,6 +20,78 @@ static BvhNode* createBVHLeaf(Vec3 verts[3], int triangle_id) {
     return (BvhNode*)ret;
 }
 
+static BvhNode* createPrimitiveLeaf(const Primitive* primitive, int primitive_id) {
+    switch (primitive->kind) {
+    case BVH_NODE_SPHERE: {
+        BvhNodeSphere* ret = (BvhNodeSphere*)malloc(sizeof(BvhNodeSphere));
+        ret->kind = BVH_NODE_SPHERE;
+        ret->primitive_id = primitive_id;
+        ret->center = primitive->position;
+        ret->radius = primitive->radius;
+        return (BvhNode*)ret;
+    } break;
+    case BVH_NODE_DISK: {
+        BvhNodeDisk* ret = (BvhNodeDisk*)malloc(sizeof(BvhNodeDisk));
+        ret->kind = BVH_NODE_DISK;
+        ret->primitive_id = primitive_id;
+        ret->center = primitive->position;
+        ret->normal = normalizeVec3(crossVec3(primitive->edges[0], primitive->edges[1]));
+        ret->edges[0] = primitive->edges[0];
+        ret->edges[1] = primitive->edges[1];
+        return (BvhNode*)ret;
+    } break;
+    default: {
+        BvhNodeQuad* ret = (BvhNodeQuad*)malloc(sizeof(BvhNodeQuad));
+        ret->kind = BVH_NODE_QUAD;
+        ret->primitive_id = primitive_id;
+        ret->corner = primitive->position;
+        ret->edges[0] = primitive->edges[0];
+        ret->edges[1] = primitive->edges[1];
+        return (BvhNode*)ret;
+    } break;
+    }
+}
+
+// A reference to a triangle (or primitive), together with the part of its bounds it is responsible
+// for. Spatial splits divide a reference in two, so that one triangle may end up in more than one leaf.
+typedef struct {
+    int triangle_id;
+    BoundingBox bounds;
+} BvhReference;
+
+typedef struct {
+    int (*vert_indices)[3];
+    Vec3* verts;
+    // If set, the references are to these primitives instead of triangles
+    const Primitive* primitives;
+    int first_id;
+    bool spatial_splits;
+    int split_budget;
+    float root_area;
+    // Build subtrees along alternating axes at the midpoint instead of using the SAH
+    bool midpoint;
+    // Subtrees with at most this many references are deferred, 0 to build the whole tree
+    int lazy_count;
+    // Share of the split budget reserved for each deferred subtree, relative to its references
+    float split_fraction;
+} BvhBuilder;
+
+// The references of a deferred subtree and the state of the builder are kept until it is built
+typedef struct {
+    BvhNodeDeferred base;
+    _Atomic(BvhNode*) subtree;
+    pthread_mutex_t lock;
+    BvhBuilder builder;
+    // Axis the midpoint builder starts with
+    int axis;
+    BvhReference* refs;
+    int count;
+} DeferredSubtree;
+
+static BvhNode* createDeferredNode(BvhBuilder* builder, const BvhReference* refs, int count, int axis);
+
+static BvhNode* createDeferredTriangles(const int* ordering, int count, int (*vert_indices)[3], Vec3* verts, int axis);
+
 static BvhNode* createBVHNode(BoundingBox bounds, BvhNode* children[2], int axis) {
     BvhNodeInternal* ret = (BvhNodeInternal*)malloc(sizeof(BvhNodeInternal));
     ret->kind = BVH_NODE_INTERNAL;
@@ -26,6 +103,76 @@ static BvhNode* createBVHNode(BoundingBox bounds, BvhNode* children[2], int axis
     return (BvhNode*)ret;
 }
 
+static float surfaceArea(const BoundingBox* bbox) {
+    Vec3 size = subVec3(bbox->bound[1], bbox->bound[0]);
+    return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+static BoundingBox primitiveBounds(const Primitive* primitive) {
+    BoundingBox ret;
+    switch (primitive->kind) {
+    case BVH_NODE_SPHERE: {
+        Vec3 radius = createVec3(primitive->radius, primitive->radius, primitive->radius);
+        ret.bound[0] = subVec3(primitive->position, radius);
+        ret.bound[1] = addVec3(primitive->position, radius);
+    } break;
+    case BVH_NODE_DISK: {
+        // The extent of the ellipse along each axis
+        Vec3 extent;
+        for (int k = 0; k < 3; k++) {
+            extent.v[k] = sqrtf(primitive->edges[0].v[k] * primitive->edges[0].v[k] + primitive->edges[1].v[k] * primitive->edges[1].v[k]);
+        }
+        ret.bound[0] = subVec3(primitive->position, extent);
+        ret.bound[1] = addVec3(primitive->position, extent);
+    } break;
+    default: {
+        Vec3 opposite = addVec3(primitive->position, addVec3(primitive->edges[0], primitive->edges[1]));
+        ret.bound[0] = minVec3(primitive->position, opposite);
+        ret.bound[1] = maxVec3(primitive->position, opposite);
+        for (int i = 0; i < 2; i++) {
+            Vec3 corner = addVec3(primitive->position, primitive->edges[i]);
+            ret.bound[0] = minVec3(ret.bound[0], corner);
+            ret.bound[1] = maxVec3(ret.bound[1], corner);
+        }
+    } break;
+    }
+    return ret;
+}
+
+// Bounds of a leaf of any kind
+static BoundingBox leafBounds(const BvhNode* bvh) {
+    Primitive primitive;
+    primitive.kind = bvh->kind;
+    switch (bvh->kind) {
+    case BVH_NODE_TRIANGLE: {
+        BvhNodeTriangle* tri = (BvhNodeTriangle*)bvh;
+        BoundingBox ret = {
+            .bound = { createVec3(INFINITY, INFINITY, INFINITY), createVec3(-INFINITY, -INFINITY, -INFINITY) },
+        };
+        for (int k = 0; k < 3; k++) {
+            ret.bound[0] = minVec3(ret.bound[0], tri->verts[k]);
+            ret.bound[1] = maxVec3(ret.bound[1], tri->verts[k]);
+        }
+        return ret;
+    } break;
+    case BVH_NODE_SPHERE:
+        primitive.position = ((BvhNodeSphere*)bvh)->center;
+        primitive.radius = ((BvhNodeSphere*)bvh)->radius;
+        break;
+    case BVH_NODE_DISK:
+        primitive.position = ((BvhNodeDisk*)bvh)->center;
+        primitive.edges[0] = ((BvhNodeDisk*)bvh)->edges[0];
+        primitive.edges[1] = ((BvhNodeDisk*)bvh)->edges[1];
+        break;
+    default:
+        primitive.position = ((BvhNodeQuad*)bvh)->corner;
+        primitive.edges[0] = ((BvhNodeQuad*)bvh)->edges[0];
+        primitive.edges[1] = ((BvhNodeQuad*)bvh)->edges[1];
+        break;
+    }
+    return primitiveBounds(&primitive);
+}
+
 static void surroundTriangles(BoundingBox* bbox, int* ordering, int (*vert_indices)[3], Vec3* verts, int start, int end) {
     for (int i = start; i < end; i++) {
         for (int k = 0; k < 3; k++) {
@@ -92,13 +239,15 @@ static void quickselect(int* ordering, int (*vert_indices)[3], Vec3* verts, int
     }
 }
 
-static BvhNode* buildBvhAlong(int* ordering, int (*vert_indices)[3], Vec3* verts, int start, int end, int axis) {
+static BvhNode* buildBvhAlong(int* ordering, int (*vert_indices)[3], Vec3* verts, int start, int end, int axis, int lazy_count) {
     if (start + 1 == end) {
         Vec3 vert[3];
         for (int k = 0; k < 3; k++) {
             vert[k] = verts[vert_indices[ordering[start]][k]];
         }
         return createBVHLeaf(vert, ordering[start]);
+    } else if (end - start <= lazy_count) {
+        return createDeferredTriangles(ordering + start, end - start, vert_indices, verts, axis);
     } else {
         BoundingBox bbox = {
             .bound = { createVec3(INFINITY, INFINITY, INFINITY), createVec3(-INFINITY, -INFINITY, -INFINITY) },
@@ -113,22 +262,755 @@ static BvhNode* buildBvhAlong(int* ordering, int (*vert_indices)[3], Vec3* verts
         }
         BvhNode* childs[2];
         int next_axis = (axis + 1) % 3;
-        childs[0] = buildBvhAlong(ordering, vert_indices, verts, start, mid_point, next_axis);
-        childs[1] = buildBvhAlong(ordering, vert_indices, verts, mid_point, end, next_axis);
+        childs[0] = buildBvhAlong(ordering, vert_indices, verts, start, mid_point, next_axis, lazy_count);
+        childs[1] = buildBvhAlong(ordering, vert_indices, verts, mid_point, end, next_axis, lazy_count);
+        return createBVHNode(bbox, childs, axis);
+    }
+}
+
+#define BVH_BINS 32
+#define SPATIAL_SPLIT_ALPHA 1e-5
+
+static BoundingBox emptyBounds() {
+    BoundingBox ret = {
+        .bound = { createVec3(INFINITY, INFINITY, INFINITY), createVec3(-INFINITY, -INFINITY, -INFINITY) },
+    };
+    return ret;
+}
+
+static void growBounds(BoundingBox* bbox, const BoundingBox* other) {
+    bbox->bound[0] = minVec3(bbox->bound[0], other->bound[0]);
+    bbox->bound[1] = maxVec3(bbox->bound[1], other->bound[1]);
+}
+
+static void growBoundsPoint(BoundingBox* bbox, Vec3 point) {
+    bbox->bound[0] = minVec3(bbox->bound[0], point);
+    bbox->bound[1] = maxVec3(bbox->bound[1], point);
+}
+
+static bool isEmptyBounds(const BoundingBox* bbox) {
+    return bbox->bound[0].x > bbox->bound[1].x || bbox->bound[0].y > bbox->bound[1].y || bbox->bound[0].z > bbox->bound[1].z;
+}
+
+static float boundsArea(const BoundingBox* bbox) {
+    return isEmptyBounds(bbox) ? 0 : surfaceArea(bbox);
+}
+
+static float referenceCenter(const BvhReference* ref, int axis) {
+    return (ref->bounds.bound[0].v[axis] + ref->bounds.bound[1].v[axis]) / 2;
+}
+
+// Split the reference at the plane position along axis, clipping the triangle against the plane
+static void splitReference(
+    const BvhBuilder* builder, const BvhReference* ref, int axis, float position, BvhReference* left, BvhReference* right
+) {
+    left->triangle_id = ref->triangle_id;
+    right->triangle_id = ref->triangle_id;
+    left->bounds = emptyBounds();
+    right->bounds = emptyBounds();
+    for (int k = 0; k < 3; k++) {
+        Vec3 v = builder->verts[builder->vert_indices[ref->triangle_id][k]];
+        Vec3 w = builder->verts[builder->vert_indices[ref->triangle_id][(k + 1) % 3]];
+        if (v.v[axis] <= position) {
+            growBoundsPoint(&left->bounds, v);
+        }
+        if (v.v[axis] >= position) {
+            growBoundsPoint(&right->bounds, v);
+        }
+        if ((v.v[axis] < position && w.v[axis] > position) || (v.v[axis] > position && w.v[axis] < position)) {
+            float t = (position - v.v[axis]) / (w.v[axis] - v.v[axis]);
+            Vec3 cut = addVec3(v, scaleVec3(subVec3(w, v), t));
+            cut.v[axis] = position;
+            growBoundsPoint(&left->bounds, cut);
+            growBoundsPoint(&right->bounds, cut);
+        }
+    }
+    // The parts must stay inside of the bounds of the reference that was split
+    left->bounds.bound[1].v[axis] = position;
+    right->bounds.bound[0].v[axis] = position;
+    left->bounds.bound[0] = maxVec3(left->bounds.bound[0], ref->bounds.bound[0]);
+    left->bounds.bound[1] = minVec3(left->bounds.bound[1], ref->bounds.bound[1]);
+    right->bounds.bound[0] = maxVec3(right->bounds.bound[0], ref->bounds.bound[0]);
+    right->bounds.bound[1] = minVec3(right->bounds.bound[1], ref->bounds.bound[1]);
+}
+
+typedef struct {
+    float cost;
+    int axis;
+    int bin;
+    float position;
+    BoundingBox bounds[2];
+} BvhSplit;
+
+static int centerBin(float center, float min, float extent) {
+    int bin = (int)(BVH_BINS * (center - min) / extent);
+    return bin < 0 ? 0 : (bin >= BVH_BINS ? BVH_BINS - 1 : bin);
+}
+
+// Binned surface area heuristic over the centers of the references
+static void findObjectSplit(BvhReference* refs, int count, BvhSplit* best) {
+    BoundingBox centers = emptyBounds();
+    for (int i = 0; i < count; i++) {
+        Vec3 center = scaleVec3(addVec3(refs[i].bounds.bound[0], refs[i].bounds.bound[1]), 0.5);
+        growBoundsPoint(&centers, center);
+    }
+    best->cost = INFINITY;
+    best->axis = 0;
+    best->bin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float min = centers.bound[0].v[axis];
+        float extent = centers.bound[1].v[axis] - min;
+        if (extent > 0) {
+            BoundingBox bins[BVH_BINS];
+            int counts[BVH_BINS] = { 0 };
+            for (int b = 0; b < BVH_BINS; b++) {
+                bins[b] = emptyBounds();
+            }
+            for (int i = 0; i < count; i++) {
+                int b = centerBin(referenceCenter(&refs[i], axis), min, extent);
+                growBounds(&bins[b], &refs[i].bounds);
+                counts[b]++;
+            }
+            BoundingBox right_bounds[BVH_BINS];
+            int right_counts[BVH_BINS];
+            BoundingBox acc = emptyBounds();
+            int acc_count = 0;
+            for (int b = BVH_BINS - 1; b > 0; b--) {
+                growBounds(&acc, &bins[b]);
+                acc_count += counts[b];
+                right_bounds[b] = acc;
+                right_counts[b] = acc_count;
+            }
+            acc = emptyBounds();
+            acc_count = 0;
+            for (int b = 1; b < BVH_BINS; b++) {
+                growBounds(&acc, &bins[b - 1]);
+                acc_count += counts[b - 1];
+                if (acc_count > 0 && right_counts[b] > 0) {
+                    float cost = boundsArea(&acc) * acc_count + boundsArea(&right_bounds[b]) * right_counts[b];
+                    if (cost < best->cost) {
+                        best->cost = cost;
+                        best->axis = axis;
+                        best->bin = b;
+                        best->position = min + extent * b / BVH_BINS;
+                        best->bounds[0] = acc;
+                        best->bounds[1] = right_bounds[b];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Binned surface area heuristic over planes that may cut through references
+static void findSpatialSplit(const BvhBuilder* builder, BvhReference* refs, int count, const BoundingBox* node_bounds, BvhSplit* best) {
+    best->cost = INFINITY;
+    best->axis = 0;
+    best->bin = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float min = node_bounds->bound[0].v[axis];
+        float extent = node_bounds->bound[1].v[axis] - min;
+        if (extent > 0) {
+            BoundingBox bins[BVH_BINS];
+            int entries[BVH_BINS] = { 0 };
+            int exits[BVH_BINS] = { 0 };
+            for (int b = 0; b < BVH_BINS; b++) {
+                bins[b] = emptyBounds();
+            }
+            for (int i = 0; i < count; i++) {
+                int first = centerBin(refs[i].bounds.bound[0].v[axis], min, extent);
+                int last = centerBin(refs[i].bounds.bound[1].v[axis], min, extent);
+                BvhReference rest = refs[i];
+                for (int b = first; b < last; b++) {
+                    BvhReference parts[2];
+                    splitReference(builder, &rest, axis, min + extent * (b + 1) / BVH_BINS, &parts[0], &parts[1]);
+                    growBounds(&bins[b], &parts[0].bounds);
+                    rest = parts[1];
+                }
+                growBounds(&bins[last], &rest.bounds);
+                entries[first]++;
+                exits[last]++;
+            }
+            BoundingBox right_bounds[BVH_BINS];
+            int right_counts[BVH_BINS];
+            BoundingBox acc = emptyBounds();
+            int acc_count = 0;
+            for (int b = BVH_BINS - 1; b > 0; b--) {
+                growBounds(&acc, &bins[b]);
+                acc_count += exits[b];
+                right_bounds[b] = acc;
+                right_counts[b] = acc_count;
+            }
+            acc = emptyBounds();
+            acc_count = 0;
+            for (int b = 1; b < BVH_BINS; b++) {
+                growBounds(&acc, &bins[b - 1]);
+                acc_count += entries[b - 1];
+                // Splits that do not reduce the number of references on either side can not terminate
+                int duplicates = acc_count + right_counts[b] - count;
+                if (
+                    acc_count > 0 && right_counts[b] > 0 && acc_count < count && right_counts[b] < count
+                    && duplicates <= builder->split_budget
+                ) {
+                    float cost = boundsArea(&acc) * acc_count + boundsArea(&right_bounds[b]) * right_counts[b];
+                    if (cost < best->cost) {
+                        best->cost = cost;
+                        best->axis = axis;
+                        best->bin = b;
+                        best->position = min + extent * b / BVH_BINS;
+                        best->bounds[0] = acc;
+                        best->bounds[1] = right_bounds[b];
+                    }
+                }
+            }
+        }
+    }
+}
+
+static BvhNode* buildBvhFromReferences(BvhBuilder* builder, BvhReference* refs, int count) {
+    if (count == 1 && builder->primitives != NULL) {
+        return createPrimitiveLeaf(&builder->primitives[refs[0].triangle_id], builder->first_id + refs[0].triangle_id);
+    } else if (count == 1) {
+        Vec3 vert[3];
+        for (int k = 0; k < 3; k++) {
+            vert[k] = builder->verts[builder->vert_indices[refs[0].triangle_id][k]];
+        }
+        return createBVHLeaf(vert, refs[0].triangle_id);
+    } else if (count <= builder->lazy_count) {
+        return createDeferredNode(builder, refs, count, 0);
+    } else {
+        BoundingBox bbox = emptyBounds();
+        for (int i = 0; i < count; i++) {
+            growBounds(&bbox, &refs[i].bounds);
+        }
+        BvhSplit object;
+        findObjectSplit(refs, count, &object);
+        BvhSplit spatial = { .cost = INFINITY };
+        if (builder->spatial_splits && builder->split_budget > 0) {
+            // Only look for spatial splits if the children of the object split overlap noticeably.
+            // Without an object split its bounds are not set.
+            bool overlapping = true;
+            if (object.cost < INFINITY) {
+                BoundingBox overlap = {
+                    .bound = { maxVec3(object.bounds[0].bound[0], object.bounds[1].bound[0]), minVec3(object.bounds[0].bound[1], object.bounds[1].bound[1]) },
+                };
+                overlapping = boundsArea(&overlap) > SPATIAL_SPLIT_ALPHA * builder->root_area;
+            }
+            if (overlapping) {
+                findSpatialSplit(builder, refs, count, &bbox, &spatial);
+            }
+        }
+        BvhReference* left = (BvhReference*)malloc(sizeof(BvhReference) * count);
+        BvhReference* right = (BvhReference*)malloc(sizeof(BvhReference) * count);
+        int left_count = 0;
+        int right_count = 0;
+        int axis = 0;
+        if (spatial.cost < object.cost) {
+            axis = spatial.axis;
+            for (int i = 0; i < count; i++) {
+                if (refs[i].bounds.bound[1].v[axis] <= spatial.position) {
+                    left[left_count++] = refs[i];
+                } else if (refs[i].bounds.bound[0].v[axis] >= spatial.position) {
+                    right[right_count++] = refs[i];
+                } else {
+                    BvhReference parts[2];
+                    splitReference(builder, &refs[i], axis, spatial.position, &parts[0], &parts[1]);
+                    if (isEmptyBounds(&parts[0].bounds)) {
+                        right[right_count++] = refs[i];
+                    } else if (isEmptyBounds(&parts[1].bounds)) {
+                        left[left_count++] = refs[i];
+                    } else if (builder->split_budget > 0 && left_count < count - 1 && right_count < count - 1) {
+                        left[left_count++] = parts[0];
+                        right[right_count++] = parts[1];
+                        builder->split_budget--;
+                    } else if (referenceCenter(&refs[i], axis) < spatial.position) {
+                        left[left_count++] = refs[i];
+                    } else {
+                        right[right_count++] = refs[i];
+                    }
+                }
+            }
+        } else if (object.cost < INFINITY) {
+            axis = object.axis;
+            BoundingBox centers = emptyBounds();
+            for (int i = 0; i < count; i++) {
+                growBoundsPoint(&centers, scaleVec3(addVec3(refs[i].bounds.bound[0], refs[i].bounds.bound[1]), 0.5));
+            }
+            float min = centers.bound[0].v[axis];
+            float extent = centers.bound[1].v[axis] - min;
+            for (int i = 0; i < count; i++) {
+                if (centerBin(referenceCenter(&refs[i], axis), min, extent) < object.bin) {
+                    left[left_count++] = refs[i];
+                } else {
+                    right[right_count++] = refs[i];
+                }
+            }
+        }
+        if (left_count == 0 || right_count == 0) {
+            // All references have the same center, split them arbitrarily
+            left_count = count / 2;
+            right_count = count - left_count;
+            memcpy(left, refs, sizeof(BvhReference) * left_count);
+            memcpy(right, refs + left_count, sizeof(BvhReference) * right_count);
+        }
+        BvhNode* childs[2];
+        childs[0] = buildBvhFromReferences(builder, left, left_count);
+        free(left);
+        childs[1] = buildBvhFromReferences(builder, right, right_count);
+        free(right);
         return createBVHNode(bbox, childs, axis);
     }
 }
 
-BvhNode* buildBvh(int (*vert_indices)[3], Vec3* verts, int triangle_count) {
-    int* order = (int*)malloc(sizeof(int) * triangle_count);
+static BvhNode* createDeferredNode(BvhBuilder* builder, const BvhReference* refs, int count, int axis) {
+    DeferredSubtree* ret = (DeferredSubtree*)malloc(sizeof(DeferredSubtree));
+    ret->base.kind = BVH_NODE_DEFERRED;
+    ret->base.bounds = emptyBounds();
+    for (int i = 0; i < count; i++) {
+        growBounds(&ret->base.bounds, &refs[i].bounds);
+    }
+    atomic_init(&ret->subtree, NULL);
+    pthread_mutex_init(&ret->lock, NULL);
+    ret->builder = *builder;
+    ret->builder.lazy_count = 0;
+    // The subtree takes its share out of the remaining budget, so that all of the subtrees
+    // together split no more references than the eager build may
+    int share = (int)(builder->split_fraction * count);
+    if (share > builder->split_budget) {
+        share = builder->split_budget;
+    }
+    builder->split_budget -= share;
+    ret->builder.split_budget = share;
+    ret->axis = axis;
+    ret->refs = (BvhReference*)malloc(sizeof(BvhReference) * count);
+    memcpy(ret->refs, refs, sizeof(BvhReference) * count);
+    ret->count = count;
+    return (BvhNode*)ret;
+}
+
+static BvhNode* createDeferredTriangles(const int* ordering, int count, int (*vert_indices)[3], Vec3* verts, int axis) {
+    BvhBuilder builder = {
+        .vert_indices = vert_indices,
+        .verts = verts,
+        .midpoint = true,
+    };
+    BvhReference* refs = (BvhReference*)malloc(sizeof(BvhReference) * count);
+    for (int i = 0; i < count; i++) {
+        refs[i].triangle_id = ordering[i];
+        refs[i].bounds = emptyBounds();
+        for (int k = 0; k < 3; k++) {
+            growBoundsPoint(&refs[i].bounds, verts[vert_indices[ordering[i]][k]]);
+        }
+    }
+    BvhNode* ret = createDeferredNode(&builder, refs, count, axis);
+    free(refs);
+    return ret;
+}
+
+const BvhNode* expandDeferredBvh(const BvhNode* bvh) {
+    DeferredSubtree* deferred = (DeferredSubtree*)bvh;
+    BvhNode* subtree = atomic_load_explicit(&deferred->subtree, memory_order_acquire);
+    if (subtree == NULL) {
+        // Other threads entering the subtree wait for it instead of building it again
+        pthread_mutex_lock(&deferred->lock);
+        subtree = atomic_load_explicit(&deferred->subtree, memory_order_relaxed);
+        if (subtree == NULL) {
+            double start = beginTraceSpan();
+            if (deferred->builder.midpoint) {
+                int* order = (int*)malloc(sizeof(int) * deferred->count);
+                for (int i = 0; i < deferred->count; i++) {
+                    order[i] = deferred->refs[i].triangle_id;
+                }
+                subtree = buildBvhAlong(order, deferred->builder.vert_indices, deferred->builder.verts, 0, deferred->count, deferred->axis, 0);
+                free(order);
+            } else {
+                subtree = buildBvhFromReferences(&deferred->builder, deferred->refs, deferred->count);
+            }
+            atomic_store_explicit(&deferred->subtree, subtree, memory_order_release);
+            endTraceSpanArgs("expand lazy bvh", start, "triangles", deferred->count, NULL, 0);
+            free(deferred->refs);
+            deferred->refs = NULL;
+        }
+        pthread_mutex_unlock(&deferred->lock);
+    }
+    return subtree;
+}
+
+// Lazy trees are built down to subtrees of about 1 / LAZY_SUBTREES of the triangles, but of at
+// least LAZY_MIN_TRIANGLES
+#define LAZY_SUBTREES 1024
+#define LAZY_MIN_TRIANGLES 256
+
+static int lazySubtreeSize(int triangle_count) {
+    int size = triangle_count / LAZY_SUBTREES;
+    return size > LAZY_MIN_TRIANGLES ? size : LAZY_MIN_TRIANGLES;
+}
+
+BvhBuildSettings createDefaultBvhBuildSettings() {
+    BvhBuildSettings ret = {
+        .method = BVH_BUILD_MIDPOINT,
+        .split_budget = 0.3,
+        .numa_replicas = false,
+        .cluster_size = 0,
+        .reorder = false,
+        .lazy = false,
+    };
+    return ret;
+}
+
+BvhNode* buildBvh(int (*vert_indices)[3], Vec3* verts, int triangle_count, const BvhBuildSettings* settings) {
+    if (triangle_count == 0) {
+        return NULL;
+    } else if (settings->method == BVH_BUILD_MIDPOINT) {
+        int* order = (int*)malloc(sizeof(int) * triangle_count);
+        for (int i = 0; i < triangle_count; i++) {
+            order[i] = i;
+        }
+        BvhNode* ret = buildBvhAlong(order, vert_indices, verts, 0, triangle_count, 0, settings->lazy ? lazySubtreeSize(triangle_count) : 0);
+        free(order);
+        return ret;
+    } else {
+        BvhBuilder builder = {
+            .vert_indices = vert_indices,
+            .verts = verts,
+            .spatial_splits = settings->method == BVH_BUILD_SPATIAL,
+            .split_budget = (int)(settings->split_budget * triangle_count),
+            .lazy_count = settings->lazy ? lazySubtreeSize(triangle_count) : 0,
+            .split_fraction = settings->split_budget,
+        };
+        builder.primitives = NULL;
+        BoundingBox root = emptyBounds();
+        BvhReference* refs = (BvhReference*)malloc(sizeof(BvhReference) * triangle_count);
+        for (int i = 0; i < triangle_count; i++) {
+            refs[i].triangle_id = i;
+            refs[i].bounds = emptyBounds();
+            for (int k = 0; k < 3; k++) {
+                growBoundsPoint(&refs[i].bounds, verts[vert_indices[i][k]]);
+            }
+            growBounds(&root, &refs[i].bounds);
+        }
+        builder.root_area = boundsArea(&root);
+        BvhNode* ret = buildBvhFromReferences(&builder, refs, triangle_count);
+        free(refs);
+        return ret;
+    }
+}
+
+#define REFIT_TASK_DEPTH 8
+
+static void refitBvhNode(BvhNode* bvh, int (*vert_indices)[3], Vec3* verts, BoundingBox* bounds, int depth) {
+    switch (bvh->kind) {
+    case BVH_NODE_INTERNAL: {
+        BvhNodeInternal* inter = (BvhNodeInternal*)bvh;
+        BoundingBox child_bounds[2];
+        for (int i = 0; i < 2; i++) {
+#pragma omp task shared(child_bounds) if(depth < REFIT_TASK_DEPTH)
+            refitBvhNode(inter->children[i], vert_indices, verts, &child_bounds[i], depth + 1);
+        }
+#pragma omp taskwait
+        inter->bounds.bound[0] = minVec3(child_bounds[0].bound[0], child_bounds[1].bound[0]);
+        inter->bounds.bound[1] = maxVec3(child_bounds[0].bound[1], child_bounds[1].bound[1]);
+        *bounds = inter->bounds;
+    } break;
+    case BVH_NODE_TRIANGLE: {
+        BvhNodeTriangle* tri = (BvhNodeTriangle*)bvh;
+        bounds->bound[0] = createVec3(INFINITY, INFINITY, INFINITY);
+        bounds->bound[1] = createVec3(-INFINITY, -INFINITY, -INFINITY);
+        for (int k = 0; k < 3; k++) {
+            tri->verts[k] = verts[vert_indices[tri->triangle_id][k]];
+            bounds->bound[0] = minVec3(bounds->bound[0], tri->verts[k]);
+            bounds->bound[1] = maxVec3(bounds->bound[1], tri->verts[k]);
+        }
+    } break;
+    case BVH_NODE_DEFERRED: {
+        DeferredSubtree* deferred = (DeferredSubtree*)bvh;
+        deferred->builder.vert_indices = vert_indices;
+        deferred->builder.verts = verts;
+        BvhNode* subtree = atomic_load(&deferred->subtree);
+        if (subtree != NULL) {
+            refitBvhNode(subtree, vert_indices, verts, bounds, depth);
+        } else {
+            *bounds = emptyBounds();
+            for (int i = 0; i < deferred->count; i++) {
+                BvhReference* ref = &deferred->refs[i];
+                ref->bounds = emptyBounds();
+                for (int k = 0; k < 3; k++) {
+                    growBoundsPoint(&ref->bounds, verts[vert_indices[ref->triangle_id][k]]);
+                }
+                growBounds(bounds, &ref->bounds);
+            }
+        }
+        deferred->base.bounds = *bounds;
+    } break;
+    default:
+        // Primitives do not depend on the vertecies
+        *bounds = leafBounds(bvh);
+        break;
+    }
+}
+
+BvhNode* buildPrimitiveBvh(const Primitive* primitives, int count, int first_id) {
+    if (count == 0) {
+        return NULL;
+    } else {
+        BvhBuilder builder = {
+            .primitives = primitives,
+            .first_id = first_id,
+            .spatial_splits = false,
+            .split_budget = 0,
+        };
+        BoundingBox root = emptyBounds();
+        BvhReference* refs = (BvhReference*)malloc(sizeof(BvhReference) * count);
+        for (int i = 0; i < count; i++) {
+            refs[i].triangle_id = i;
+            refs[i].bounds = primitiveBounds(&primitives[i]);
+            growBounds(&root, &refs[i].bounds);
+        }
+        builder.root_area = boundsArea(&root);
+        BvhNode* ret = buildBvhFromReferences(&builder, refs, count);
+        free(refs);
+        return ret;
+    }
+}
+
+void refitBvh(BvhNode* bvh, int (*vert_indices)[3], Vec3* verts) {
+    if (bvh != NULL) {
+        BoundingBox bounds;
+#pragma omp parallel
+#pragma omp single
+        refitBvhNode(bvh, vert_indices, verts, &bounds, 0);
+    }
+}
+
+static void renumberBvhLeaves(BvhNode* bvh, int* new_ids, int* order, int* next_id) {
+    if (bvh->kind == BVH_NODE_INTERNAL) {
+        BvhNodeInternal* inter = (BvhNodeInternal*)bvh;
+        renumberBvhLeaves(inter->children[0], new_ids, order, next_id);
+        renumberBvhLeaves(inter->children[1], new_ids, order, next_id);
+    } else if (bvh->kind == BVH_NODE_TRIANGLE) {
+        BvhNodeTriangle* tri = (BvhNodeTriangle*)bvh;
+        if (new_ids[tri->triangle_id] < 0) {
+            new_ids[tri->triangle_id] = *next_id;
+            order[*next_id] = tri->triangle_id;
+            (*next_id)++;
+        }
+        tri->triangle_id = new_ids[tri->triangle_id];
+    }
+}
+
+void renumberBvhTriangles(BvhNode* bvh, int triangle_count, int* order) {
+    int* new_ids = (int*)malloc(sizeof(int) * triangle_count);
     for (int i = 0; i < triangle_count; i++) {
-        order[i] = i;
+        new_ids[i] = -1;
+    }
+    int next_id = 0;
+    if (bvh != NULL) {
+        renumberBvhLeaves(bvh, new_ids, order, &next_id);
+    }
+    // Triangles that are not in the tree keep their relative order at the end
+    for (int i = 0; i < triangle_count; i++) {
+        if (new_ids[i] < 0) {
+            order[next_id] = i;
+            next_id++;
+        }
+    }
+    free(new_ids);
+}
+
+#define SAH_TRAVERSAL_COST 1.0
+#define SAH_INTERSECTION_COST 1.0
+
+static float sumBvhCost(const BvhNode* bvh, float parent_area) {
+    switch (bvh->kind) {
+    case BVH_NODE_INTERNAL: {
+        BvhNodeInternal* inter = (BvhNodeInternal*)bvh;
+        float area = surfaceArea(&inter->bounds);
+        return area * SAH_TRAVERSAL_COST + sumBvhCost(inter->children[0], area) + sumBvhCost(inter->children[1], area);
+    } break;
+    case BVH_NODE_DEFERRED: {
+        DeferredSubtree* deferred = (DeferredSubtree*)bvh;
+        float area = surfaceArea(&deferred->base.bounds);
+        // Counted like a leaf over the bounds, whether the subtree is built yet or not. Otherwise
+        // the cost would depend on which subtrees rays happened to enter. Subtrees that are not
+        // built yet are built from the current triangles, so only the top of the tree is compared
+        // when deciding whether to rebuild.
+        return area * SAH_TRAVERSAL_COST + area * SAH_INTERSECTION_COST;
+    } break;
+    default:
+        // Leaves have no bounds of their own, they are tested whenever the parent is hit
+        return parent_area * SAH_INTERSECTION_COST;
+    }
+}
+
+float computeBvhCost(const BvhNode* bvh) {
+    if (bvh == NULL) {
+        return 0;
+    } else if (bvh->kind == BVH_NODE_INTERNAL) {
+        float root_area = surfaceArea(&((BvhNodeInternal*)bvh)->bounds);
+        return sumBvhCost(bvh, root_area) / root_area;
+    } else {
+        return SAH_INTERSECTION_COST;
+    }
+}
+
+BoundingBox getBvhBounds(const BvhNode* bvh) {
+    BoundingBox bounds = {
+        .bound = { createVec3(INFINITY, INFINITY, INFINITY), createVec3(-INFINITY, -INFINITY, -INFINITY) },
+    };
+    if (bvh != NULL) {
+        if (bvh->kind == BVH_NODE_INTERNAL) {
+            bounds = ((BvhNodeInternal*)bvh)->bounds;
+        } else if (bvh->kind == BVH_NODE_DEFERRED) {
+            bounds = ((BvhNodeDeferred*)bvh)->bounds;
+        } else {
+            bounds = leafBounds(bvh);
+        }
+    }
+    return bounds;
+}
+
+static size_t nodeSize(BvhNodeKind kind) {
+    switch (kind) {
+    case BVH_NODE_INTERNAL:
+        return sizeof(BvhNodeInternal);
+    case BVH_NODE_SPHERE:
+        return sizeof(BvhNodeSphere);
+    case BVH_NODE_DISK:
+        return sizeof(BvhNodeDisk);
+    case BVH_NODE_QUAD:
+        return sizeof(BvhNodeQuad);
+    case BVH_NODE_DEFERRED:
+        return sizeof(DeferredSubtree);
+    default:
+        return sizeof(BvhNodeTriangle);
+    }
+}
+
+static void sumBvhStats(const BvhNode* bvh, int depth, BvhStats* stats, double* node_area, double* overlap_area, long* depth_sum) {
+    stats->memory_bytes += nodeSize(bvh->kind);
+    if (bvh->kind == BVH_NODE_DEFERRED) {
+        DeferredSubtree* deferred = (DeferredSubtree*)bvh;
+        BvhNode* subtree = atomic_load(&deferred->subtree);
+        if (subtree != NULL) {
+            sumBvhStats(subtree, depth, stats, node_area, overlap_area, depth_sum);
+        } else {
+            stats->deferred_subtrees++;
+            stats->memory_bytes += sizeof(BvhReference) * deferred->count;
+        }
+        return;
+    }
+    if (depth > stats->max_depth) {
+        stats->max_depth = depth;
+    }
+    if (bvh->kind == BVH_NODE_INTERNAL) {
+        BvhNodeInternal* inter = (BvhNodeInternal*)bvh;
+        // Leaves of spatial splits reach out of their parent, but only the part inside is ever tested
+        BoundingBox overlap = inter->bounds;
+        for (int k = 0; k < 2; k++) {
+            BoundingBox child = getBvhBounds(inter->children[k]);
+            overlap.bound[0] = maxVec3(overlap.bound[0], child.bound[0]);
+            overlap.bound[1] = minVec3(overlap.bound[1], child.bound[1]);
+        }
+        stats->internal_nodes++;
+        *node_area += surfaceArea(&inter->bounds);
+        *overlap_area += boundsArea(&overlap);
+        for (int k = 0; k < 2; k++) {
+            sumBvhStats(inter->children[k], depth + 1, stats, node_area, overlap_area, depth_sum);
+        }
+    } else {
+        stats->leaves++;
+        stats->leaf_depths[depth < BVH_STATS_DEPTHS ? depth : BVH_STATS_DEPTHS - 1]++;
+        *depth_sum += depth;
+    }
+}
+
+void computeBvhStats(const BvhNode* bvh, BvhStats* stats) {
+    memset(stats, 0, sizeof(BvhStats));
+    if (bvh != NULL) {
+        double node_area = 0;
+        double overlap_area = 0;
+        long depth_sum = 0;
+        sumBvhStats(bvh, 0, stats, &node_area, &overlap_area, &depth_sum);
+        stats->sah_cost = computeBvhCost(bvh);
+        stats->average_leaf_depth = stats->leaves > 0 ? depth_sum / (float)stats->leaves : 0;
+        stats->overlap_ratio = node_area > 0 ? overlap_area / node_area : 0;
+    }
+}
+
+// Nodes in the compact copy are aligned so that the pointers of internal nodes stay aligned
+static size_t compactNodeSize(BvhNodeKind kind) {
+    return (nodeSize(kind) + 15) / 16 * 16;
+}
+
+static size_t compactBvhSize(const BvhNode* bvh) {
+    if (bvh->kind == BVH_NODE_INTERNAL) {
+        BvhNodeInternal* inter = (BvhNodeInternal*)bvh;
+        return compactNodeSize(BVH_NODE_INTERNAL) + compactBvhSize(inter->children[0]) + compactBvhSize(inter->children[1]);
+    } else {
+        return compactNodeSize(bvh->kind);
+    }
+}
+
+static BvhNode* copyBvhInto(const BvhNode* bvh, char** memory) {
+    BvhNode* ret = (BvhNode*)*memory;
+    if (bvh->kind == BVH_NODE_INTERNAL) {
+        BvhNodeInternal* inter = (BvhNodeInternal*)ret;
+        *inter = *(BvhNodeInternal*)bvh;
+        *memory += compactNodeSize(BVH_NODE_INTERNAL);
+        for (int i = 0; i < 2; i++) {
+            inter->children[i] = copyBvhInto(((BvhNodeInternal*)bvh)->children[i], memory);
+        }
+    } else {
+        memcpy(ret, bvh, nodeSize(bvh->kind));
+        *memory += compactNodeSize(bvh->kind);
     }
-    BvhNode* ret = buildBvhAlong(order, vert_indices, verts, 0, triangle_count, 0);
-    free(order);
     return ret;
 }
 
+BvhNode* copyBvhCompact(const BvhNode* bvh) {
+    if (bvh == NULL) {
+        return NULL;
+    } else {
+        char* memory = (char*)allocateLarge(compactBvhSize(bvh));
+        return copyBvhInto(bvh, &memory);
+    }
+}
+
+char* serializeBvh(const BvhNode* bvh, size_t* size) {
+    *size = compactBvhSize(bvh);
+    char* memory = (char*)malloc(*size);
+    char* next = memory;
+    copyBvhInto(bvh, &next);
+    // Replace the child pointers by offsets, the nodes are already in the order they were copied
+    for (char* node = memory; node < next;) {
+        if (((BvhNode*)node)->kind == BVH_NODE_INTERNAL) {
+            BvhNodeInternal* inter = (BvhNodeInternal*)node;
+            for (int i = 0; i < 2; i++) {
+                inter->children[i] = (BvhNode*)((char*)inter->children[i] - memory);
+            }
+            node += compactNodeSize(BVH_NODE_INTERNAL);
+        } else {
+            node += compactNodeSize(((BvhNode*)node)->kind);
+        }
+    }
+    return memory;
+}
+
+BvhNode* relocateBvh(char* memory, size_t size) {
+    for (char* node = memory; node < memory + size;) {
+        if (((BvhNode*)node)->kind == BVH_NODE_INTERNAL) {
+            BvhNodeInternal* inter = (BvhNodeInternal*)node;
+            for (int i = 0; i < 2; i++) {
+                inter->children[i] = (BvhNode*)(memory + (size_t)inter->children[i]);
+            }
+            node += compactNodeSize(BVH_NODE_INTERNAL);
+        } else {
+            node += compactNodeSize(((BvhNode*)node)->kind);
+        }
+    }
+    return (BvhNode*)memory;
+}
+
 void freeBvh(BvhNode* bvh) {
     if (bvh != NULL) {
         switch (bvh->kind) {
@@ -137,6 +1019,12 @@ void freeBvh(BvhNode* bvh) {
             freeBvh(inter->children[0]);
             freeBvh(inter->children[1]);
         } break;
+        case BVH_NODE_DEFERRED: {
+            DeferredSubtree* deferred = (DeferredSubtree*)bvh;
+            freeBvh(atomic_load(&deferred->subtree));
+            pthread_mutex_destroy(&deferred->lock);
+            free(deferred->refs);
+        } break;
         default:
             break;
         }
@@ -1,11 +1,18 @@
 #ifndef _BVH_H_
 #define _BVH_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "vec.h"
 
 typedef enum {
     BVH_NODE_INTERNAL,
     BVH_NODE_TRIANGLE,
+    BVH_NODE_SPHERE,
+    BVH_NODE_DISK,
+    BVH_NODE_QUAD,
+    BVH_NODE_DEFERRED,
 } BvhNodeKind;
 
 #define BVH_NODE_BASE BvhNodeKind kind;
@@ -31,7 +38,136 @@ typedef struct {
     Vec3 verts[3];
 } BvhNodeTriangle;
 
-BvhNode* buildBvh(int (*vert_indices)[3], Vec3* verts, int triangle_count);
+// Leaves of analytic primitives. The hits report the primitive id in place of the triangle id, and
+// the parameters of the hit point on the surface in place of the barycentric coordinates.
+
+typedef struct {
+    BVH_NODE_BASE
+    int primitive_id;
+    Vec3 center;
+    float radius;
+} BvhNodeSphere;
+
+// Elliptic disk with the edges as its half axes, they are orthogonal and of equal length for a
+// circular disk. Hits have u^2 + v^2 <= 1.
+typedef struct {
+    BVH_NODE_BASE
+    int primitive_id;
+    Vec3 center;
+    Vec3 normal;
+    Vec3 edges[2];
+} BvhNodeDisk;
+
+// Parallelogram spanned by the edges starting at the corner. Hits have u and v between 0 and 1.
+typedef struct {
+    BVH_NODE_BASE
+    int primitive_id;
+    Vec3 corner;
+    Vec3 edges[2];
+} BvhNodeQuad;
+
+// Subtree of a lazily built tree, which is only built once a ray enters its bounds. The rest of
+// the node is private to the builder.
+typedef struct {
+    BVH_NODE_BASE
+    BoundingBox bounds;
+} BvhNodeDeferred;
+
+// Description of an analytic primitive, kind is one of the primitive leaf kinds
+typedef struct {
+    BvhNodeKind kind;
+    // Center of a sphere or disk, corner of a quad
+    Vec3 position;
+    // Edges of a disk or quad
+    Vec3 edges[2];
+    // Radius of a sphere
+    float radius;
+} Primitive;
+
+typedef enum {
+    // Split at the center of the bounds, alternating the axis (fast to build)
+    BVH_BUILD_MIDPOINT,
+    // Binned surface area heuristic over the triangle centers
+    BVH_BUILD_SAH,
+    // Surface area heuristic that may also split triangles at a spatial plane (SBVH), which
+    // reduces the overlap of siblings for long and thin triangles
+    BVH_BUILD_SPATIAL,
+} BvhBuildMethod;
+
+typedef struct {
+    BvhBuildMethod method;
+    // Additional triangle references spatial splits may create, relative to the triangle count
+    float split_budget;
+    // Keep a copy of the tree on every numa node, used together with thread pinning
+    bool numa_replicas;
+    // If not zero, the scene is split into spatial clusters of about this many triangles that are
+    // paged in from disk on demand instead of keeping the whole scene in memory
+    int cluster_size;
+    // Store the triangles, vertecies and normals of the scene in the order of the bvh leaves, so
+    // that hits close to each other are shaded from memory close to each other
+    bool reorder;
+    // Build only the top levels of the tree when the scene is loaded, and every subtree below
+    // them the first time a ray enters it. Lazy trees are neither replicated nor reordered.
+    bool lazy;
+} BvhBuildSettings;
+
+BvhBuildSettings createDefaultBvhBuildSettings();
+
+BvhNode* buildBvh(int (*vert_indices)[3], Vec3* verts, int triangle_count, const BvhBuildSettings* settings);
+
+// Tree over analytic primitives, built using the surface area heuristic. The primitives get the
+// ids first_id + index, so that they can share the id space with the triangles of a scene.
+BvhNode* buildPrimitiveBvh(const Primitive* primitives, int count, int first_id);
+
+// The subtree of a deferred node, which is built by the first call. Thread safe.
+const BvhNode* expandDeferredBvh(const BvhNode* bvh);
+
+// Update the bounds of an existing tree after the vertecies moved, keeping its structure
+void refitBvh(BvhNode* bvh, int (*vert_indices)[3], Vec3* verts);
+
+// Renumber the triangles in the order of the leaves from left to right. order receives the old id
+// of every new one. Triangles referenced by more than one leaf get the place of the first one.
+void renumberBvhTriangles(BvhNode* bvh, int triangle_count, int* order);
+
+// Surface area heuristic cost of the tree, used to judge its quality
+float computeBvhCost(const BvhNode* bvh);
+
+#define BVH_STATS_DEPTHS 64
+
+// Measures of the quality of a tree, for diagnostics
+typedef struct {
+    float sah_cost;
+    int internal_nodes;
+    // Every leaf holds a single triangle or primitive, so with spatial splits there are more
+    // leaves than triangles
+    int leaves;
+    // Subtrees of a lazy tree that were not built yet, they are not part of the other counts
+    int deferred_subtrees;
+    int max_depth;
+    float average_leaf_depth;
+    // Number of leaves at each depth, the last entry also counts the deeper ones
+    int leaf_depths[BVH_STATS_DEPTHS];
+    // Surface area of the overlap of the children of all internal nodes, relative to the surface
+    // area of the internal nodes
+    float overlap_ratio;
+    size_t memory_bytes;
+} BvhStats;
+
+void computeBvhStats(const BvhNode* bvh, BvhStats* stats);
+
+// Bounds of everything contained in the tree
+BoundingBox getBvhBounds(const BvhNode* bvh);
+
+// Copy the tree into a single allocation made by the calling thread, so that with first touch
+// placement all of its nodes are on the numa node of that thread. Free with free(), not freeBvh().
+BvhNode* copyBvhCompact(const BvhNode* bvh);
+
+// Store the tree in a single buffer of the returned size, with the children given as offsets
+// into the buffer instead of pointers, e.g. to write it to a file. Free with free().
+char* serializeBvh(const BvhNode* bvh, size_t* size);
+
+// Turn a buffer written by serializeBvh back into a tree, in place. Free the buffer, not the tree.
+BvhNode* relocateBvh(char* memory, size_t size);
 
 void freeBvh(BvhNode* bvh);
 
@@ -0,0 +1,156 @@
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "emitters.h"
+
+struct EmitterList {
+    // Triangle id of every emitter, primitives use the ids following the triangles
+    int* ids;
+    float* areas;
+    // Running sum of the power of the emitters, the last entry is the total power
+    float* cdf;
+    int count;
+};
+
+static float emitterPower(const MaterialProperties* material, float area) {
+    Color emission = material->emission_color;
+    return area * (emission.x + emission.y + emission.z) / 3;
+}
+
+static float primitiveArea(const Primitive* primitive) {
+    switch (primitive->kind) {
+    case BVH_NODE_SPHERE:
+        return 4 * PI * primitive->radius * primitive->radius;
+    case BVH_NODE_DISK:
+        return PI * magnitudeVec3(crossVec3(primitive->edges[0], primitive->edges[1]));
+    default:
+        return magnitudeVec3(crossVec3(primitive->edges[0], primitive->edges[1]));
+    }
+}
+
+static void addEmitter(EmitterList* emitters, int* capacity, int id, float area, float power) {
+    if (emitters->count == *capacity) {
+        *capacity = 2 * *capacity + 16;
+        emitters->ids = (int*)realloc(emitters->ids, sizeof(int) * *capacity);
+        emitters->areas = (float*)realloc(emitters->areas, sizeof(float) * *capacity);
+        emitters->cdf = (float*)realloc(emitters->cdf, sizeof(float) * *capacity);
+    }
+    float total = emitters->count > 0 ? emitters->cdf[emitters->count - 1] : 0;
+    emitters->ids[emitters->count] = id;
+    emitters->areas[emitters->count] = area;
+    emitters->cdf[emitters->count] = total + power;
+    emitters->count++;
+}
+
+EmitterList* createEmitterList(const Scene* scene) {
+    EmitterList* emitters = (EmitterList*)malloc(sizeof(EmitterList));
+    emitters->ids = NULL;
+    emitters->areas = NULL;
+    emitters->cdf = NULL;
+    emitters->count = 0;
+    int capacity = 0;
+    if (scene->paged == NULL) {
+        for (int i = 0; i < scene->triangle_count; i++) {
+            const MaterialProperties* material = &scene->objects[scene->object_ids[i]].material;
+            if (!isVec3Null(material->emission_color)) {
+                Vec3 vert0 = scene->vertecies[scene->vertex_indices[i][0]];
+                Vec3 vert1 = scene->vertecies[scene->vertex_indices[i][1]];
+                Vec3 vert2 = scene->vertecies[scene->vertex_indices[i][2]];
+                float area = magnitudeVec3(crossVec3(subVec3(vert1, vert0), subVec3(vert2, vert0))) / 2;
+                float power = emitterPower(material, area);
+                if (power > 0) {
+                    addEmitter(emitters, &capacity, i, area, power);
+                }
+            }
+        }
+    }
+    for (int i = 0; i < scene->primitive_count; i++) {
+        const MaterialProperties* material = &scene->primitive_materials[i];
+        if (!isVec3Null(material->emission_color)) {
+            float area = primitiveArea(&scene->primitives[i]);
+            float power = emitterPower(material, area);
+            if (power > 0) {
+                addEmitter(emitters, &capacity, scene->triangle_count + i, area, power);
+            }
+        }
+    }
+    return emitters;
+}
+
+void freeEmitterList(EmitterList* emitters) {
+    if (emitters != NULL) {
+        free(emitters->ids);
+        free(emitters->areas);
+        free(emitters->cdf);
+        free(emitters);
+    }
+}
+
+bool containsEmitter(const EmitterList* emitters, int id) {
+    // The emitters are added in the order of their ids
+    int low = 0;
+    int high = emitters->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (emitters->ids[mid] < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < emitters->count && emitters->ids[low] == id;
+}
+
+// Surface parameters of a uniformly distributed point, in the form computed by the intersection
+static void samplePrimitiveParameters(const Primitive* primitive, float u0, float u1, float* u, float* v) {
+    switch (primitive->kind) {
+    case BVH_NODE_SPHERE:
+        // The sine of the latitude is uniformly distributed over the sphere
+        *u = u0;
+        *v = 0.5 + asinf(1 - 2 * u1) / PI;
+        break;
+    case BVH_NODE_DISK: {
+        float radius = sqrtf(u0);
+        *u = radius * cosf(2 * PI * u1);
+        *v = radius * sinf(2 * PI * u1);
+    } break;
+    default:
+        *u = u0;
+        *v = u1;
+        break;
+    }
+}
+
+bool sampleEmitter(
+    const EmitterList* emitters, const Scene* scene, float u_emitter, float u0, float u1, SurfacePoint* out, float* pdf
+) {
+    if (emitters->count == 0) {
+        return false;
+    }
+    float total = emitters->cdf[emitters->count - 1];
+    float target = u_emitter * total;
+    int low = 0;
+    int high = emitters->count - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (emitters->cdf[mid] > target) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    float power = emitters->cdf[low] - (low > 0 ? emitters->cdf[low - 1] : 0);
+    int id = emitters->ids[low];
+    float u, v;
+    if (id < scene->triangle_count) {
+        float root = sqrtf(u0);
+        u = 1 - root;
+        v = u1 * root;
+    } else {
+        samplePrimitiveParameters(&scene->primitives[id - scene->triangle_count], u0, u1, &u, &v);
+    }
+    getSurfacePoint(scene, id, u, v, 0, out);
+    *pdf = power / (total * emitters->areas[low]);
+    return true;
+}
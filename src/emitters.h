@@ -0,0 +1,26 @@
+#ifndef _EMITTERS_H_
+#define _EMITTERS_H_
+
+#include <stdbool.h>
+
+#include "scene.h"
+
+// The emitting triangles and primitives of a scene, for integrators that start paths on the
+// lights. The triangles of out-of-core scenes are not in memory and are left out.
+typedef struct EmitterList EmitterList;
+
+EmitterList* createEmitterList(const Scene* scene);
+
+void freeEmitterList(EmitterList* emitters);
+
+// Whether paths starting on the lights can start on the triangle or primitive (with an id
+// following the triangles)
+bool containsEmitter(const EmitterList* emitters, int id);
+
+// Pick an emitter proportional to its power and a uniformly distributed point on it, with its
+// textures applied. pdf is per unit area. Returns false if the scene emits no light.
+bool sampleEmitter(
+    const EmitterList* emitters, const Scene* scene, float u_emitter, float u0, float u1, SurfacePoint* out, float* pdf
+);
+
+#endif
@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "guiding.h"
+
+// Quadrants that received more than this fraction of the energy of their tree are subdivided
+#define SUBDIVISION_FRACTION 0.01
+#define MAX_DIRECTION_DEPTH 20
+// Regions that recorded more than this many samples times the square root of the number of
+// passes since the last update are split in half
+#define SPLIT_THRESHOLD 12000
+#define MAX_SPATIAL_DEPTH 48
+
+// Directions are mapped to the unit square using the area preserving cylindrical projection,
+// x is (cos(theta) + 1) / 2 and y is phi / (2 pi). Quadrant q covers the half x >= 0.5 if bit 0
+// is set and the half y >= 0.5 if bit 1 is set.
+typedef struct {
+    float sums[4];
+    // Node subdividing each quadrant, 0 if the quadrant is not subdivided
+    int children[4];
+} DirectionNode;
+
+typedef struct {
+    DirectionNode* nodes;
+    int count;
+    int capacity;
+} DirectionTree;
+
+typedef struct {
+    DirectionTree sampling;
+    DirectionTree recording;
+    int samples;
+} GuideRegion;
+
+typedef struct {
+    // Children of inner nodes, 0 for leaves
+    int children[2];
+    int axis;
+    int depth;
+    // Region of a leaf
+    int region;
+} SpatialNode;
+
+struct PathGuide {
+    BoundingBox bounds;
+    SpatialNode* nodes;
+    int node_count;
+    int node_capacity;
+    GuideRegion* regions;
+    int region_count;
+    int region_capacity;
+};
+
+static int addDirectionNode(DirectionTree* tree) {
+    if (tree->count == tree->capacity) {
+        tree->capacity *= 2;
+        tree->nodes = (DirectionNode*)realloc(tree->nodes, sizeof(DirectionNode) * tree->capacity);
+    }
+    memset(&tree->nodes[tree->count], 0, sizeof(DirectionNode));
+    tree->count++;
+    return tree->count - 1;
+}
+
+static void initDirectionTree(DirectionTree* tree) {
+    tree->count = 0;
+    tree->capacity = 16;
+    tree->nodes = (DirectionNode*)malloc(sizeof(DirectionNode) * tree->capacity);
+    addDirectionNode(tree);
+}
+
+static void copyDirectionTree(DirectionTree* dst, const DirectionTree* src) {
+    dst->count = src->count;
+    dst->capacity = src->capacity;
+    dst->nodes = (DirectionNode*)malloc(sizeof(DirectionNode) * src->capacity);
+    memcpy(dst->nodes, src->nodes, sizeof(DirectionNode) * src->count);
+}
+
+static void freeDirectionTree(DirectionTree* tree) {
+    free(tree->nodes);
+}
+
+static float nodeTotal(const DirectionNode* node) {
+    return node->sums[0] + node->sums[1] + node->sums[2] + node->sums[3];
+}
+
+static void directionToSquare(Vec3 direction, float* x, float* y) {
+    *x = fminf(fmaxf((direction.z + 1) / 2, 0), 1);
+    float phi = atan2f(direction.y, direction.x);
+    if (phi < 0) {
+        phi += 2 * PI;
+    }
+    *y = fminf(fmaxf(phi / (2 * PI), 0), 1);
+}
+
+static Vec3 squareToDirection(float x, float y) {
+    float cos_theta = 2 * x - 1;
+    float sin_theta = sqrtf(fmaxf(0, 1 - cos_theta * cos_theta));
+    float phi = 2 * PI * y;
+    return createVec3(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+}
+
+// Select the quadrant containing the point and move the point into the coordinates of it
+static int enterQuadrant(float* x, float* y) {
+    int qx = *x >= 0.5;
+    int qy = *y >= 0.5;
+    *x = 2 * *x - qx;
+    *y = 2 * *y - qy;
+    return qx + 2 * qy;
+}
+
+static void recordDirection(DirectionTree* tree, float x, float y, float value) {
+    int node = 0;
+    for (;;) {
+        int quadrant = enterQuadrant(&x, &y);
+#pragma omp atomic
+        tree->nodes[node].sums[quadrant] += value;
+        node = tree->nodes[node].children[quadrant];
+        if (node == 0) {
+            break;
+        }
+    }
+}
+
+// Density of the distribution over the unit square
+static float squarePdf(const DirectionTree* tree, float x, float y) {
+    float pdf = 1;
+    int node = 0;
+    for (;;) {
+        const DirectionNode* current = &tree->nodes[node];
+        float total = nodeTotal(current);
+        int quadrant = enterQuadrant(&x, &y);
+        if (total <= 0 || current->sums[quadrant] <= 0) {
+            return 0;
+        }
+        pdf *= 4 * current->sums[quadrant] / total;
+        node = current->children[quadrant];
+        if (node == 0) {
+            return pdf;
+        }
+    }
+}
+
+// Choose one of two halves proportional to their weights, rescaling the random number
+static int chooseHalf(float first, float second, float* u) {
+    float split = first / (first + second);
+    if (*u < split) {
+        *u = *u / split;
+        return 0;
+    } else {
+        *u = fminf((*u - split) / (1 - split), 0.99999994);
+        return 1;
+    }
+}
+
+static void sampleSquare(const DirectionTree* tree, float u0, float u1, float* x, float* y, float* pdf) {
+    float origin_x = 0;
+    float origin_y = 0;
+    float size = 1;
+    *pdf = 1;
+    int node = 0;
+    for (;;) {
+        const DirectionNode* current = &tree->nodes[node];
+        float total = nodeTotal(current);
+        if (total <= 0) {
+            break;
+        }
+        int qx = chooseHalf(current->sums[0] + current->sums[2], current->sums[1] + current->sums[3], &u0);
+        int qy = chooseHalf(current->sums[qx], current->sums[qx + 2], &u1);
+        int quadrant = qx + 2 * qy;
+        *pdf *= 4 * current->sums[quadrant] / total;
+        size /= 2;
+        origin_x += qx * size;
+        origin_y += qy * size;
+        node = current->children[quadrant];
+        if (node == 0) {
+            break;
+        }
+    }
+    *x = origin_x + u0 * size;
+    *y = origin_y + u1 * size;
+}
+
+// Subdivide the quadrants of out_node that got enough of the energy in the tree. node is the
+// matching node of the tree, or -1 if the tree is not subdivided this deep.
+static void refineDirectionNode(
+    DirectionTree* out, int out_node, const DirectionTree* tree, int node, const float energy[4], float total, int depth
+) {
+    for (int q = 0; q < 4; q++) {
+        if (depth < MAX_DIRECTION_DEPTH && energy[q] > SUBDIVISION_FRACTION * total) {
+            int child = addDirectionNode(out);
+            out->nodes[out_node].children[q] = child;
+            int tree_child = node >= 0 && tree->nodes[node].children[q] != 0 ? tree->nodes[node].children[q] : -1;
+            float child_energy[4];
+            for (int k = 0; k < 4; k++) {
+                // Without a finer subdivision the energy is assumed to be spread evenly
+                child_energy[k] = tree_child >= 0 ? tree->nodes[tree_child].sums[k] : energy[q] / 4;
+            }
+            refineDirectionNode(out, child, tree, tree_child, child_energy, total, depth + 1);
+        }
+    }
+}
+
+// An empty tree with a structure adapted to the energy recorded in tree
+static void refineDirectionTree(DirectionTree* out, const DirectionTree* tree) {
+    float total = nodeTotal(&tree->nodes[0]);
+    if (total > 0) {
+        initDirectionTree(out);
+        refineDirectionNode(out, 0, tree, 0, tree->nodes[0].sums, total, 1);
+    } else {
+        // Nothing was learned, keep the current structure
+        copyDirectionTree(out, tree);
+        for (int i = 0; i < out->count; i++) {
+            for (int q = 0; q < 4; q++) {
+                out->nodes[i].sums[q] = 0;
+            }
+        }
+    }
+}
+
+static int addSpatialNode(PathGuide* guide, int axis, int depth, int region) {
+    if (guide->node_count == guide->node_capacity) {
+        guide->node_capacity *= 2;
+        guide->nodes = (SpatialNode*)realloc(guide->nodes, sizeof(SpatialNode) * guide->node_capacity);
+    }
+    SpatialNode* node = &guide->nodes[guide->node_count];
+    node->children[0] = 0;
+    node->children[1] = 0;
+    node->axis = axis;
+    node->depth = depth;
+    node->region = region;
+    guide->node_count++;
+    return guide->node_count - 1;
+}
+
+static int addRegion(PathGuide* guide) {
+    if (guide->region_count == guide->region_capacity) {
+        guide->region_capacity *= 2;
+        guide->regions = (GuideRegion*)realloc(guide->regions, sizeof(GuideRegion) * guide->region_capacity);
+    }
+    guide->region_count++;
+    return guide->region_count - 1;
+}
+
+PathGuide* createPathGuide(BoundingBox bounds) {
+    PathGuide* guide = (PathGuide*)malloc(sizeof(PathGuide));
+    guide->bounds = bounds;
+    guide->node_count = 0;
+    guide->node_capacity = 16;
+    guide->nodes = (SpatialNode*)malloc(sizeof(SpatialNode) * guide->node_capacity);
+    guide->region_count = 0;
+    guide->region_capacity = 16;
+    guide->regions = (GuideRegion*)malloc(sizeof(GuideRegion) * guide->region_capacity);
+    int region = addRegion(guide);
+    initDirectionTree(&guide->regions[region].sampling);
+    initDirectionTree(&guide->regions[region].recording);
+    guide->regions[region].samples = 0;
+    Vec3 size = subVec3(bounds.bound[1], bounds.bound[0]);
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+    addSpatialNode(guide, axis, 0, region);
+    return guide;
+}
+
+void freePathGuide(PathGuide* guide) {
+    if (guide != NULL) {
+        for (int i = 0; i < guide->region_count; i++) {
+            freeDirectionTree(&guide->regions[i].sampling);
+            freeDirectionTree(&guide->regions[i].recording);
+        }
+        free(guide->regions);
+        free(guide->nodes);
+        free(guide);
+    }
+}
+
+int getGuideRegion(const PathGuide* guide, Vec3 position) {
+    BoundingBox box = guide->bounds;
+    int node = 0;
+    while (guide->nodes[node].children[0] != 0) {
+        int axis = guide->nodes[node].axis;
+        float middle = (box.bound[0].v[axis] + box.bound[1].v[axis]) / 2;
+        if (position.v[axis] < middle) {
+            box.bound[1].v[axis] = middle;
+            node = guide->nodes[node].children[0];
+        } else {
+            box.bound[0].v[axis] = middle;
+            node = guide->nodes[node].children[1];
+        }
+    }
+    return guide->nodes[node].region;
+}
+
+bool isGuideRegionTrained(const PathGuide* guide, int region) {
+    return nodeTotal(&guide->regions[region].sampling.nodes[0]) > 0;
+}
+
+Vec3 sampleGuideDirection(const PathGuide* guide, int region, float u0, float u1, float* pdf) {
+    float x, y;
+    sampleSquare(&guide->regions[region].sampling, u0, u1, &x, &y, pdf);
+    *pdf /= 4 * PI;
+    return squareToDirection(x, y);
+}
+
+float guideDirectionPdf(const PathGuide* guide, int region, Vec3 direction) {
+    float x, y;
+    directionToSquare(direction, &x, &y);
+    return squarePdf(&guide->regions[region].sampling, x, y) / (4 * PI);
+}
+
+void recordGuideRadiance(PathGuide* guide, int region, Vec3 direction, float radiance) {
+    if (radiance > 0 && isfinite(radiance)) {
+        float x, y;
+        directionToSquare(direction, &x, &y);
+        recordDirection(&guide->regions[region].recording, x, y, radiance);
+    }
+#pragma omp atomic
+    guide->regions[region].samples++;
+}
+
+// Split the leaf until each leaf is expected to receive at most threshold samples. Both halves
+// start out with the distributions of the leaf.
+static void splitSpatialNode(PathGuide* guide, int node, int samples, float threshold) {
+    if (samples > threshold && guide->nodes[node].depth < MAX_SPATIAL_DEPTH) {
+        int region = guide->nodes[node].region;
+        int other = addRegion(guide);
+        copyDirectionTree(&guide->regions[other].sampling, &guide->regions[region].sampling);
+        copyDirectionTree(&guide->regions[other].recording, &guide->regions[region].recording);
+        guide->regions[other].samples = 0;
+        int axis = (guide->nodes[node].axis + 1) % 3;
+        int depth = guide->nodes[node].depth + 1;
+        int children[2];
+        children[0] = addSpatialNode(guide, axis, depth, region);
+        children[1] = addSpatialNode(guide, axis, depth, other);
+        guide->nodes[node].children[0] = children[0];
+        guide->nodes[node].children[1] = children[1];
+        guide->nodes[node].region = -1;
+        for (int k = 0; k < 2; k++) {
+            splitSpatialNode(guide, children[k], samples / 2, threshold);
+        }
+    }
+}
+
+void updatePathGuide(PathGuide* guide, int passes) {
+    float threshold = SPLIT_THRESHOLD * sqrtf(passes);
+    int node_count = guide->node_count;
+    for (int i = 0; i < node_count; i++) {
+        if (guide->nodes[i].children[0] == 0) {
+            splitSpatialNode(guide, i, guide->regions[guide->nodes[i].region].samples, threshold);
+        }
+    }
+    for (int i = 0; i < guide->region_count; i++) {
+        GuideRegion* region = &guide->regions[i];
+        DirectionTree next;
+        refineDirectionTree(&next, &region->recording);
+        if (nodeTotal(&region->recording.nodes[0]) > 0) {
+            freeDirectionTree(&region->sampling);
+            region->sampling = region->recording;
+        } else {
+            // Keep sampling what was learned before if nothing new arrived
+            freeDirectionTree(&region->recording);
+        }
+        region->recording = next;
+        region->samples = 0;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef _GUIDING_H_
+#define _GUIDING_H_
+
+#include <stdbool.h>
+
+#include "vec.h"
+#include "intersection.h"
+
+// Path guiding with a spatial-directional tree. A kd-tree over the scene splits space into
+// regions, and every region has a quadtree over the sphere of directions that learns where the
+// incident radiance comes from. Each region holds two quadtrees: one filled with the radiance
+// recorded since the last update and the one learned before that is sampled from. On an update
+// the recorded one replaces the sampled one and the trees are refined where they received many
+// samples or much energy. As in the SD-tree of Müller et al., each update should
+// be given about twice as many samples as the one before, to make up for the finer trees.
+typedef struct PathGuide PathGuide;
+
+PathGuide* createPathGuide(BoundingBox bounds);
+
+void freePathGuide(PathGuide* guide);
+
+// Index of the region containing the position
+int getGuideRegion(const PathGuide* guide, Vec3 position);
+
+// Whether the region learned a distribution that can be sampled from
+bool isGuideRegionTrained(const PathGuide* guide, int region);
+
+// Sample a direction from the learned distribution of the region, pdf is per solid angle
+Vec3 sampleGuideDirection(const PathGuide* guide, int region, float u0, float u1, float* pdf);
+
+float guideDirectionPdf(const PathGuide* guide, int region, Vec3 direction);
+
+// Record the radiance arriving in the region from the direction, already divided by the pdf of
+// the sampled direction. Thread safe, but may not run at the same time as updatePathGuide.
+void recordGuideRadiance(PathGuide* guide, int region, Vec3 direction, float radiance);
+
+// Start sampling from the radiance recorded since the last update, and refine the trees. passes
+// is the number of rendering passes that were recorded since then.
+void updatePathGuide(PathGuide* guide, int passes);
+
+#endif
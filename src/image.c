@@ -0,0 +1,289 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+
+#include "image.h"
+#include "trace.h"
+
+PngSettings createDefaultPngSettings() {
+    PngSettings ret = {
+        .compression_level = 6,
+        .filter = PNG_ROW_FILTER_PAETH,
+    };
+    return ret;
+}
+
+bool parsePngRowFilter(const char* name, PngRowFilter* filter) {
+    static const char* names[] = { "none", "sub", "up", "average", "paeth" };
+    for (int i = 0; i < 5; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *filter = (PngRowFilter)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Values at or above threshold[k] map to at least k, i.e. threshold[k] = (k / 256)^2 / scale. This
+// gives the same result as 256 * sqrt(value * scale) without any square root per pixel.
+static void initQuantizeThresholds(float thresholds[256], float scale) {
+    for (int k = 0; k < 256; k++) {
+        thresholds[k] = (k / 256.0) * (k / 256.0) / scale;
+    }
+}
+
+static uint8_t quantizeValue(const float thresholds[256], float value) {
+    int ret = 0;
+    for (int step = 128; step > 0; step /= 2) {
+        ret += value >= thresholds[ret + step] ? step : 0;
+    }
+    return (uint8_t)ret;
+}
+
+static uint8_t paethPredictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    } else if (pb <= pc) {
+        return b;
+    } else {
+        return c;
+    }
+}
+
+static void filterRow(uint8_t* out, const uint8_t* row, const uint8_t* prev, int length, PngRowFilter filter) {
+    out[0] = filter;
+    out++;
+    switch (filter) {
+    case PNG_ROW_FILTER_SUB:
+        for (int i = 0; i < length; i++) {
+            out[i] = row[i] - (i >= 3 ? row[i - 3] : 0);
+        }
+        break;
+    case PNG_ROW_FILTER_UP:
+        for (int i = 0; i < length; i++) {
+            out[i] = row[i] - (prev != NULL ? prev[i] : 0);
+        }
+        break;
+    case PNG_ROW_FILTER_AVERAGE:
+        for (int i = 0; i < length; i++) {
+            int left = i >= 3 ? row[i - 3] : 0;
+            int up = prev != NULL ? prev[i] : 0;
+            out[i] = row[i] - (left + up) / 2;
+        }
+        break;
+    case PNG_ROW_FILTER_PAETH:
+        for (int i = 0; i < length; i++) {
+            int left = i >= 3 ? row[i - 3] : 0;
+            int up = prev != NULL ? prev[i] : 0;
+            int up_left = i >= 3 && prev != NULL ? prev[i - 3] : 0;
+            out[i] = row[i] - paethPredictor(left, up, up_left);
+        }
+        break;
+    default:
+        memcpy(out, row, length);
+        break;
+    }
+}
+
+#define CHUNK_BYTES (1 << 18)
+#define DICTIONARY_BYTES (1 << 15)
+
+typedef struct {
+    size_t start;
+    size_t length;
+    uint8_t* compressed;
+    size_t compressed_length;
+    uLong adler;
+    bool ok;
+} DeflateChunk;
+
+// Compress one chunk as raw deflate blocks. All but the last chunk end with a sync flush, so that
+// they end on a byte boundary and the chunks can simply be concatenated. The end of the previous
+// chunk is used as dictionary, so the compression ratio stays close to a single stream.
+static void compressChunk(DeflateChunk* chunk, const uint8_t* data, int level, bool last) {
+    chunk->ok = false;
+    chunk->adler = adler32(1, data + chunk->start, chunk->length);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        chunk->compressed = NULL;
+        return;
+    }
+    if (chunk->start > 0) {
+        size_t dict_length = chunk->start < DICTIONARY_BYTES ? chunk->start : DICTIONARY_BYTES;
+        deflateSetDictionary(&stream, data + chunk->start - dict_length, dict_length);
+    }
+    size_t capacity = deflateBound(&stream, chunk->length) + 64;
+    chunk->compressed = (uint8_t*)malloc(capacity);
+    stream.next_in = (Bytef*)(data + chunk->start);
+    stream.avail_in = chunk->length;
+    stream.next_out = chunk->compressed;
+    stream.avail_out = capacity;
+    int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    chunk->ok = stream.avail_in == 0 && (last ? result == Z_STREAM_END : result == Z_OK);
+    chunk->compressed_length = capacity - stream.avail_out;
+    deflateEnd(&stream);
+}
+
+static void writeUint32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static void writePNGChunk(FILE* file, const char* type, const uint8_t* data, size_t length) {
+    uint8_t header[8];
+    writeUint32(header, length);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(0, header + 4, 4);
+    uint8_t footer[4];
+    fwrite(header, 1, 8, file);
+    // The data of empty chunks, like IEND, may be NULL
+    if (length > 0) {
+        crc = crc32(crc, data, length);
+        fwrite(data, 1, length, file);
+    }
+    writeUint32(footer, crc);
+    fwrite(footer, 1, 4, file);
+}
+
+bool writePNGFile(const char* filename, const Color* pixels, int width, int heigth, float scale, const PngSettings* settings) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    size_t row_length = 3 * (size_t)width;
+    size_t stride = row_length + 1;
+    uint8_t* image = (uint8_t*)malloc(row_length * heigth);
+    uint8_t* filtered = (uint8_t*)malloc(stride * heigth);
+    double start = beginTraceSpan();
+    float thresholds[256];
+    initQuantizeThresholds(thresholds, scale);
+    double step_start = beginTraceSpan();
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < heigth; i++) {
+        const float* values = pixels[(size_t)i * width].v;
+        uint8_t* row = image + i * row_length;
+        for (size_t j = 0; j < row_length; j++) {
+            row[j] = quantizeValue(thresholds, values[j]);
+        }
+    }
+    endTraceSpan("png quantize", step_start);
+    step_start = beginTraceSpan();
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < heigth; i++) {
+        const uint8_t* prev = i > 0 ? image + (i - 1) * row_length : NULL;
+        filterRow(filtered + i * stride, image + i * row_length, prev, row_length, settings->filter);
+    }
+    endTraceSpan("png filter", step_start);
+    free(image);
+    size_t total = stride * heigth;
+    int chunk_count = (total + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    if (chunk_count == 0) {
+        chunk_count = 1;
+    }
+    DeflateChunk* chunks = (DeflateChunk*)malloc(sizeof(DeflateChunk) * chunk_count);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < chunk_count; i++) {
+        double chunk_start = beginTraceSpan();
+        chunks[i].start = (size_t)i * CHUNK_BYTES;
+        chunks[i].length = i == chunk_count - 1 ? total - chunks[i].start : CHUNK_BYTES;
+        compressChunk(&chunks[i], filtered, settings->compression_level, i == chunk_count - 1);
+        endTraceSpanArgs("png compress", chunk_start, "chunk", i, NULL, 0);
+    }
+    bool ok = true;
+    uLong adler = 1;
+    for (int i = 0; i < chunk_count; i++) {
+        ok &= chunks[i].ok;
+        adler = adler32_combine(adler, chunks[i].adler, chunks[i].length);
+    }
+    if (ok) {
+        static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        fwrite(signature, 1, 8, file);
+        uint8_t header[13];
+        writeUint32(header, width);
+        writeUint32(header + 4, heigth);
+        header[8] = 8;  // bit depth
+        header[9] = 2;  // truecolor
+        header[10] = 0; // deflate
+        header[11] = 0; // adaptive filtering
+        header[12] = 0; // no interlace
+        writePNGChunk(file, "IHDR", header, 13);
+        // zlib header with a 32K window and the level hint, the check bits make it divisible by 31
+        int level = settings->compression_level;
+        int level_hint = level < 0 ? 2 : (level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3)));
+        uint8_t zlib_header[2] = { 0x78, level_hint << 6 };
+        zlib_header[1] += (31 - (zlib_header[0] * 256 + zlib_header[1]) % 31) % 31;
+        writePNGChunk(file, "IDAT", zlib_header, 2);
+        for (int i = 0; i < chunk_count; i++) {
+            writePNGChunk(file, "IDAT", chunks[i].compressed, chunks[i].compressed_length);
+        }
+        uint8_t zlib_footer[4];
+        writeUint32(zlib_footer, adler);
+        writePNGChunk(file, "IDAT", zlib_footer, 4);
+        writePNGChunk(file, "IEND", NULL, 0);
+    }
+    for (int i = 0; i < chunk_count; i++) {
+        free(chunks[i].compressed);
+    }
+    free(chunks);
+    free(filtered);
+    ok &= !ferror(file);
+    ok &= fclose(file) == 0;
+    endTraceSpan("write png", start);
+    return ok;
+}
+
+
+bool writePFMFile(const char* filename, const Color* pixels, int width, int heigth, float scale) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    // A negative scale marks little endian data, which is what is written on all supported hosts
+    double start = beginTraceSpan();
+    fprintf(file, "PF\n%d %d\n-1.0\n", width, heigth);
+    float* row = (float*)malloc(sizeof(float) * 3 * width);
+    // The rows are stored from the bottom to the top
+    for (int i = heigth - 1; i >= 0; i--) {
+        const float* values = pixels[(size_t)i * width].v;
+        for (int j = 0; j < 3 * width; j++) {
+            row[j] = values[j] * scale;
+        }
+        fwrite(row, sizeof(float), 3 * width, file);
+    }
+    free(row);
+    bool ok = !ferror(file);
+    ok &= fclose(file) == 0;
+    endTraceSpan("write pfm", start);
+    return ok;
+}
+
+Color* readPFMFile(const char* filename, int* width, int* heigth) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    Color* pixels = NULL;
+    float byte_order;
+    if (fscanf(file, "PF %d %d %f", width, heigth, &byte_order) == 3 && fgetc(file) != EOF && *width > 0 && *heigth > 0 && byte_order < 0) {
+        pixels = (Color*)malloc(sizeof(Color) * *width * *heigth);
+        for (int i = *heigth - 1; i >= 0 && pixels != NULL; i--) {
+            if (fread(pixels[(size_t)i * *width].v, sizeof(float), 3 * *width, file) != 3 * (size_t)*width) {
+                free(pixels);
+                pixels = NULL;
+            }
+        }
+    }
+    fclose(file);
+    return pixels;
+}
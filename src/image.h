@@ -0,0 +1,40 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stdbool.h>
+
+#include "vec.h"
+
+// The values match the filter type bytes of the png format
+typedef enum {
+    PNG_ROW_FILTER_NONE = 0,
+    PNG_ROW_FILTER_SUB = 1,
+    PNG_ROW_FILTER_UP = 2,
+    PNG_ROW_FILTER_AVERAGE = 3,
+    PNG_ROW_FILTER_PAETH = 4,
+} PngRowFilter;
+
+typedef struct {
+    // zlib compression level from 0 (store only) to 9 (smallest)
+    int compression_level;
+    // Filter applied to every row before compression
+    PngRowFilter filter;
+} PngSettings;
+
+PngSettings createDefaultPngSettings();
+
+// Parse the name of a row filter (none, sub, up, average or paeth)
+bool parsePngRowFilter(const char* name, PngRowFilter* filter);
+
+// Write the pixels multiplied by scale as a gamma corrected 8-bit png file. Conversion, filtering
+// and compression are done in parallel, the rows are compressed in independent chunks that are
+// joined into a single zlib stream.
+bool writePNGFile(const char* filename, const Color* pixels, int width, int heigth, float scale, const PngSettings* settings);
+
+// Write the pixels multiplied by scale as a linear 32-bit float pfm file
+bool writePFMFile(const char* filename, const Color* pixels, int width, int heigth, float scale);
+
+// Read a color pfm file as written by writePFMFile, returns NULL on failure
+Color* readPFMFile(const char* filename, int* width, int* heigth);
+
+#endif
@@ -34,6 +34,97 @@ bool testRayTriangleIntersection(const Ray* ray, const Vec3 vert[3], Intersectio
     return false;
 }
 
+static bool testRaySphereIntersection(const Ray* ray, const BvhNodeSphere* sphere, Intersection* out) {
+    Vec3 offset = subVec3(ray->start, sphere->center);
+    float a = dotVec3(ray->direction, ray->direction);
+    float b = dotVec3(offset, ray->direction);
+    float c = dotVec3(offset, offset) - sphere->radius * sphere->radius;
+    float discriminant = b * b - a * c;
+    if (discriminant >= 0) {
+        float root = sqrtf(discriminant);
+        float t = (-b - root) / a;
+        if (t <= EPSILON) {
+            // The ray starts inside of the sphere
+            t = (-b + root) / a;
+        }
+        if (t > EPSILON && t < out->dist) {
+            Vec3 normal = scaleVec3(addVec3(offset, scaleVec3(ray->direction, t)), 1 / sphere->radius);
+            out->dist = t;
+            // Longitude and latitude, both mapped to [0, 1]
+            out->u = 0.5 + atan2f(normal.z, normal.x) / (2 * PI);
+            out->v = 0.5 + asinf(fminf(fmaxf(normal.y, -1), 1)) / PI;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Intersect with the plane through origin spanned by the edges, giving the coordinates of the hit
+// in multiples of the edges
+static bool testRayPlaneIntersection(const Ray* ray, Vec3 origin, const Vec3 edges[2], float max_dist, float* t, float* u, float* v) {
+    Vec3 h = crossVec3(ray->direction, edges[1]);
+    float a = dotVec3(edges[0], h);
+    if (a < -EPSILON || a > EPSILON) {
+        float f = 1.0 / a;
+        Vec3 s = subVec3(ray->start, origin);
+        Vec3 q = crossVec3(s, edges[0]);
+        *t = f * dotVec3(edges[1], q);
+        *u = f * dotVec3(s, h);
+        *v = f * dotVec3(ray->direction, q);
+        return *t > EPSILON && *t < max_dist;
+    }
+    return false;
+}
+
+static bool testRayDiskIntersection(const Ray* ray, const BvhNodeDisk* disk, Intersection* out) {
+    float t, u, v;
+    if (testRayPlaneIntersection(ray, disk->center, disk->edges, out->dist, &t, &u, &v) && u * u + v * v <= 1) {
+        out->dist = t;
+        out->u = u;
+        out->v = v;
+        return true;
+    }
+    return false;
+}
+
+static bool testRayQuadIntersection(const Ray* ray, const BvhNodeQuad* quad, Intersection* out) {
+    float t, u, v;
+    if (testRayPlaneIntersection(ray, quad->corner, quad->edges, out->dist, &t, &u, &v) && u >= 0 && u <= 1 && v >= 0 && v <= 1) {
+        out->dist = t;
+        out->u = u;
+        out->v = v;
+        return true;
+    }
+    return false;
+}
+
+// Test any kind of primitive leaf, setting the triangle id of the hit to the primitive id
+static bool testRayPrimitiveIntersection(const Ray* ray, const BvhNode* bvh, Intersection* out) {
+    switch (bvh->kind) {
+    case BVH_NODE_SPHERE:
+        if (testRaySphereIntersection(ray, (BvhNodeSphere*)bvh, out)) {
+            out->triangle_id = ((BvhNodeSphere*)bvh)->primitive_id;
+            return true;
+        }
+        break;
+    case BVH_NODE_DISK:
+        if (testRayDiskIntersection(ray, (BvhNodeDisk*)bvh, out)) {
+            out->triangle_id = ((BvhNodeDisk*)bvh)->primitive_id;
+            return true;
+        }
+        break;
+    case BVH_NODE_QUAD:
+        if (testRayQuadIntersection(ray, (BvhNodeQuad*)bvh, out)) {
+            out->triangle_id = ((BvhNodeQuad*)bvh)->primitive_id;
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    return false;
+}
+
 bool testRayBoundingBoxIntersection(const Ray* ray, const BoundingBox* bb, float t0, float t1) {
     float tmin, tmax, tymin, tymax, tzmin, tzmax;
     tmin = (bb->bound[ray->sign[0]].x - ray->start.x) * ray->inv_direction.x;
@@ -75,6 +166,14 @@ bool testRayBvhIntersection(const Ray* ray, const BvhNode* bvh, Intersection* ou
             return false;
         }
     } break;
+    case BVH_NODE_DEFERRED: {
+        BvhNodeDeferred* deferred = (BvhNodeDeferred*)bvh;
+        if (testRayBoundingBoxIntersection(ray, &deferred->bounds, EPSILON, out->dist)) {
+            return testRayBvhIntersection(ray, expandDeferredBvh(bvh), out);
+        } else {
+            return false;
+        }
+    } break;
     case BVH_NODE_TRIANGLE: {
         BvhNodeTriangle* tri = (BvhNodeTriangle*)bvh;
         if (testRayTriangleIntersection(ray, tri->verts, out)) {
@@ -85,11 +184,75 @@ bool testRayBvhIntersection(const Ray* ray, const BvhNode* bvh, Intersection* ou
         }
     } break;
     default:
-        return false;
+        return testRayPrimitiveIntersection(ray, bvh, out);
         break;
     }
 }
 
+bool countRayBvhIntersection(const Ray* ray, const BvhNode* bvh, Intersection* out, TraversalCounts* counts) {
+    switch (bvh->kind) {
+    case BVH_NODE_INTERNAL: {
+        BvhNodeInternal* inter = (BvhNodeInternal*)bvh;
+        counts->nodes++;
+        if (testRayBoundingBoxIntersection(ray, &inter->bounds, EPSILON, out->dist)) {
+            bool intersec0 = countRayBvhIntersection(ray, inter->children[ray->sign[inter->split_axis]], out, counts);
+            bool intersec1 = countRayBvhIntersection(ray, inter->children[1 - ray->sign[inter->split_axis]], out, counts);
+            return intersec0 || intersec1;
+        } else {
+            return false;
+        }
+    } break;
+    case BVH_NODE_DEFERRED: {
+        BvhNodeDeferred* deferred = (BvhNodeDeferred*)bvh;
+        counts->nodes++;
+        if (testRayBoundingBoxIntersection(ray, &deferred->bounds, EPSILON, out->dist)) {
+            return countRayBvhIntersection(ray, expandDeferredBvh(bvh), out, counts);
+        } else {
+            return false;
+        }
+    } break;
+    default:
+        counts->leaves++;
+        return testRayBvhIntersection(ray, bvh, out);
+        break;
+    }
+}
+
+bool testRayBvhOcclusion(const Ray* ray, const BvhNode* bvh, float max_dist) {
+    switch (bvh->kind) {
+    case BVH_NODE_INTERNAL: {
+        BvhNodeInternal* inter = (BvhNodeInternal*)bvh;
+        if (testRayBoundingBoxIntersection(ray, &inter->bounds, EPSILON, max_dist)) {
+            return testRayBvhOcclusion(ray, inter->children[ray->sign[inter->split_axis]], max_dist)
+                || testRayBvhOcclusion(ray, inter->children[1 - ray->sign[inter->split_axis]], max_dist);
+        } else {
+            return false;
+        }
+    } break;
+    case BVH_NODE_DEFERRED: {
+        BvhNodeDeferred* deferred = (BvhNodeDeferred*)bvh;
+        if (testRayBoundingBoxIntersection(ray, &deferred->bounds, EPSILON, max_dist)) {
+            return testRayBvhOcclusion(ray, expandDeferredBvh(bvh), max_dist);
+        } else {
+            return false;
+        }
+    } break;
+    case BVH_NODE_TRIANGLE: {
+        BvhNodeTriangle* tri = (BvhNodeTriangle*)bvh;
+        Intersection intersection = {
+            .dist = max_dist,
+        };
+        return testRayTriangleIntersection(ray, tri->verts, &intersection);
+    } break;
+    default: {
+        Intersection intersection = {
+            .dist = max_dist,
+        };
+        return testRayPrimitiveIntersection(ray, bvh, &intersection);
+    } break;
+    }
+}
+
 Ray createRay(Vec3 start, Vec3 direction) {
     Ray ret = {
         .start = start,
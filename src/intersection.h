@@ -4,6 +4,7 @@
 #include "bvh.h"
 #include "vec.h"
 
+// For analytic primitives, triangle_id is the primitive id and u and v are surface parameters
 typedef struct {
     float dist;
     int triangle_id;
@@ -26,4 +27,18 @@ bool testRayBoundingBoxIntersection(const Ray* ray, const BoundingBox* bounds, f
 
 bool testRayBvhIntersection(const Ray* ray, const BvhNode* bvh, Intersection* out);
 
+// Work done by a traversal
+typedef struct {
+    // Internal nodes whose bounds were tested
+    int nodes;
+    // Triangles and primitives tested
+    int leaves;
+} TraversalCounts;
+
+// Like testRayBvhIntersection, but also counts the work, for diagnostics
+bool countRayBvhIntersection(const Ray* ray, const BvhNode* bvh, Intersection* out, TraversalCounts* counts);
+
+// Any-hit query, returns true as soon as some hit closer than max_dist is found
+bool testRayBvhOcclusion(const Ray* ray, const BvhNode* bvh, float max_dist);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,164 @@
+
+#include <math.h>
+
+#include "light.h"
+#include "intersection.h"
+#include "sampler.h"
+#include "bsdf.h"
+#include "emitters.h"
+
+// Lobes that can still be followed with the remaining depth, the same as for camera paths
+static int allowedLobes(const Renderer* renderer, int depth) {
+    int lobes = 0;
+    if (depth - renderer->diffuse_depth_cost > 0) {
+        lobes |= BSDF_LOBE_DIFFUSE;
+    }
+    if (depth - renderer->specular_depth_cost > 0) {
+        lobes |= BSDF_LOBE_SPECULAR;
+    }
+    if (depth - renderer->transmition_depth_cost > 0) {
+        lobes |= BSDF_LOBE_TRANSMISSION;
+    }
+    return lobes;
+}
+
+static int lobeDepthCost(const Renderer* renderer, BsdfLobe lobe) {
+    switch (lobe) {
+    case BSDF_LOBE_DIFFUSE:
+        return renderer->diffuse_depth_cost;
+    case BSDF_LOBE_SPECULAR:
+        return renderer->specular_depth_cost;
+    default:
+        return renderer->transmition_depth_cost;
+    }
+}
+
+// Find the pixel the point is seen in and the direction towards the camera. factor converts the
+// radiance leaving the point towards the camera into the contribution to the pixel, i.e. it is
+// the cosine at the point over the squared distance, times the importance of the pinhole camera.
+// Returns false if the camera does not see the point.
+static bool connectToCamera(
+    const Renderer* renderer, const CameraFrame* camera, Scene* scene, Vec3 position, Vec3 normal,
+    float* x, float* y, Vec3* direction, float* factor
+) {
+    if (!projectToCamera(camera, renderer, position, x, y)) {
+        return false;
+    }
+    Vec3 offset = subVec3(camera->position, position);
+    float dist = magnitudeVec3(offset);
+    *direction = scaleVec3(offset, 1 / dist);
+    Ray ray = createRay(position, *direction);
+    if (testRaySceneOcclusion(&ray, scene, dist)) {
+        return false;
+    }
+    // The camera averages over the area of a pixel on the image plane at distance one, which
+    // covers a solid angle proportional to cos^3 of the angle to the view direction
+    float cos_camera = -dotVec3(*direction, camera->forward);
+    float pixel_area = camera->horizontal_scale * camera->vertical_scale / (renderer->width * renderer->height);
+    float cos_surface = fabsf(dotVec3(normal, *direction));
+    *factor = cos_surface / (dist * dist * cos_camera * cos_camera * cos_camera * pixel_area);
+    return true;
+}
+
+// The path integrator shades a surface from the side of the incoming ray, so the bsdf seen along
+// a light path is evaluated as if the camera ray came from the outgoing direction. Like every eval
+// function, the result is the bsdf times the cosine to its direction argument, which is the light
+// direction here. Callers divide by that cosine to get the bsdf. The lobes are symmetric, so this
+// is the same bsdf that sampleBsdf draws from on the side of the light, and the weights of the
+// light path stay bounded.
+static Color evalReverseBsdf(const SurfacePoint* surface, Vec3 light_direction, Vec3 camera_direction, int lobes) {
+    bool outside = dotVec3(surface->normal, camera_direction) >= 0;
+    Vec3 normal = outside ? surface->normal : scaleVec3(surface->normal, -1);
+    return evalBsdf(&surface->material, scaleVec3(camera_direction, -1), normal, outside, lobes, scaleVec3(light_direction, -1));
+}
+
+// Follow one path from the lights, scale is the weight of a single path in the pass
+static void traceLightPath(
+    Renderer* renderer, const CameraFrame* camera, Scene* scene, Sampler* sampler, float scale
+) {
+    if (renderer->depth <= 0) {
+        return;
+    }
+    float u_emitter = sampleFloat(sampler);
+    float u0, u1;
+    sample2D(sampler, &u0, &u1);
+    SurfacePoint light;
+    float area_pdf;
+    if (!sampleEmitter(renderer->emitters, scene, u_emitter, u0, u1, &light, &area_pdf) || area_pdf <= 0) {
+        return;
+    }
+    // Emitters are seen from both sides, so the path leaves to either side with a cosine weighted
+    // direction. The cosine cancels with the pdf of cos / (2 pi).
+    Vec3 side = sampleFloat(sampler) < 0.5 ? light.normal : scaleVec3(light.normal, -1);
+    sample2D(sampler, &u0, &u1);
+    Vec3 direction = sampleLambert(side, u0, u1);
+    Color throughput = scaleVec3(light.material.emission_color, 2 * PI / area_pdf);
+    Vec3 position = light.position;
+    int depth = renderer->depth;
+    for (int bounces = 0; !isVec3Null(throughput); bounces++) {
+        Ray ray = createRay(position, direction);
+        Intersection hit = {
+            .dist = INFINITY,
+        };
+        if (!testRaySceneIntersection(&ray, scene, &hit)) {
+            return;
+        }
+        Vec3 hit_position = addVec3(position, scaleVec3(direction, hit.dist));
+        float camera_dist = magnitudeVec3(subVec3(hit_position, camera->position));
+        SurfacePoint surface;
+        getSurfacePoint(scene, hit.triangle_id, hit.u, hit.v, camera_dist * pixelSpreadAngle(renderer), &surface);
+        // The cosine at this end of the segment was not part of the sampled direction, and it is
+        // the cosine that evalReverseBsdf includes
+        float cos_in = fabsf(dotVec3(surface.normal, direction));
+        int lobes = allowedLobes(renderer, depth);
+        if (cos_in <= 0 || lobes == 0) {
+            return;
+        }
+        float x, y;
+        Vec3 to_camera;
+        float factor;
+        if (
+            bounces > 0 && (lobes & BSDF_LOBE_DIFFUSE) != 0
+            && connectToCamera(renderer, camera, scene, surface.position, surface.normal, &x, &y, &to_camera, &factor)
+        ) {
+            Color eval = evalReverseBsdf(&surface, direction, to_camera, BSDF_LOBE_DIFFUSE);
+            if (!isVec3Null(eval)) {
+                splatToBuffer(renderer, (int)x, (int)y, scaleVec3(mulVec3(throughput, eval), factor * scale / cos_in));
+            }
+        }
+        // Sample the next direction as if the light was a camera ray, which follows the mirror
+        // and refraction directions of the light, and weight it by the reverse bsdf. After a
+        // diffuse bounce the path would no longer be a caustic.
+        lobes &= BSDF_LOBE_SPECULAR | BSDF_LOBE_TRANSMISSION;
+        bool outside = dotVec3(surface.normal, direction) <= 0;
+        Vec3 normal = outside ? surface.normal : scaleVec3(surface.normal, -1);
+        BsdfSample sample;
+        if (lobes == 0 || !sampleBsdf(&surface.material, direction, normal, outside, lobes, sampler, &sample)) {
+            return;
+        }
+        float pdf = bsdfPdf(&surface.material, direction, normal, outside, lobes, sample.direction);
+        if (pdf <= 0) {
+            return;
+        }
+        Color eval = evalReverseBsdf(&surface, direction, sample.direction, lobes);
+        float cos_out = fabsf(dotVec3(surface.normal, sample.direction));
+        throughput = mulVec3(throughput, scaleVec3(eval, cos_out / (cos_in * pdf)));
+        depth -= lobeDepthCost(renderer, sample.lobe);
+        position = surface.position;
+        direction = sample.direction;
+    }
+}
+
+void renderTileLight(Renderer* renderer, const CameraFrame* camera, Scene* scene, int x0, int y0, int x1, int y1) {
+    // The pass adds the average over all paths of the whole image
+    float scale = 1 / ((float)renderer->width * renderer->height * renderer->pixel_samples);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            for (int s = 0; s < renderer->pixel_samples; s++) {
+                Sampler sampler;
+                initSampler(&sampler, y * renderer->width + x, renderer->sample_index + s);
+                traceLightPath(renderer, camera, scene, &sampler, scale);
+            }
+        }
+    }
+}
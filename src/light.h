@@ -0,0 +1,17 @@
+#ifndef _LIGHT_H_
+#define _LIGHT_H_
+
+#include "renderer.h"
+#include "scene.h"
+
+// Caustic paths of the light integrator. They leave an emitter, pass through specular or
+// transmission bounces only, and are connected to the camera at the first diffuse surface after
+// them. Light focused by glass onto a diffuse surface is found by every light path that passes
+// through the glass, while a camera path has to hit the emitter by chance after refracting. All
+// other paths are left to the camera paths of the tile, which skip these ones. A tile traces as
+// many light paths as it has camera samples, but they may be seen anywhere in the image, so their
+// contributions are added with splatToBuffer. Caustics of emitters that are not in the emitter
+// list, i.e. the triangles of out-of-core scenes, are left to the camera paths.
+void renderTileLight(Renderer* renderer, const CameraFrame* camera, Scene* scene, int x0, int y0, int x1, int y1);
+
+#endif
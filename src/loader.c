@@ -0,0 +1,190 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "loader.h"
+#include "texture.h"
+#include "trace.h"
+
+char* readFile(const char* filename) {
+    // Compressed files are decompressed, others are read unchanged
+    gzFile file = gzopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    } else {
+        size_t capacity = 1 << 16;
+        size_t size = 0;
+        char* data = malloc(capacity);
+        int read;
+        while ((read = gzread(file, data + size, capacity - size - 1)) > 0) {
+            size += read;
+            if (size + 1 == capacity) {
+                capacity *= 2;
+                data = realloc(data, capacity);
+            }
+        }
+        data[size] = 0;
+        gzclose(file);
+        return data;
+    }
+}
+
+// Files next to a compressed obj file may be compressed as well, e.g. scene.mtl.gz
+static char* readSceneFile(const char* filename, bool compressed) {
+    char* data = NULL;
+    if (compressed) {
+        char* compressed_filename = (char*)malloc(strlen(filename) + 4);
+        strcpy(compressed_filename, filename);
+        strcat(compressed_filename, ".gz");
+        data = readFile(compressed_filename);
+        free(compressed_filename);
+    }
+    if (data == NULL) {
+        data = readFile(filename);
+    }
+    return data;
+}
+
+// The other file names are derived from the name without the .gz ending
+static int baseNameLength(const char* obj_filename) {
+    return strlen(obj_filename) - (isCompressedFilename(obj_filename) ? 3 : 0);
+}
+
+static char* mtlFilename(const char* obj_filename) {
+    int path_len = baseNameLength(obj_filename);
+    char* mtl_filename = strndup(obj_filename, path_len);
+    if (path_len >= 3) {
+        mtl_filename[path_len - 3] = 'm';
+        mtl_filename[path_len - 2] = 't';
+        mtl_filename[path_len - 1] = 'l';
+    }
+    return mtl_filename;
+}
+
+// Analytic primitives are declared in a file next to the obj file, e.g. scene.prim
+static char* primFilename(const char* obj_filename) {
+    int path_len = baseNameLength(obj_filename);
+    char* prim_filename = (char*)malloc(path_len + 6);
+    memcpy(prim_filename, obj_filename, path_len);
+    prim_filename[path_len] = 0;
+    if (path_len >= 3 && strncmp(obj_filename + path_len - 3, "obj", 3) == 0) {
+        strcpy(prim_filename + path_len - 3, "prim");
+    } else {
+        strcpy(prim_filename + path_len, ".prim");
+    }
+    return prim_filename;
+}
+
+bool loadScene(Scene* scene, const char* obj_filename, const BvhBuildSettings* bvh_settings) {
+    double start = beginTraceSpan();
+    TextStream* stream = openTextStream(obj_filename);
+    if (stream == NULL) {
+        fprintf(stderr, "failed to open '%s': %s\n", obj_filename, strerror(errno));
+        return false;
+    } else {
+        bool compressed = isCompressedFilename(obj_filename);
+        char* mtl_filename = mtlFilename(obj_filename);
+        char* mtl_data = readSceneFile(mtl_filename, compressed);
+        char* prim_filename = primFilename(obj_filename);
+        char* prim_data = readSceneFile(prim_filename, compressed);
+        // Texture maps are relative to the directory of the mtl file
+        char* directory = strdup(obj_filename);
+        char* last_slash = strrchr(directory, '/');
+        if (last_slash != NULL) {
+            last_slash[1] = 0;
+        } else {
+            directory[0] = 0;
+        }
+        loadFromObj(scene, stream, mtl_data, prim_data, directory, bvh_settings);
+        bool failed = hasTextStreamFailed(stream);
+        closeTextStream(stream);
+        free(directory);
+        free(mtl_filename);
+        free(mtl_data);
+        free(prim_filename);
+        free(prim_data);
+        endTraceSpan("load scene", start);
+        if (failed) {
+            fprintf(stderr, "failed to read '%s', the file is damaged or truncated\n", obj_filename);
+            freeScene(scene);
+            return false;
+        } else {
+            return true;
+        }
+    }
+}
+
+// Missing files change the stamp as well, so that adding one is noticed
+static uint64_t stampFile(uint64_t stamp, const char* filename) {
+    struct stat info;
+    uint64_t modified = 0;
+    uint64_t size = UINT64_MAX;
+    if (stat(filename, &info) == 0) {
+        modified = info.st_mtime;
+        size = info.st_size;
+    }
+    stamp = (stamp ^ modified) * 1099511628211ull;
+    return (stamp ^ size) * 1099511628211ull;
+}
+
+// Stamps both of the names readSceneFile tries
+static uint64_t stampSceneFile(uint64_t stamp, const char* filename, bool compressed) {
+    if (compressed) {
+        char* compressed_filename = (char*)malloc(strlen(filename) + 4);
+        strcpy(compressed_filename, filename);
+        strcat(compressed_filename, ".gz");
+        stamp = stampFile(stamp, compressed_filename);
+        free(compressed_filename);
+    }
+    return stampFile(stamp, filename);
+}
+
+uint64_t sceneFilesStamp(const Scene* scene, const char* obj_filename) {
+    bool compressed = isCompressedFilename(obj_filename);
+    uint64_t stamp = stampFile(14695981039346656037ull, obj_filename);
+    char* mtl_filename = mtlFilename(obj_filename);
+    stamp = stampSceneFile(stamp, mtl_filename, compressed);
+    free(mtl_filename);
+    char* prim_filename = primFilename(obj_filename);
+    stamp = stampSceneFile(stamp, prim_filename, compressed);
+    free(prim_filename);
+    for (int i = 0; i < scene->texture_count; i++) {
+        stamp = stampFile(stamp, getTextureFilename(scene->textures[i]));
+    }
+    return stamp;
+}
+
+bool loadSceneFrame(Scene* scene, const char* obj_filename, float rebuild_threshold) {
+    TextStream* stream = openTextStream(obj_filename);
+    if (stream == NULL) {
+        fprintf(stderr, "failed to open '%s': %s\n", obj_filename, strerror(errno));
+        return false;
+    } else {
+        double start = beginTraceSpan();
+        bool reused = loadFrameFromObj(scene, stream);
+        closeTextStream(stream);
+        endTraceSpan("load frame", start);
+        if (reused) {
+            updateSceneBvh(scene, rebuild_threshold);
+            return true;
+        } else {
+            if (scene->paged == NULL) {
+                fprintf(stderr, "topology of '%s' changed, reloading the scene\n", obj_filename);
+            }
+            Scene next;
+            if (loadScene(&next, obj_filename, &scene->bvh_settings)) {
+                freeScene(scene);
+                *scene = next;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    }
+}
+
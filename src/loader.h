@@ -0,0 +1,23 @@
+#ifndef _LOADER_H_
+#define _LOADER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "scene.h"
+
+// Read the whole file into a null terminated string, decompressing gzip files. Returns NULL on
+// failure.
+char* readFile(const char* filename);
+
+// Load the obj file together with the mtl file of the same name
+bool loadScene(Scene* scene, const char* obj_filename, const BvhBuildSettings* bvh_settings);
+
+// Changes whenever one of the files the scene was loaded from changes, i.e. the obj file, the mtl
+// and prim files next to it and the texture maps. Only compares modification times and sizes.
+uint64_t sceneFilesStamp(const Scene* scene, const char* obj_filename);
+
+// Load the next frame of an animation, reusing topology and bvh if possible
+bool loadSceneFrame(Scene* scene, const char* obj_filename, float rebuild_threshold);
+
+#endif
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <omp.h>
+
+#include "numa.h"
+
+#define MAX_NUMA_NODES 64
+#define HUGE_PAGE_SIZE (2 << 20)
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int node_count;
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+static bool pinning_enabled = false;
+
+// Pinning of the calling thread, so that it is only done again if the team changed
+static _Thread_local int current_node = 0;
+static _Thread_local int pinned_thread = -1;
+static _Thread_local int pinned_team_size = -1;
+
+// Parse a cpu list as found in sysfs, e.g. "0-3,8-11"
+static void parseCpuList(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* pos = list;
+    while (*pos != 0 && *pos != '\n') {
+        char* end;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if (end == pos) {
+            break;
+        } else if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        pos = *end == ',' ? end + 1 : end;
+    }
+}
+
+static void loadTopology() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long cpu = 0; cpu < cpus && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+    node_count = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (file != NULL) {
+            char list[4096];
+            if (fgets(list, sizeof(list), file) != NULL) {
+                cpu_set_t cpus;
+                parseCpuList(list, &cpus);
+                CPU_AND(&node_cpus[node_count], &cpus, &allowed);
+                // Nodes with only memory, or none of the cpus we may use, are skipped
+                if (CPU_COUNT(&node_cpus[node_count]) > 0) {
+                    node_count++;
+                }
+            }
+            fclose(file);
+        }
+    }
+    if (node_count == 0) {
+        node_count = 1;
+        node_cpus[0] = allowed;
+    }
+}
+
+int getNumaNodeCount() {
+    pthread_once(&topology_once, loadTopology);
+    return node_count;
+}
+
+void setThreadPinning(bool enabled) {
+    pthread_once(&topology_once, loadTopology);
+    pinning_enabled = enabled;
+}
+
+void pinCurrentThread() {
+    int thread = omp_get_thread_num();
+    int threads = omp_get_num_threads();
+    if (pinning_enabled && (thread != pinned_thread || threads != pinned_team_size)) {
+        int node = thread * node_count / threads;
+        // Index of this thread among the threads of the same node
+        int local = thread - (node * threads + node_count - 1) / node_count;
+        int target = local % CPU_COUNT(&node_cpus[node]);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_cpus[node])) {
+                if (target == 0) {
+                    CPU_SET(cpu, &set);
+                    break;
+                }
+                target--;
+            }
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+            current_node = node;
+        } else {
+            current_node = 0;
+        }
+        pinned_thread = thread;
+        pinned_team_size = threads;
+    }
+}
+
+int getCurrentNumaNode() {
+    return current_node;
+}
+
+void* allocateLarge(size_t size) {
+    if (size < HUGE_PAGE_SIZE) {
+        return malloc(size);
+    } else {
+        void* ret;
+        size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (posix_memalign(&ret, HUGE_PAGE_SIZE, size) != 0) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        // Only a hint, without transparent huge pages this is a no-op
+        madvise(ret, size, MADV_HUGEPAGE);
+#endif
+        return ret;
+    }
+}
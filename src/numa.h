@@ -0,0 +1,24 @@
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Number of numa nodes with cpus we are allowed to run on, 1 if the topology is unknown
+int getNumaNodeCount();
+
+// Enable or disable pinning of the OpenMP threads, see pinCurrentThread
+void setThreadPinning(bool enabled);
+
+// Called by every thread at the start of a parallel region. If pinning is enabled, the thread is
+// pinned to one cpu, spreading the threads of the team evenly over the numa nodes.
+void pinCurrentThread();
+
+// Numa node the calling thread is pinned to, 0 if it is not pinned
+int getCurrentNumaNode();
+
+// Allocate memory for a large array. Allocations bigger than a huge page are aligned to it and
+// advised to be backed by transparent huge pages. Free with free().
+void* allocateLarge(size_t size);
+
+#endif
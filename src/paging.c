@@ -0,0 +1,1088 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "paging.h"
+#include "trace.h"
+
+#define DEFAULT_CACHE_BUDGET ((size_t)1 << 30)
+#define PAGE_ALIGN(SIZE) (((SIZE) + 15) / 16 * 16)
+// The grid the triangles are binned into is finer than the clusters, so that the clusters can be
+// made of whole cells and still hold about as many triangles as allowed
+#define CELLS_PER_CLUSTER 8
+
+typedef struct {
+    int vertex_count;
+    int normal_count;
+    int texcoord_count;
+    int triangle_count;
+    int has_texcoords;
+    size_t bvh_size;
+} PageHeader;
+
+// Offsets of the arrays inside of a page, they follow the header in this order
+typedef struct {
+    size_t vertecies;
+    size_t normals;
+    size_t texcoords;
+    size_t vertex_indices;
+    size_t normal_indices;
+    size_t texcoord_indices;
+    size_t object_ids;
+    size_t bvh;
+    size_t size;
+} PageLayout;
+
+typedef struct Cluster {
+    BoundingBox bounds;
+    int first_triangle;
+    int triangle_count;
+    off_t offset;
+    size_t size;
+    // Only valid while the cluster is resident. The scene uses the triangle ids local to the cluster.
+    char* page;
+    Scene scene;
+    BvhNode* bvh;
+    int users;
+    struct Cluster* newer;
+    struct Cluster* older;
+} Cluster;
+
+// Node of the top-level bvh, leaves reference a cluster
+typedef struct {
+    BoundingBox bounds;
+    int children[2];
+    int split_axis;
+    int cluster;
+} ClusterNode;
+
+struct PagedGeometry {
+    FILE* page_file;
+    Cluster* clusters;
+    int cluster_count;
+    ClusterNode* nodes;
+    int node_count;
+    Object* objects;
+    int object_count;
+};
+
+// All resident clusters of all scenes, in the order they were last used
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_budget = DEFAULT_CACHE_BUDGET;
+static size_t resident_bytes = 0;
+static Cluster* newest_cluster = NULL;
+static Cluster* oldest_cluster = NULL;
+static int cluster_total = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_faults = 0;
+static unsigned long cache_evictions = 0;
+
+void setGeometryCacheBudget(size_t bytes) {
+    pthread_mutex_lock(&cache_lock);
+    cache_budget = bytes;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static PageLayout layoutPage(const PageHeader* header) {
+    PageLayout ret;
+    size_t offset = PAGE_ALIGN(sizeof(PageHeader));
+    ret.vertecies = offset;
+    offset += PAGE_ALIGN(sizeof(Vec3) * header->vertex_count);
+    ret.normals = offset;
+    offset += PAGE_ALIGN(sizeof(Vec3) * header->normal_count);
+    ret.texcoords = offset;
+    offset += PAGE_ALIGN(sizeof(Vec3) * header->texcoord_count);
+    ret.vertex_indices = offset;
+    offset += PAGE_ALIGN(sizeof(int[3]) * header->triangle_count);
+    ret.normal_indices = offset;
+    offset += PAGE_ALIGN(sizeof(int[3]) * header->triangle_count);
+    ret.texcoord_indices = offset;
+    offset += header->has_texcoords ? PAGE_ALIGN(sizeof(int[3]) * header->triangle_count) : 0;
+    ret.object_ids = offset;
+    offset += PAGE_ALIGN(sizeof(int) * header->triangle_count);
+    ret.bvh = offset;
+    offset += header->bvh_size;
+    ret.size = offset;
+    return ret;
+}
+
+// A triangle as it is read from the obj file, with the indices of the whole scene
+typedef struct {
+    int vertex_indices[3];
+    int normal_indices[3];
+    int texcoord_indices[3];
+    int object_id;
+} TriangleRecord;
+
+// Triangles waiting to be written, all with their center in the same cell of the grid
+typedef struct {
+    TriangleRecord* triangles;
+    int count;
+    int capacity;
+} TriangleBin;
+
+struct PageBuilder {
+    BvhBuildSettings settings;
+    int cluster_size;
+    // The vertex attributes and the triangles in the order they are read. The attribute files are
+    // mapped into memory when the clusters are written, so the kernel can drop their pages again.
+    FILE* vertex_file;
+    FILE* normal_file;
+    FILE* texcoord_file;
+    FILE* triangle_file;
+    int vertex_count;
+    int normal_count;
+    int texcoord_count;
+    int triangle_count;
+    BoundingBox bounds;
+    // Only valid while the clusters are written
+    const Vec3* vertecies;
+    const Vec3* normals;
+    const Vec3* texcoords;
+    FILE* page_file;
+    off_t file_size;
+    PagedGeometry* geometry;
+    int cluster_capacity;
+    int node_capacity;
+};
+
+// Open addressing table from the indices of the scene to the ones inside of a cluster. It is sized
+// for the indices of one cluster, so it does not grow with the scene.
+typedef struct {
+    int* keys;
+    int* values;
+    int mask;
+} IndexMap;
+
+static void initIndexMap(IndexMap* map, int count) {
+    int size = 16;
+    while (size < 2 * count) {
+        size *= 2;
+    }
+    map->keys = (int*)malloc(sizeof(int) * size);
+    map->values = (int*)malloc(sizeof(int) * size);
+    map->mask = size - 1;
+    memset(map->keys, -1, sizeof(int) * size);
+}
+
+static void freeIndexMap(IndexMap* map) {
+    free(map->keys);
+    free(map->values);
+}
+
+// Indices outside of the global array, e.g. missing texture coordinates, are mapped to -1
+static int mapIndex(IndexMap* map, int index, Vec3* local, const Vec3* global, int global_count, int* count) {
+    if (index < 0 || index >= global_count) {
+        return -1;
+    } else {
+        int slot = (int)(((unsigned)index * 2654435761u) & map->mask);
+        while (map->keys[slot] >= 0 && map->keys[slot] != index) {
+            slot = (slot + 1) & map->mask;
+        }
+        if (map->keys[slot] < 0) {
+            map->keys[slot] = index;
+            map->values[slot] = *count;
+            local[*count] = global[index];
+            (*count)++;
+        }
+        return map->values[slot];
+    }
+}
+
+static void writeCluster(PageBuilder* builder, const TriangleRecord* triangles, int count, Cluster* cluster) {
+    bool has_texcoords = builder->texcoord_count > 0;
+    Vec3* vertecies = (Vec3*)malloc(sizeof(Vec3) * 3 * count);
+    Vec3* normals = (Vec3*)malloc(sizeof(Vec3) * 3 * count);
+    Vec3* texcoords = (Vec3*)malloc(sizeof(Vec3) * 3 * count);
+    int (*vertex_indices)[3] = (int(*)[3])malloc(sizeof(int[3]) * count);
+    int (*normal_indices)[3] = (int(*)[3])malloc(sizeof(int[3]) * count);
+    int (*texcoord_indices)[3] = (int(*)[3])malloc(sizeof(int[3]) * count);
+    int* object_ids = (int*)malloc(sizeof(int) * count);
+    IndexMap vertex_map, normal_map, texcoord_map;
+    initIndexMap(&vertex_map, 3 * count);
+    initIndexMap(&normal_map, 3 * count);
+    initIndexMap(&texcoord_map, 3 * count);
+    PageHeader header = {
+        .vertex_count = 0,
+        .normal_count = 0,
+        .texcoord_count = 0,
+        .triangle_count = count,
+        .has_texcoords = has_texcoords,
+    };
+    for (int i = 0; i < count; i++) {
+        const TriangleRecord* t = &triangles[i];
+        for (int k = 0; k < 3; k++) {
+            vertex_indices[i][k] = mapIndex(&vertex_map, t->vertex_indices[k], vertecies, builder->vertecies, builder->vertex_count, &header.vertex_count);
+            normal_indices[i][k] = mapIndex(&normal_map, t->normal_indices[k], normals, builder->normals, builder->normal_count, &header.normal_count);
+            if (has_texcoords) {
+                texcoord_indices[i][k] = mapIndex(&texcoord_map, t->texcoord_indices[k], texcoords, builder->texcoords, builder->texcoord_count, &header.texcoord_count);
+            }
+        }
+        object_ids[i] = t->object_id;
+    }
+    freeIndexMap(&vertex_map);
+    freeIndexMap(&normal_map);
+    freeIndexMap(&texcoord_map);
+    BvhNode* bvh = buildBvh(vertex_indices, vertecies, count, &builder->settings);
+    cluster->bounds = getBvhBounds(bvh);
+    char* serialized = serializeBvh(bvh, &header.bvh_size);
+    freeBvh(bvh);
+    PageLayout layout = layoutPage(&header);
+    char* page = (char*)calloc(layout.size, 1);
+    memcpy(page, &header, sizeof(PageHeader));
+    memcpy(page + layout.vertecies, vertecies, sizeof(Vec3) * header.vertex_count);
+    memcpy(page + layout.normals, normals, sizeof(Vec3) * header.normal_count);
+    memcpy(page + layout.texcoords, texcoords, sizeof(Vec3) * header.texcoord_count);
+    memcpy(page + layout.vertex_indices, vertex_indices, sizeof(int[3]) * count);
+    memcpy(page + layout.normal_indices, normal_indices, sizeof(int[3]) * count);
+    if (has_texcoords) {
+        memcpy(page + layout.texcoord_indices, texcoord_indices, sizeof(int[3]) * count);
+    }
+    memcpy(page + layout.object_ids, object_ids, sizeof(int) * count);
+    memcpy(page + layout.bvh, serialized, header.bvh_size);
+    fwrite(page, 1, layout.size, builder->page_file);
+    cluster->offset = builder->file_size;
+    cluster->size = layout.size;
+    builder->file_size += layout.size;
+    free(page);
+    free(serialized);
+    free(vertecies);
+    free(normals);
+    free(texcoords);
+    free(vertex_indices);
+    free(normal_indices);
+    free(texcoord_indices);
+    free(object_ids);
+}
+
+// Clusters are numbered in the order they are written, which also numbers the triangles
+static void addCluster(PageBuilder* builder, const TriangleRecord* triangles, int count) {
+    PagedGeometry* geometry = builder->geometry;
+    if (geometry->cluster_count == builder->cluster_capacity) {
+        builder->cluster_capacity *= 2;
+        geometry->clusters = (Cluster*)realloc(geometry->clusters, sizeof(Cluster) * builder->cluster_capacity);
+    }
+    int cluster_id = geometry->cluster_count;
+    geometry->cluster_count++;
+    Cluster* cluster = &geometry->clusters[cluster_id];
+    memset(cluster, 0, sizeof(Cluster));
+    cluster->first_triangle = cluster_id == 0 ? 0 : geometry->clusters[cluster_id - 1].first_triangle + geometry->clusters[cluster_id - 1].triangle_count;
+    cluster->triangle_count = count;
+    writeCluster(builder, triangles, count, cluster);
+}
+
+static float clusterCenter(const PagedGeometry* geometry, int cluster, int axis) {
+    // Twice the center, which is just as good for comparing
+    return geometry->clusters[cluster].bounds.bound[0].v[axis] + geometry->clusters[cluster].bounds.bound[1].v[axis];
+}
+
+// Reorder the clusters so that the nth one is the one it would be if they were sorted by their
+// center along the axis, with no larger ones before and no smaller ones after it
+static void selectNthCluster(const PagedGeometry* geometry, int* clusters, int count, int nth, int axis) {
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        float pivot = clusterCenter(geometry, clusters[(low + high) / 2], axis);
+        int i = low;
+        int j = high;
+        while (i <= j) {
+            while (clusterCenter(geometry, clusters[i], axis) < pivot) {
+                i++;
+            }
+            while (clusterCenter(geometry, clusters[j], axis) > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                int tmp = clusters[i];
+                clusters[i] = clusters[j];
+                clusters[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        if (nth <= j) {
+            high = j;
+        } else if (nth >= i) {
+            low = i;
+        } else {
+            break;
+        }
+    }
+}
+
+static int addClusterNode(PageBuilder* builder) {
+    PagedGeometry* geometry = builder->geometry;
+    if (geometry->node_count == builder->node_capacity) {
+        builder->node_capacity *= 2;
+        geometry->nodes = (ClusterNode*)realloc(geometry->nodes, sizeof(ClusterNode) * builder->node_capacity);
+    }
+    geometry->node_count++;
+    return geometry->node_count - 1;
+}
+
+// Split the written clusters at the median of their centers along the largest extent
+static int buildClusterTree(PageBuilder* builder, int* clusters, int count) {
+    PagedGeometry* geometry = builder->geometry;
+    int node = addClusterNode(builder);
+    if (count == 1) {
+        geometry->nodes[node].bounds = geometry->clusters[clusters[0]].bounds;
+        geometry->nodes[node].cluster = clusters[0];
+    } else {
+        Vec3 min = createVec3(INFINITY, INFINITY, INFINITY);
+        Vec3 max = createVec3(-INFINITY, -INFINITY, -INFINITY);
+        for (int i = 0; i < count; i++) {
+            Vec3 center = createVec3(
+                clusterCenter(geometry, clusters[i], 0), clusterCenter(geometry, clusters[i], 1),
+                clusterCenter(geometry, clusters[i], 2)
+            );
+            min = minVec3(min, center);
+            max = maxVec3(max, center);
+        }
+        Vec3 extent = subVec3(max, min);
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int half = count / 2;
+        selectNthCluster(geometry, clusters, count, half, axis);
+        int left = buildClusterTree(builder, clusters, half);
+        int right = buildClusterTree(builder, clusters + half, count - half);
+        // The nodes may have moved while building the children
+        ClusterNode* inter = &geometry->nodes[node];
+        inter->children[0] = left;
+        inter->children[1] = right;
+        inter->split_axis = axis;
+        inter->cluster = -1;
+        inter->bounds.bound[0] = minVec3(geometry->nodes[left].bounds.bound[0], geometry->nodes[right].bounds.bound[0]);
+        inter->bounds.bound[1] = maxVec3(geometry->nodes[left].bounds.bound[1], geometry->nodes[right].bounds.bound[1]);
+    }
+    return node;
+}
+
+// The page file is removed right away, it only lives as long as it is open. It is placed into
+// TMPDIR, so that it can be moved to a disk if /tmp is kept in memory.
+static FILE* createPageFile() {
+    const char* directory = getenv("TMPDIR");
+    if (directory == NULL || directory[0] == 0) {
+        directory = "/tmp";
+    }
+    char* path = (char*)malloc(strlen(directory) + 32);
+    sprintf(path, "%s/raytrace-pages-XXXXXX", directory);
+    FILE* ret = NULL;
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        ret = fdopen(fd, "w+b");
+        if (ret == NULL) {
+            close(fd);
+        }
+    }
+    free(path);
+    return ret;
+}
+
+static void closeFile(FILE* file) {
+    if (file != NULL) {
+        fclose(file);
+    }
+}
+
+PageBuilder* createPageBuilder(int cluster_size, const BvhBuildSettings* settings) {
+    PageBuilder* builder = (PageBuilder*)calloc(1, sizeof(PageBuilder));
+    builder->settings = *settings;
+    builder->settings.cluster_size = 0;
+    builder->settings.numa_replicas = false;
+    builder->settings.lazy = false;
+    builder->cluster_size = cluster_size;
+    builder->bounds.bound[0] = createVec3(INFINITY, INFINITY, INFINITY);
+    builder->bounds.bound[1] = createVec3(-INFINITY, -INFINITY, -INFINITY);
+    builder->vertex_file = createPageFile();
+    builder->normal_file = createPageFile();
+    builder->texcoord_file = createPageFile();
+    builder->triangle_file = createPageFile();
+    builder->page_file = createPageFile();
+    if (
+        builder->vertex_file == NULL || builder->normal_file == NULL || builder->texcoord_file == NULL
+        || builder->triangle_file == NULL || builder->page_file == NULL
+    ) {
+        closeFile(builder->vertex_file);
+        closeFile(builder->normal_file);
+        closeFile(builder->texcoord_file);
+        closeFile(builder->triangle_file);
+        closeFile(builder->page_file);
+        free(builder);
+        return NULL;
+    }
+    return builder;
+}
+
+void addPagedVertex(PageBuilder* builder, Vec3 vertex) {
+    fwrite(&vertex, sizeof(Vec3), 1, builder->vertex_file);
+    builder->bounds.bound[0] = minVec3(builder->bounds.bound[0], vertex);
+    builder->bounds.bound[1] = maxVec3(builder->bounds.bound[1], vertex);
+    builder->vertex_count++;
+}
+
+void addPagedNormal(PageBuilder* builder, Vec3 normal) {
+    fwrite(&normal, sizeof(Vec3), 1, builder->normal_file);
+    builder->normal_count++;
+}
+
+void addPagedTexcoord(PageBuilder* builder, Vec3 texcoord) {
+    fwrite(&texcoord, sizeof(Vec3), 1, builder->texcoord_file);
+    builder->texcoord_count++;
+}
+
+void addPagedTriangle(PageBuilder* builder, const int vertex_indices[3], const int normal_indices[3], const int texcoord_indices[3], int object_id) {
+    TriangleRecord record;
+    memcpy(record.vertex_indices, vertex_indices, sizeof(record.vertex_indices));
+    memcpy(record.normal_indices, normal_indices, sizeof(record.normal_indices));
+    memcpy(record.texcoord_indices, texcoord_indices, sizeof(record.texcoord_indices));
+    record.object_id = object_id;
+    fwrite(&record, sizeof(TriangleRecord), 1, builder->triangle_file);
+    builder->triangle_count++;
+}
+
+// Returns NULL for empty files, and on failure. Clears the failure of an empty mapping.
+static const Vec3* mapAttributeFile(FILE* file, int count, bool* failed) {
+    if (fflush(file) != 0 || ferror(file)) {
+        *failed = true;
+        return NULL;
+    } else if (count == 0) {
+        return NULL;
+    } else {
+        void* data = mmap(NULL, sizeof(Vec3) * (size_t)count, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (data == MAP_FAILED) {
+            *failed = true;
+            return NULL;
+        }
+        return (const Vec3*)data;
+    }
+}
+
+static void unmapAttributeFile(const Vec3* data, int count) {
+    if (data != NULL) {
+        munmap((void*)data, sizeof(Vec3) * (size_t)count);
+    }
+}
+
+// Cells of about equal size in every direction, about one for every cluster. Directions in which
+// the scene is much flatter than a cell get a single one.
+static void chooseGridSize(BoundingBox bounds, int cells, int size[3]) {
+    Vec3 extent = subVec3(bounds.bound[1], bounds.bound[0]);
+    bool flat[3];
+    for (int k = 0; k < 3; k++) {
+        flat[k] = !(extent.v[k] > 0);
+    }
+    double cell = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        double volume = 1;
+        int dimensions = 0;
+        for (int k = 0; k < 3; k++) {
+            if (!flat[k]) {
+                volume *= extent.v[k];
+                dimensions++;
+            }
+        }
+        cell = dimensions > 0 ? pow(volume / cells, 1.0 / dimensions) : 0;
+        for (int k = 0; k < 3; k++) {
+            if (!flat[k] && extent.v[k] < cell) {
+                flat[k] = true;
+                changed = true;
+            }
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        size[k] = flat[k] ? 1 : (int)fmin(fmax(extent.v[k] / cell + 0.5, 1), 1 << 20);
+    }
+}
+
+static int triangleCell(const PageBuilder* builder, const TriangleRecord* triangle, const int size[3]) {
+    Vec3 center = createVec3(0, 0, 0);
+    for (int k = 0; k < 3; k++) {
+        center = addVec3(center, builder->vertecies[triangle->vertex_indices[k]]);
+    }
+    center = scaleVec3(center, 1.0 / 3);
+    int cell = 0;
+    for (int k = 2; k >= 0; k--) {
+        float min = builder->bounds.bound[0].v[k];
+        float extent = builder->bounds.bound[1].v[k] - min;
+        int x = extent > 0 ? (int)((center.v[k] - min) / extent * size[k]) : 0;
+        x = x < 0 ? 0 : (x >= size[k] ? size[k] - 1 : x);
+        cell = cell * size[k] + x;
+    }
+    return cell;
+}
+
+static void appendToBin(TriangleBin* bin, const TriangleRecord* triangle) {
+    if (bin->count == bin->capacity) {
+        bin->capacity = 2 * bin->capacity + 16;
+        bin->triangles = (TriangleRecord*)realloc(bin->triangles, sizeof(TriangleRecord) * bin->capacity);
+    }
+    bin->triangles[bin->count] = *triangle;
+    bin->count++;
+}
+
+static void clearBin(TriangleBin* bin) {
+    free(bin->triangles);
+    bin->triangles = NULL;
+    bin->count = 0;
+    bin->capacity = 0;
+}
+
+// Triangles referencing vertecies that do not exist are dropped
+static bool isValidTriangle(const PageBuilder* builder, const TriangleRecord* triangle) {
+    for (int k = 0; k < 3; k++) {
+        if (triangle->vertex_indices[k] < 0 || triangle->vertex_indices[k] >= builder->vertex_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Calls the function for every valid triangle in the triangle file
+static void forEachTriangle(PageBuilder* builder, void (*function)(void*, const TriangleRecord*), void* data) {
+    TriangleRecord chunk[1024];
+    rewind(builder->triangle_file);
+    size_t read;
+    while ((read = fread(chunk, sizeof(TriangleRecord), 1024, builder->triangle_file)) > 0) {
+        for (size_t i = 0; i < read; i++) {
+            if (isValidTriangle(builder, &chunk[i])) {
+                function(data, &chunk[i]);
+            }
+        }
+    }
+}
+
+typedef struct {
+    PageBuilder* builder;
+    int size[3];
+    int* counts;
+    // Region of every cell, and the triangles of every region that were not read yet
+    int* regions;
+    int* remaining;
+    TriangleBin* bins;
+    int region_count;
+    size_t waiting;
+    size_t budget;
+} ClusterGrid;
+
+static void countTriangle(void* data, const TriangleRecord* triangle) {
+    ClusterGrid* grid = (ClusterGrid*)data;
+    grid->counts[triangleCell(grid->builder, triangle, grid->size)]++;
+}
+
+static int gridCell(const ClusterGrid* grid, const int cell[3]) {
+    return (cell[2] * grid->size[1] + cell[1]) * grid->size[0] + cell[0];
+}
+
+// Split the box of cells at the median of the triangle counts along its longest side, until the
+// boxes hold at most cluster_size triangles or are a single cell. Each box becomes a region.
+static void splitCells(ClusterGrid* grid, const int low[3], const int high[3]) {
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (high[k] - low[k] > high[axis] - low[axis]) {
+            axis = k;
+        }
+    }
+    int length = high[axis] - low[axis];
+    int* slices = (int*)calloc(length, sizeof(int));
+    int total = 0;
+    int cell[3];
+    for (cell[2] = low[2]; cell[2] < high[2]; cell[2]++) {
+        for (cell[1] = low[1]; cell[1] < high[1]; cell[1]++) {
+            for (cell[0] = low[0]; cell[0] < high[0]; cell[0]++) {
+                int count = grid->counts[gridCell(grid, cell)];
+                slices[cell[axis] - low[axis]] += count;
+                total += count;
+            }
+        }
+    }
+    if (total <= grid->builder->cluster_size || length == 1) {
+        int region = grid->region_count;
+        grid->region_count++;
+        grid->remaining[region] = total;
+        for (cell[2] = low[2]; cell[2] < high[2]; cell[2]++) {
+            for (cell[1] = low[1]; cell[1] < high[1]; cell[1]++) {
+                for (cell[0] = low[0]; cell[0] < high[0]; cell[0]++) {
+                    grid->regions[gridCell(grid, cell)] = region;
+                }
+            }
+        }
+    } else {
+        int split = 1;
+        int before = slices[0];
+        while (split < length - 1 && 2 * (before + slices[split]) <= total) {
+            before += slices[split];
+            split++;
+        }
+        int middle[3] = { high[0], high[1], high[2] };
+        middle[axis] = low[axis] + split;
+        splitCells(grid, low, middle);
+        middle[0] = low[0];
+        middle[1] = low[1];
+        middle[2] = low[2];
+        middle[axis] = low[axis] + split;
+        splitCells(grid, middle, high);
+    }
+    free(slices);
+}
+
+static void writeBin(ClusterGrid* grid, int region) {
+    TriangleBin* bin = &grid->bins[region];
+    addCluster(grid->builder, bin->triangles, bin->count);
+    grid->waiting -= bin->count;
+    clearBin(bin);
+}
+
+static void binTriangle(void* data, const TriangleRecord* triangle) {
+    ClusterGrid* grid = (ClusterGrid*)data;
+    int region = grid->regions[triangleCell(grid->builder, triangle, grid->size)];
+    TriangleBin* bin = &grid->bins[region];
+    appendToBin(bin, triangle);
+    grid->remaining[region]--;
+    grid->waiting++;
+    if (grid->remaining[region] == 0 || bin->count == grid->builder->cluster_size) {
+        writeBin(grid, region);
+    }
+    if (grid->waiting > grid->budget) {
+        int fullest = 0;
+        for (int i = 1; i < grid->region_count; i++) {
+            if (grid->bins[i].count > grid->bins[fullest].count) {
+                fullest = i;
+            }
+        }
+        writeBin(grid, fullest);
+    }
+}
+
+// The first pass over the triangles counts them in every cell of a grid that is a few times
+// finer than the clusters. The grid is then split into regions of whole cells, and the second
+// pass writes the triangles of a region as a cluster as soon as all of them have been read. If the
+// waiting triangles would use more than the budget of the cluster cache, the fullest region is
+// written early and the rest of it becomes another cluster.
+static void writeClusters(PageBuilder* builder) {
+    ClusterGrid grid;
+    grid.builder = builder;
+    chooseGridSize(builder->bounds, CELLS_PER_CLUSTER * (builder->triangle_count / builder->cluster_size + 1), grid.size);
+    int cells = grid.size[0] * grid.size[1] * grid.size[2];
+    grid.counts = (int*)calloc(cells, sizeof(int));
+    grid.regions = (int*)malloc(sizeof(int) * cells);
+    grid.remaining = (int*)malloc(sizeof(int) * cells);
+    grid.region_count = 0;
+    forEachTriangle(builder, countTriangle, &grid);
+    int low[3] = { 0, 0, 0 };
+    splitCells(&grid, low, grid.size);
+    grid.bins = (TriangleBin*)calloc(grid.region_count, sizeof(TriangleBin));
+    pthread_mutex_lock(&cache_lock);
+    grid.budget = cache_budget / sizeof(TriangleRecord);
+    pthread_mutex_unlock(&cache_lock);
+    if (grid.budget < (size_t)builder->cluster_size) {
+        grid.budget = builder->cluster_size;
+    }
+    grid.waiting = 0;
+    forEachTriangle(builder, binTriangle, &grid);
+    for (int i = 0; i < grid.region_count; i++) {
+        // Only if the file changed between the passes
+        if (grid.bins[i].count > 0) {
+            writeBin(&grid, i);
+        }
+    }
+    free(grid.bins);
+    free(grid.counts);
+    free(grid.regions);
+    free(grid.remaining);
+}
+
+static void freePageBuilder(PageBuilder* builder) {
+    fclose(builder->vertex_file);
+    fclose(builder->normal_file);
+    fclose(builder->texcoord_file);
+    fclose(builder->triangle_file);
+    free(builder);
+}
+
+PagedGeometry* finishPageBuilder(PageBuilder* builder, Object* objects, int object_count) {
+    PagedGeometry* geometry = (PagedGeometry*)malloc(sizeof(PagedGeometry));
+    geometry->page_file = builder->page_file;
+    geometry->objects = objects;
+    geometry->object_count = object_count;
+    geometry->cluster_count = 0;
+    geometry->node_count = 0;
+    builder->geometry = geometry;
+    builder->cluster_capacity = 16;
+    builder->node_capacity = 32;
+    geometry->clusters = (Cluster*)malloc(sizeof(Cluster) * builder->cluster_capacity);
+    geometry->nodes = (ClusterNode*)malloc(sizeof(ClusterNode) * builder->node_capacity);
+    bool failed = fflush(builder->triangle_file) != 0 || ferror(builder->triangle_file);
+    builder->vertecies = mapAttributeFile(builder->vertex_file, builder->vertex_count, &failed);
+    builder->normals = mapAttributeFile(builder->normal_file, builder->normal_count, &failed);
+    builder->texcoords = mapAttributeFile(builder->texcoord_file, builder->texcoord_count, &failed);
+    if (!failed && builder->triangle_count > 0) {
+        writeClusters(builder);
+        failed = ferror(builder->triangle_file);
+    }
+    if (geometry->cluster_count > 0) {
+        int* clusters = (int*)malloc(sizeof(int) * geometry->cluster_count);
+        for (int i = 0; i < geometry->cluster_count; i++) {
+            clusters[i] = i;
+        }
+        buildClusterTree(builder, clusters, geometry->cluster_count);
+        free(clusters);
+    }
+    unmapAttributeFile(builder->vertecies, builder->vertex_count);
+    unmapAttributeFile(builder->normals, builder->normal_count);
+    unmapAttributeFile(builder->texcoords, builder->texcoord_count);
+    freePageBuilder(builder);
+    pthread_mutex_lock(&cache_lock);
+    cluster_total += geometry->cluster_count;
+    pthread_mutex_unlock(&cache_lock);
+    if (failed || fflush(geometry->page_file) != 0 || ferror(geometry->page_file)) {
+        freePagedGeometry(geometry);
+        return NULL;
+    }
+    return geometry;
+}
+
+int getPagedTriangleCount(const PagedGeometry* geometry) {
+    if (geometry->cluster_count > 0) {
+        const Cluster* last = &geometry->clusters[geometry->cluster_count - 1];
+        return last->first_triangle + last->triangle_count;
+    } else {
+        return 0;
+    }
+}
+
+static void unlinkCluster(Cluster* cluster) {
+    if (cluster->newer != NULL) {
+        cluster->newer->older = cluster->older;
+    } else {
+        newest_cluster = cluster->older;
+    }
+    if (cluster->older != NULL) {
+        cluster->older->newer = cluster->newer;
+    } else {
+        oldest_cluster = cluster->newer;
+    }
+    cluster->newer = NULL;
+    cluster->older = NULL;
+}
+
+static void linkCluster(Cluster* cluster) {
+    cluster->newer = NULL;
+    cluster->older = newest_cluster;
+    if (newest_cluster != NULL) {
+        newest_cluster->newer = cluster;
+    } else {
+        oldest_cluster = cluster;
+    }
+    newest_cluster = cluster;
+}
+
+static void unloadCluster(Cluster* cluster) {
+    unlinkCluster(cluster);
+    free(cluster->page);
+    cluster->page = NULL;
+    cluster->bvh = NULL;
+    resident_bytes -= cluster->size;
+}
+
+void freePagedGeometry(PagedGeometry* geometry) {
+    if (geometry != NULL) {
+        pthread_mutex_lock(&cache_lock);
+        for (int i = 0; i < geometry->cluster_count; i++) {
+            if (geometry->clusters[i].page != NULL) {
+                unloadCluster(&geometry->clusters[i]);
+            }
+        }
+        cluster_total -= geometry->cluster_count;
+        pthread_mutex_unlock(&cache_lock);
+        fclose(geometry->page_file);
+        free(geometry->clusters);
+        free(geometry->nodes);
+        free(geometry);
+    }
+}
+
+BoundingBox getPagedGeometryBounds(const PagedGeometry* geometry) {
+    if (geometry->node_count > 0) {
+        return geometry->nodes[0].bounds;
+    } else {
+        BoundingBox bounds = {
+            .bound = { createVec3(INFINITY, INFINITY, INFINITY), createVec3(-INFINITY, -INFINITY, -INFINITY) },
+        };
+        return bounds;
+    }
+}
+
+int getClusterCount(const PagedGeometry* geometry) {
+    return geometry->cluster_count;
+}
+
+int getTriangleCluster(const PagedGeometry* geometry, int triangle_id) {
+    int low = 0;
+    int high = geometry->cluster_count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (geometry->clusters[mid].first_triangle <= triangle_id) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+static char* readClusterPage(PagedGeometry* geometry, const Cluster* cluster) {
+    char* page = (char*)malloc(cluster->size);
+    size_t done = 0;
+    while (done < cluster->size) {
+        ssize_t result = pread(fileno(geometry->page_file), page + done, cluster->size - done, cluster->offset + done);
+        if (result <= 0) {
+            break;
+        }
+        done += result;
+    }
+    if (done < cluster->size) {
+        // Treat the cluster as empty, rays will pass through it
+        fprintf(stderr, "failed to read a geometry page\n");
+        memset(page, 0, sizeof(PageHeader));
+    }
+    return page;
+}
+
+static void installClusterPage(PagedGeometry* geometry, Cluster* cluster, char* page) {
+    PageHeader* header = (PageHeader*)page;
+    PageLayout layout = layoutPage(header);
+    Scene* scene = &cluster->scene;
+    memset(scene, 0, sizeof(Scene));
+    scene->vertecies = (Vec3*)(page + layout.vertecies);
+    scene->vertex_count = header->vertex_count;
+    scene->normals = (Vec3*)(page + layout.normals);
+    scene->normal_count = header->normal_count;
+    scene->texcoords = (Vec3*)(page + layout.texcoords);
+    scene->texcoord_count = header->texcoord_count;
+    scene->vertex_indices = (int(*)[3])(page + layout.vertex_indices);
+    scene->normal_indices = (int(*)[3])(page + layout.normal_indices);
+    scene->texcoord_indices = header->has_texcoords ? (int(*)[3])(page + layout.texcoord_indices) : NULL;
+    scene->object_ids = (int*)(page + layout.object_ids);
+    scene->triangle_count = header->triangle_count;
+    scene->objects = geometry->objects;
+    scene->object_count = geometry->object_count;
+    cluster->bvh = header->bvh_size > 0 ? relocateBvh(page + layout.bvh, header->bvh_size) : NULL;
+    cluster->page = page;
+    resident_bytes += cluster->size;
+    linkCluster(cluster);
+}
+
+static void evictClusters() {
+    Cluster* cluster = oldest_cluster;
+    while (resident_bytes > cache_budget && cluster != NULL) {
+        Cluster* newer = cluster->newer;
+        if (cluster->users == 0) {
+            unloadCluster(cluster);
+            cache_evictions++;
+        }
+        cluster = newer;
+    }
+}
+
+static bool tryAcquireCluster(PagedGeometry* geometry, int cluster_id) {
+    Cluster* cluster = &geometry->clusters[cluster_id];
+    bool ret = false;
+    pthread_mutex_lock(&cache_lock);
+    if (cluster->page != NULL) {
+        cluster->users++;
+        unlinkCluster(cluster);
+        linkCluster(cluster);
+        cache_hits++;
+        ret = true;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+void acquireCluster(PagedGeometry* geometry, int cluster_id) {
+    if (!tryAcquireCluster(geometry, cluster_id)) {
+        Cluster* cluster = &geometry->clusters[cluster_id];
+        // The page is read without holding the lock. If another thread loaded it in the meantime,
+        // its copy is used and this one is dropped.
+        double start = beginTraceSpan();
+        char* page = readClusterPage(geometry, cluster);
+        endTraceSpanArgs("read cluster page", start, "cluster", cluster_id, NULL, 0);
+        pthread_mutex_lock(&cache_lock);
+        cache_faults++;
+        if (cluster->page == NULL) {
+            installClusterPage(geometry, cluster, page);
+            page = NULL;
+        } else {
+            unlinkCluster(cluster);
+            linkCluster(cluster);
+        }
+        cluster->users++;
+        evictClusters();
+        pthread_mutex_unlock(&cache_lock);
+        free(page);
+    }
+}
+
+void releaseCluster(PagedGeometry* geometry, int cluster_id) {
+    pthread_mutex_lock(&cache_lock);
+    geometry->clusters[cluster_id].users--;
+    evictClusters();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void getPagedSurfacePoint(PagedGeometry* geometry, int triangle_id, float u, float v, float footprint, SurfacePoint* out) {
+    int cluster_id = getTriangleCluster(geometry, triangle_id);
+    Cluster* cluster = &geometry->clusters[cluster_id];
+    acquireCluster(geometry, cluster_id);
+    getSurfacePoint(&cluster->scene, triangle_id - cluster->first_triangle, u, v, footprint, out);
+    releaseCluster(geometry, cluster_id);
+}
+
+static bool testRayCluster(const Ray* ray, const Cluster* cluster, Intersection* out) {
+    if (cluster->bvh != NULL && testRayBvhIntersection(ray, cluster->bvh, out)) {
+        out->triangle_id += cluster->first_triangle;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static void addDeferredRay(DeferredRays* deferred, int ray_id, int cluster_id) {
+    if (deferred->count == deferred->capacity) {
+        deferred->capacity = deferred->capacity == 0 ? 1024 : 2 * deferred->capacity;
+        deferred->rays = (int*)realloc(deferred->rays, sizeof(int) * deferred->capacity);
+        deferred->clusters = (int*)realloc(deferred->clusters, sizeof(int) * deferred->capacity);
+    }
+    deferred->rays[deferred->count] = ray_id;
+    deferred->clusters[deferred->count] = cluster_id;
+    deferred->count++;
+}
+
+// If deferred is NULL all clusters are loaded as needed, otherwise only resident ones are tested
+static bool testRayClusterNode(
+    const Ray* ray, int ray_id, PagedGeometry* geometry, int node_id, Intersection* out, DeferredRays* deferred
+) {
+    const ClusterNode* node = &geometry->nodes[node_id];
+    if (!testRayBoundingBoxIntersection(ray, &node->bounds, 0, out->dist)) {
+        return false;
+    } else if (node->cluster < 0) {
+        bool intersec0 = testRayClusterNode(ray, ray_id, geometry, node->children[ray->sign[node->split_axis]], out, deferred);
+        bool intersec1 = testRayClusterNode(ray, ray_id, geometry, node->children[1 - ray->sign[node->split_axis]], out, deferred);
+        return intersec0 || intersec1;
+    } else if (deferred == NULL) {
+        acquireCluster(geometry, node->cluster);
+        bool ret = testRayCluster(ray, &geometry->clusters[node->cluster], out);
+        releaseCluster(geometry, node->cluster);
+        return ret;
+    } else if (tryAcquireCluster(geometry, node->cluster)) {
+        bool ret = testRayCluster(ray, &geometry->clusters[node->cluster], out);
+        releaseCluster(geometry, node->cluster);
+        return ret;
+    } else {
+        addDeferredRay(deferred, ray_id, node->cluster);
+        return false;
+    }
+}
+
+bool testRayPagedIntersection(const Ray* ray, PagedGeometry* geometry, Intersection* out) {
+    return geometry->node_count > 0 && testRayClusterNode(ray, -1, geometry, 0, out, NULL);
+}
+
+bool testRayResidentClusters(const Ray* ray, int ray_id, PagedGeometry* geometry, Intersection* out, DeferredRays* deferred) {
+    return geometry->node_count > 0 && testRayClusterNode(ray, ray_id, geometry, 0, out, deferred);
+}
+
+static bool testRayClusterNodeOcclusion(const Ray* ray, PagedGeometry* geometry, int node_id, float max_dist) {
+    const ClusterNode* node = &geometry->nodes[node_id];
+    if (!testRayBoundingBoxIntersection(ray, &node->bounds, 0, max_dist)) {
+        return false;
+    } else if (node->cluster < 0) {
+        return testRayClusterNodeOcclusion(ray, geometry, node->children[ray->sign[node->split_axis]], max_dist)
+            || testRayClusterNodeOcclusion(ray, geometry, node->children[1 - ray->sign[node->split_axis]], max_dist);
+    } else {
+        const Cluster* cluster = &geometry->clusters[node->cluster];
+        acquireCluster(geometry, node->cluster);
+        bool ret = cluster->bvh != NULL && testRayBvhOcclusion(ray, cluster->bvh, max_dist);
+        releaseCluster(geometry, node->cluster);
+        return ret;
+    }
+}
+
+bool testRayPagedOcclusion(const Ray* ray, PagedGeometry* geometry, float max_dist) {
+    return geometry->node_count > 0 && testRayClusterNodeOcclusion(ray, geometry, 0, max_dist);
+}
+
+void initDeferredRays(DeferredRays* deferred) {
+    deferred->count = 0;
+    deferred->capacity = 0;
+    deferred->rays = NULL;
+    deferred->clusters = NULL;
+}
+
+void freeDeferredRays(DeferredRays* deferred) {
+    free(deferred->rays);
+    free(deferred->clusters);
+}
+
+void resolveDeferredRays(DeferredRays* deferred, PagedGeometry* geometry, const Vec3* origins, const Vec3* directions, Intersection* hits) {
+    if (deferred->count == 0) {
+        return;
+    }
+    // Group the rays by cluster using a counting sort
+    int* starts = (int*)calloc(geometry->cluster_count + 1, sizeof(int));
+    int* order = (int*)malloc(sizeof(int) * deferred->count);
+    for (int i = 0; i < deferred->count; i++) {
+        starts[deferred->clusters[i] + 1]++;
+    }
+    for (int i = 0; i < geometry->cluster_count; i++) {
+        starts[i + 1] += starts[i];
+    }
+    for (int i = 0; i < deferred->count; i++) {
+        order[starts[deferred->clusters[i]]] = i;
+        starts[deferred->clusters[i]]++;
+    }
+    int k = 0;
+    while (k < deferred->count) {
+        int cluster_id = deferred->clusters[order[k]];
+        Cluster* cluster = &geometry->clusters[cluster_id];
+        int end = k;
+        bool needed = false;
+        while (end < deferred->count && deferred->clusters[order[end]] == cluster_id) {
+            // Hits found in other clusters in the meantime may make loading this one unnecessary
+            int ray_id = deferred->rays[order[end]];
+            Ray ray = createRay(origins[ray_id], directions[ray_id]);
+            needed |= testRayBoundingBoxIntersection(&ray, &cluster->bounds, 0, hits[ray_id].dist);
+            end++;
+        }
+        if (needed) {
+            acquireCluster(geometry, cluster_id);
+            for (; k < end; k++) {
+                int ray_id = deferred->rays[order[k]];
+                Ray ray = createRay(origins[ray_id], directions[ray_id]);
+                testRayCluster(&ray, cluster, &hits[ray_id]);
+            }
+            releaseCluster(geometry, cluster_id);
+        }
+        k = end;
+    }
+    free(starts);
+    free(order);
+    deferred->count = 0;
+}
+
+void getGeometryCacheStats(GeometryCacheStats* stats) {
+    pthread_mutex_lock(&cache_lock);
+    stats->hits = cache_hits;
+    stats->faults = cache_faults;
+    stats->evictions = cache_evictions;
+    stats->resident_bytes = resident_bytes;
+    stats->budget_bytes = cache_budget;
+    stats->clusters = cluster_total;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,102 @@
+#ifndef _PAGING_H_
+#define _PAGING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bvh.h"
+#include "intersection.h"
+#include "scene.h"
+
+// Out-of-core geometry. The triangles of a scene are split into spatial clusters, and each cluster
+// is stored together with its own bvh as one page of a temporary file. Only a top-level bvh over
+// the clusters stays in memory. Pages are loaded on demand into a cache shared by all scenes of the
+// process, which evicts the least recently used clusters once its memory budget is exceeded.
+
+typedef struct {
+    unsigned long hits;
+    unsigned long faults;
+    unsigned long evictions;
+    size_t resident_bytes;
+    size_t budget_bytes;
+    int clusters;
+} GeometryCacheStats;
+
+// Rays that still have to be tested against clusters which were not resident when they were traced
+typedef struct {
+    int count;
+    int capacity;
+    int* rays;
+    int* clusters;
+} DeferredRays;
+
+// Set the memory budget of the cluster cache. Clusters that are in use are never evicted, so the
+// budget may be exceeded while more clusters are in use than fit into it.
+void setGeometryCacheBudget(size_t bytes);
+
+// Builds the clusters while the obj file is parsed. The vertex attributes and the triangles are
+// moved to temporary files in TMPDIR as they are added. Finishing reads the triangles back and
+// bins them by their center into a grid over the bounds of the vertecies, writing each cell as a
+// cluster with a bvh built using settings once it holds cluster_size triangles. The triangles
+// waiting in the cells use at most the memory budget of the cluster cache, and the attribute
+// files are only mapped into memory, so loading never needs the whole scene in memory.
+typedef struct PageBuilder PageBuilder;
+
+// Returns NULL if the temporary files can not be created
+PageBuilder* createPageBuilder(int cluster_size, const BvhBuildSettings* settings);
+
+void addPagedVertex(PageBuilder* builder, Vec3 vertex);
+
+void addPagedNormal(PageBuilder* builder, Vec3 normal);
+
+void addPagedTexcoord(PageBuilder* builder, Vec3 texcoord);
+
+// The indices are zero based and refer to all attributes added so far or later. Missing normals
+// and texture coordinates are given as -1.
+void addPagedTriangle(PageBuilder* builder, const int vertex_indices[3], const int normal_indices[3], const int texcoord_indices[3], int object_id);
+
+// Write the clusters and free the builder. Triangles are numbered cluster by cluster, so the
+// triangle ids of the paged geometry differ from their order in the file, and triangles with
+// vertecies that do not exist are dropped. The objects stay owned by the caller. Returns NULL if
+// the geometry could not be written.
+PagedGeometry* finishPageBuilder(PageBuilder* builder, Object* objects, int object_count);
+
+int getPagedTriangleCount(const PagedGeometry* geometry);
+
+void freePagedGeometry(PagedGeometry* geometry);
+
+BoundingBox getPagedGeometryBounds(const PagedGeometry* geometry);
+
+int getClusterCount(const PagedGeometry* geometry);
+
+int getTriangleCluster(const PagedGeometry* geometry, int triangle_id);
+
+// Make the cluster resident, loading it if necessary, and keep it resident until it is released
+void acquireCluster(PagedGeometry* geometry, int cluster);
+
+void releaseCluster(PagedGeometry* geometry, int cluster);
+
+// Like getSurfacePoint, loading the cluster of the triangle if necessary
+void getPagedSurfacePoint(PagedGeometry* geometry, int triangle_id, float u, float v, float footprint, SurfacePoint* out);
+
+// Closest hit, loading every cluster the ray has to be tested against
+bool testRayPagedIntersection(const Ray* ray, PagedGeometry* geometry, Intersection* out);
+
+bool testRayPagedOcclusion(const Ray* ray, PagedGeometry* geometry, float max_dist);
+
+// Closest hit among the clusters that are resident right now. The clusters that are not resident
+// but would have to be tested are added to deferred together with ray_id.
+bool testRayResidentClusters(const Ray* ray, int ray_id, PagedGeometry* geometry, Intersection* out, DeferredRays* deferred);
+
+void initDeferredRays(DeferredRays* deferred);
+
+void freeDeferredRays(DeferredRays* deferred);
+
+// Test the deferred rays, going through the clusters one after another so that each cluster is
+// loaded only once no matter how many rays wait for it. The rays and their current closest hits
+// are indexed by ray id. Clears the deferred rays.
+void resolveDeferredRays(DeferredRays* deferred, PagedGeometry* geometry, const Vec3* origins, const Vec3* directions, Intersection* hits);
+
+void getGeometryCacheStats(GeometryCacheStats* stats);
+
+#endif
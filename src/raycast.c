@@ -4,119 +4,555 @@
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
-#include <math.h>
-#include <png.h>
 #include <time.h>
+#include <getopt.h>
+#include <limits.h>
+#include <omp.h>
 
 #include "scene.h"
 #include "renderer.h"
+#include "image.h"
+#include "loader.h"
+#include "server.h"
+#include "numa.h"
+#include "texture.h"
+#include "paging.h"
+#include "trace.h"
 
-bool writePNGFile(const char* filename, Color* pixels, int width, int heigth) {
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png == NULL) {
+#define WIDTH 1250
+#define HEIGHT 1250
+
+#define HVIEW 0.5
+#define VVIEW 0.5
+
+#define PASSES 1024
+
+#define REBUILD_THRESHOLD 1.5
+
+#define CACHE_SIZE 4
+
+#define CLUSTER_SIZE (1 << 14)
+
+#define MAX_RENDERER_OPTIONS 64
+
+// Renderer settings given on the command line, applied to every renderer that is created
+typedef struct {
+    int count;
+    const char* names[MAX_RENDERER_OPTIONS];
+    const char* values[MAX_RENDERER_OPTIONS];
+} RendererOptions;
+
+static bool addRendererOption(RendererOptions* options, const char* name, const char* value) {
+    if (options->count < MAX_RENDERER_OPTIONS) {
+        options->names[options->count] = name;
+        options->values[options->count] = value;
+        options->count++;
+        return true;
+    } else {
         return false;
     }
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_write_struct(&png, &info);
-        return false;
+}
+
+static bool applyRendererOptions(Renderer* renderer, const RendererOptions* options) {
+    for (int i = 0; i < options->count; i++) {
+        if (!setRendererOption(renderer, options->names[i], options->values[i])) {
+            fprintf(stderr, "invalid value '%s' for option '%s'\n", options->values[i], options->names[i]);
+            return false;
+        }
     }
-    FILE* fp = fopen(filename, "wb");
-    if (fp == NULL) {
-        png_destroy_write_struct(&png, &info);
-        return false;
+    return true;
+}
+
+// Files ending in .pfm keep the linear float values, all others are written as png
+static bool writeImageFile(const char* filename, const Renderer* renderer, float scale, const PngSettings* png_settings) {
+    int length = strlen(filename);
+    if (length >= 4 && strcmp(filename + length - 4, ".pfm") == 0) {
+        return writePFMFile(filename, renderer->buffer, renderer->width, renderer->height, scale);
+    } else {
+        return writePNGFile(filename, renderer->buffer, renderer->width, renderer->height, scale, png_settings);
+    }
+}
+
+// Rendering stops after the given number of passes, or after the first pass that ends more than
+// time_limit seconds after the start if time_limit is positive
+static void renderToFile(Renderer* renderer, Scene* scene, int passes, float time_limit, const char* filename, const PngSettings* png_settings) {
+    clearBuffer(renderer);
+    double start = omp_get_wtime();
+    int done = 0;
+    while (done < passes && (time_limit <= 0 || done == 0 || omp_get_wtime() - start < time_limit)) {
+        renderScene(renderer, scene);
+        done++;
+        if (!writeImageFile(filename, renderer, 1.0 / done, png_settings)) {
+            fprintf(stderr, "failed to write '%s': %s\n", filename, strerror(errno));
+        }
     }
-    png_init_io(png, fp);
-    png_set_IHDR(png, info, width, heigth, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-    png_colorp palette = (png_colorp)png_malloc(png, sizeof(png_color) * PNG_MAX_PALETTE_LENGTH);
-    if (palette == NULL) {
-        fclose(fp);
-        png_destroy_write_struct(&png, &info);
+    if (time_limit > 0) {
+        fprintf(stderr, "rendered %d passes in %.3f s\n", done, omp_get_wtime() - start);
+    }
+}
+
+#define MAX_VIEWS 1024
+
+// Render all views listed in the camera file in one batch. Each line of the file contains the
+// output file followed by renderer options, e.g. "front.png position=0,1,5 direction=0,0,-1".
+static bool renderViews(
+    Scene* scene, const char* cameras_filename, int width, int height, const RendererOptions* defaults, int passes,
+    float time_limit, const PngSettings* png_settings
+) {
+    FILE* file = fopen(cameras_filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "failed to open '%s': %s\n", cameras_filename, strerror(errno));
         return false;
     }
-    png_set_PLTE(png, info, palette, PNG_MAX_PALETTE_LENGTH);
-    png_write_info(png, info);
-    png_set_packing(png);
-    png_bytepp rows = (png_bytepp)png_malloc(png, sizeof(png_bytep) * heigth);
-    for (int i = 0; i < heigth; i++) {
-        png_bytep row = (png_bytep)png_malloc(png, sizeof(png_byte) * width * 3);
-        for (int j = 0; j < width; j++) {
-            for (int k = 0; k < 3; k++) {
-                float value = pixels[i * width + j].v[k];
-                row[3 * j + k] = (png_byte)(fminf(fmaxf(256 * sqrtf(value), 0), 255));
-            }
-        }
-        rows[i] = row;
-    }
-    png_write_image(png, rows);
-    png_write_end(png, info);
-    fclose(fp);
-    for (int i = 0; i < heigth; i++) {
-        png_free(png, rows[i]);
-    }
-    png_free(png, rows);
-    png_free(png, palette);
-    png_destroy_write_struct(&png, &info);
-    return true;
+    Renderer* views = (Renderer*)malloc(sizeof(Renderer) * MAX_VIEWS);
+    Renderer** renderers = (Renderer**)malloc(sizeof(Renderer*) * MAX_VIEWS);
+    char** filenames = (char**)malloc(sizeof(char*) * MAX_VIEWS);
+    int count = 0;
+    bool valid = true;
+    char line[4096];
+    int line_number = 0;
+    while (valid && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char* save;
+        char* filename = strtok_r(line, " \t\n", &save);
+        if (filename == NULL || filename[0] == '#') {
+            continue;
+        } else if (count == MAX_VIEWS) {
+            fprintf(stderr, "%s:%d: too many views\n", cameras_filename, line_number);
+            valid = false;
+            break;
+        }
+        int view_width = width;
+        int view_height = height;
+        char* options[MAX_RENDERER_OPTIONS];
+        int option_count = 0;
+        char* option;
+        while ((option = strtok_r(NULL, " \t\n", &save)) != NULL) {
+            if (strncmp(option, "size=", 5) == 0) {
+                if (sscanf(option + 5, "%ix%i", &view_width, &view_height) != 2 || view_width <= 0 || view_height <= 0) {
+                    fprintf(stderr, "%s:%d: invalid size '%s'\n", cameras_filename, line_number, option + 5);
+                    valid = false;
+                }
+            } else if (option_count == MAX_RENDERER_OPTIONS) {
+                fprintf(stderr, "%s:%d: too many options\n", cameras_filename, line_number);
+                valid = false;
+                break;
+            } else {
+                options[option_count] = option;
+                option_count++;
+            }
+        }
+        Renderer* renderer = &views[count];
+        initRenderer(renderer, view_width, view_height, HVIEW, VVIEW);
+        valid &= applyRendererOptions(renderer, defaults);
+        for (int i = 0; i < option_count; i++) {
+            char* value = strchr(options[i], '=');
+            if (value != NULL) {
+                *value = 0;
+                value++;
+            }
+            if (value == NULL || !setRendererOption(renderer, options[i], value)) {
+                fprintf(stderr, "%s:%d: invalid option '%s'\n", cameras_filename, line_number, options[i]);
+                valid = false;
+            }
+        }
+        renderers[count] = renderer;
+        filenames[count] = strdup(filename);
+        count++;
+    }
+    fclose(file);
+    if (valid) {
+        for (int i = 0; i < count; i++) {
+            clearBuffer(renderers[i]);
+        }
+        double start = omp_get_wtime();
+        int done = 0;
+        while (done < passes && (time_limit <= 0 || done == 0 || omp_get_wtime() - start < time_limit)) {
+            renderScenes(renderers, count, scene);
+            done++;
+        }
+        if (time_limit > 0) {
+            fprintf(stderr, "rendered %d passes in %.3f s\n", done, omp_get_wtime() - start);
+        }
+        for (int i = 0; i < count; i++) {
+            if (!writeImageFile(filenames[i], renderers[i], 1.0 / done, png_settings)) {
+                fprintf(stderr, "failed to write '%s': %s\n", filenames[i], strerror(errno));
+                valid = false;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        freeRenderer(renderers[i]);
+        free(filenames[i]);
+    }
+    free(filenames);
+    free(renderers);
+    free(views);
+    return valid;
 }
 
-#define WIDTH 1250
-#define HEIGHT 1250
+static void printTextureCacheStats() {
+    TextureCacheStats stats;
+    getTextureCacheStats(&stats);
+    if (stats.textures > 0) {
+        unsigned long lookups = stats.hits + stats.misses;
+        fprintf(
+            stderr, "texture cache: %d textures, %lu lookups, %.2f%% misses, %lu evictions, %.1f of %.1f MiB resident\n",
+            stats.textures, lookups, lookups > 0 ? 100.0 * stats.misses / lookups : 0.0, stats.evictions,
+            stats.resident_bytes / 1048576.0, stats.budget_bytes / 1048576.0
+        );
+    }
+}
 
-#define HVIEW 0.5
-#define VVIEW 0.5
+static void printGeometryCacheStats() {
+    GeometryCacheStats stats;
+    getGeometryCacheStats(&stats);
+    if (stats.clusters > 0) {
+        unsigned long lookups = stats.hits + stats.faults;
+        fprintf(
+            stderr, "geometry cache: %d clusters, %lu lookups, %lu faults, %lu evictions, %.1f of %.1f MiB resident\n",
+            stats.clusters, lookups, stats.faults, stats.evictions, stats.resident_bytes / 1048576.0,
+            stats.budget_bytes / 1048576.0
+        );
+    }
+}
+
+static void printBvhStats(const char* name, const BvhNode* bvh, int primitive_count) {
+    BvhStats stats;
+    computeBvhStats(bvh, &stats);
+    if (stats.leaves > 0 || stats.deferred_subtrees > 0) {
+        fprintf(
+            stderr, "%s bvh: sah cost %.2f, %d internal nodes, %d leaves (%.2f per %s), %.1f MiB\n",
+            name, stats.sah_cost, stats.internal_nodes, stats.leaves, stats.leaves / (float)primitive_count,
+            name, stats.memory_bytes / 1048576.0
+        );
+        if (stats.deferred_subtrees > 0) {
+            fprintf(stderr, "%s bvh: %d subtrees not built yet\n", name, stats.deferred_subtrees);
+        }
+        fprintf(
+            stderr, "%s bvh: depth %d at most, %.1f on average, %.1f%% sibling overlap\n",
+            name, stats.max_depth, stats.average_leaf_depth, 100.0 * stats.overlap_ratio
+        );
+        int max_leaves = 0;
+        for (int i = 0; i < BVH_STATS_DEPTHS; i++) {
+            if (stats.leaf_depths[i] > max_leaves) {
+                max_leaves = stats.leaf_depths[i];
+            }
+        }
+        for (int i = 0; i < BVH_STATS_DEPTHS; i++) {
+            if (stats.leaf_depths[i] > 0) {
+                int width = (stats.leaf_depths[i] * 50 + max_leaves - 1) / max_leaves;
+                fprintf(stderr, "  leaves at depth %2d%s %8d %.*s\n", i, i == BVH_STATS_DEPTHS - 1 ? "+" : " ", stats.leaf_depths[i], width, "##################################################");
+            }
+        }
+    }
+}
+
+static void printSceneBvhStats(const Scene* scene) {
+    if (scene->paged != NULL) {
+        fprintf(stderr, "triangle bvh: not available for out-of-core scenes\n");
+    } else {
+        printBvhStats("triangle", scene->bvh, scene->triangle_count);
+    }
+    printBvhStats("primitive", scene->primitive_bvh, scene->primitive_count);
+}
+
+static bool saveTrace(const char* filename) {
+    if (filename != NULL && !writeTrace(filename)) {
+        fprintf(stderr, "failed to write '%s': %s\n", filename, strerror(errno));
+        return false;
+    } else {
+        return true;
+    }
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr, "Usage: %s [OPTIONS] OBJ-FILE OUT-FILE\n", program);
+    fprintf(stderr, "   or: %s [OPTIONS] --cameras CAMERA-FILE OBJ-FILE\n", program);
+    fprintf(stderr, "   or: %s --server [--socket PATH] [--cache N]\n", program);
+    fprintf(stderr, "OBJ-FILE may be gzip compressed (e.g. scene.obj.gz), with scene.mtl.gz and\n");
+    fprintf(stderr, "scene.prim.gz or the uncompressed files next to it.\n");
+    fprintf(stderr, "Images are written as png, or as linear float pfm if the name ends in .pfm.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s, --size WIDTHxHEIGHT  size of the output image (default %dx%d)\n", WIDTH, HEIGHT);
+    fprintf(stderr, "  -n, --samples N          samples per pixel in each pass (default 128)\n");
+    fprintf(stderr, "  -i, --integrator NAME    integrator to use, path, wavefront, light, ao or\n");
+    fprintf(stderr, "                           heatmap (default path)\n");
+    fprintf(stderr, "  -o, --option NAME=VALUE  set any renderer option, e.g. position=0,1,5\n");
+    fprintf(stderr, "  -p, --passes N           number of progressive passes (default %d)\n", PASSES);
+    fprintf(stderr, "      --time SECONDS       stop after the first pass that ends later than SECONDS\n");
+    fprintf(stderr, "                           into rendering, even if not all passes are done\n");
+    fprintf(stderr, "  -f, --frames FIRST:LAST  render an animation, OBJ-FILE and OUT-FILE are printf\n");
+    fprintf(stderr, "                           patterns of the frame number (e.g. frame%%04d.obj)\n");
+    fprintf(stderr, "  -c, --cameras FILE       render all views listed in the file, one per line as\n");
+    fprintf(stderr, "                           OUT-FILE [size=WxH] [position=X,Y,Z] [direction=X,Y,Z]\n");
+    fprintf(stderr, "                           [up=X,Y,Z] [view=H,V] [samples=N] [depth=N]\n");
+    fprintf(stderr, "  -b, --bvh METHOD         bvh construction, midpoint, sah or sbvh (default midpoint)\n");
+    fprintf(stderr, "      --split-budget F     additional triangle references sbvh may create, as a\n");
+    fprintf(stderr, "                           fraction of the triangle count (default 0.3)\n");
+    fprintf(stderr, "      --lazy-bvh           build the subtrees of the bvh only when a ray first enters\n");
+    fprintf(stderr, "                           them, for a faster first image of large scenes\n");
+    fprintf(stderr, "      --reorder            store the triangles and vertecies in the order of the bvh\n");
+    fprintf(stderr, "                           leaves, so that nearby hits are shaded from nearby memory.\n");
+    fprintf(stderr, "                           Can not be combined with --lazy-bvh\n");
+    fprintf(stderr, "      --bvh-stats          print the quality of the bvh after loading the scene, use\n");
+    fprintf(stderr, "                           -i heatmap -o heatmap=nodes|tests to see its traversal\n");
+    fprintf(stderr, "      --png-level N        png compression level from 0 to 9 (default 6)\n");
+    fprintf(stderr, "      --png-filter NAME    png row filter, none, sub, up, average or paeth\n");
+    fprintf(stderr, "                           (default paeth)\n");
+    fprintf(stderr, "      --pin-threads        pin the threads to cpus spread over the numa nodes, and\n");
+    fprintf(stderr, "                           keep a copy of the bvh on every node\n");
+    fprintf(stderr, "      --texture-cache MB   memory budget of the texture tile cache (default 256)\n");
+    fprintf(stderr, "      --out-of-core MB     render from geometry kept in a page file in TMPDIR,\n");
+    fprintf(stderr, "                           loading at most MB of it into memory at a time, also\n");
+    fprintf(stderr, "                           while the scene is loaded\n");
+    fprintf(stderr, "      --server             serve render requests read from stdin or the socket\n");
+    fprintf(stderr, "      --socket PATH        listen on a unix socket instead of stdin\n");
+    fprintf(stderr, "      --cache N            number of scenes kept loaded by the server (default %d)\n", CACHE_SIZE);
+    fprintf(stderr, "      --trace FILE         write a timeline of the work of every thread as a json\n");
+    fprintf(stderr, "                           trace for chrome://tracing or Perfetto\n");
+}
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s OBJ-FILE OUT-FILE\n", argv[0]);
+    static const struct option long_options[] = {
+        { "bvh-stats", no_argument, NULL, 'A' },
+        { "reorder", no_argument, NULL, 'R' },
+        { "lazy-bvh", no_argument, NULL, 'Z' },
+        { "size", required_argument, NULL, 's' },
+        { "samples", required_argument, NULL, 'n' },
+        { "integrator", required_argument, NULL, 'i' },
+        { "option", required_argument, NULL, 'o' },
+        { "passes", required_argument, NULL, 'p' },
+        { "time", required_argument, NULL, 'M' },
+        { "frames", required_argument, NULL, 'f' },
+        { "cameras", required_argument, NULL, 'c' },
+        { "bvh", required_argument, NULL, 'b' },
+        { "split-budget", required_argument, NULL, 'B' },
+        { "png-level", required_argument, NULL, 'L' },
+        { "png-filter", required_argument, NULL, 'F' },
+        { "pin-threads", no_argument, NULL, 'P' },
+        { "texture-cache", required_argument, NULL, 'T' },
+        { "out-of-core", required_argument, NULL, 'G' },
+        { "server", no_argument, NULL, 'S' },
+        { "socket", required_argument, NULL, 'U' },
+        { "cache", required_argument, NULL, 'C' },
+        { "trace", required_argument, NULL, 'J' },
+        { NULL, 0, NULL, 0 },
+    };
+    int width = WIDTH;
+    int height = HEIGHT;
+    RendererOptions renderer_options = { .count = 0 };
+    int passes = PASSES;
+    float time_limit = 0;
+    bool animation = false;
+    int first_frame = 0;
+    int last_frame = 0;
+    const char* cameras_filename = NULL;
+    bool server = false;
+    const char* socket_path = NULL;
+    int cache_size = CACHE_SIZE;
+    const char* trace_filename = NULL;
+    bool bvh_stats = false;
+    BvhBuildSettings bvh_settings = createDefaultBvhBuildSettings();
+    PngSettings png_settings = createDefaultPngSettings();
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:n:i:o:p:f:c:b:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            if (sscanf(optarg, "%ix%i", &width, &height) != 2 || width <= 0 || height <= 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            addRendererOption(&renderer_options, "samples", optarg);
+            break;
+        case 'i':
+            addRendererOption(&renderer_options, "integrator", optarg);
+            break;
+        case 'o': {
+            char* value = strchr(optarg, '=');
+            if (value == NULL || !addRendererOption(&renderer_options, optarg, value + 1)) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            *value = 0;
+        } break;
+        case 'p':
+            passes = atoi(optarg);
+            break;
+        case 'M':
+            if (sscanf(optarg, "%f", &time_limit) != 1 || time_limit <= 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            animation = true;
+            if (sscanf(optarg, "%i:%i", &first_frame, &last_frame) != 2) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            cameras_filename = optarg;
+            break;
+        case 'b':
+            if (strcmp(optarg, "midpoint") == 0) {
+                bvh_settings.method = BVH_BUILD_MIDPOINT;
+            } else if (strcmp(optarg, "sah") == 0) {
+                bvh_settings.method = BVH_BUILD_SAH;
+            } else if (strcmp(optarg, "sbvh") == 0) {
+                bvh_settings.method = BVH_BUILD_SPATIAL;
+            } else {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            if (sscanf(optarg, "%f", &bvh_settings.split_budget) != 1 || bvh_settings.split_budget < 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            bvh_stats = true;
+            break;
+        case 'R':
+            bvh_settings.reorder = true;
+            break;
+        case 'Z':
+            bvh_settings.lazy = true;
+            break;
+        case 'L':
+            if (sscanf(optarg, "%i", &png_settings.compression_level) != 1 || png_settings.compression_level < 0 || png_settings.compression_level > 9) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            if (!parsePngRowFilter(optarg, &png_settings.filter)) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            setThreadPinning(true);
+            bvh_settings.numa_replicas = true;
+            break;
+        case 'T': {
+            int megabytes;
+            if (sscanf(optarg, "%i", &megabytes) != 1 || megabytes <= 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            setTextureCacheBudget((size_t)megabytes << 20);
+        } break;
+        case 'G': {
+            int megabytes;
+            if (sscanf(optarg, "%i", &megabytes) != 1 || megabytes <= 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            bvh_settings.cluster_size = CLUSTER_SIZE;
+            setGeometryCacheBudget((size_t)megabytes << 20);
+        } break;
+        case 'S':
+            server = true;
+            break;
+        case 'U':
+            socket_path = optarg;
+            break;
+        case 'C':
+            cache_size = atoi(optarg);
+            break;
+        case 'J':
+            trace_filename = optarg;
+            enableTracing();
+            break;
+        default:
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    // The lazy bvh has no leaf order to reorder the scene by until it is fully built
+    if (bvh_settings.reorder && bvh_settings.lazy) {
+        fprintf(stderr, "%s: --reorder can not be combined with --lazy-bvh\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (server) {
+        if (argc != optind) {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        bool ok = runServer(socket_path, cache_size, &bvh_settings, &png_settings);
+        ok &= saveTrace(trace_filename);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (cameras_filename != NULL) {
+        if (argc - optind != 1) {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        Scene scene;
+        if (!loadScene(&scene, argv[optind], &bvh_settings)) {
+            return EXIT_FAILURE;
+        }
+        if (bvh_stats) {
+            printSceneBvhStats(&scene);
+        }
+        bool ok = renderViews(&scene, cameras_filename, width, height, &renderer_options, passes, time_limit, &png_settings);
+        printTextureCacheStats();
+        printGeometryCacheStats();
+        freeScene(&scene);
+        ok &= saveTrace(trace_filename);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (argc - optind != 2) {
+        printUsage(argv[0]);
         return EXIT_FAILURE;
     } else {
         srand(time(NULL));
-        FILE* obj_file = fopen(argv[1], "r");
-        if (obj_file == NULL) {
-            fprintf(stderr, "failed to open '%s': %s\n", argv[1], strerror(errno));
+        const char* obj_filename = argv[optind];
+        const char* out_filename = argv[optind + 1];
+        Renderer renderer;
+        initRenderer(&renderer, width, height, HVIEW, VVIEW);
+        if (!applyRendererOptions(&renderer, &renderer_options)) {
+            freeRenderer(&renderer);
             return EXIT_FAILURE;
-        } else {
-            fseek(obj_file, 0, SEEK_END);
-            int size = ftell(obj_file);
-            fseek(obj_file, 0, SEEK_SET);
-            char* data = malloc(size + 1);
-            fread(data, 1, size, obj_file);
-            data[size] = 0;
-            fclose(obj_file);
-            Scene scene;
-            char* mtl_data = NULL;
-            int path_len = strlen(argv[1]);
-            argv[1][path_len - 3] = 'm';
-            argv[1][path_len - 2] = 't';
-            argv[1][path_len - 1] = 'l';
-            FILE* mtl_file = fopen(argv[1], "r");
-            if (mtl_file != NULL) {
-                fseek(mtl_file, 0, SEEK_END);
-                int size = ftell(mtl_file);
-                fseek(mtl_file, 0, SEEK_SET);
-                mtl_data = malloc(size + 1);
-                fread(mtl_data, 1, size, mtl_file);
-                mtl_data[size] = 0;
-                fclose(mtl_file);
-            }
-            loadFromObj(&scene, data, mtl_data);
-            free(mtl_data);
-            free(data);
-            Renderer renderer;
-            initRenderer(&renderer, WIDTH, HEIGHT, HVIEW, VVIEW);
-            clearBuffer(&renderer);
-            for (int i = 0; i < 1024; i++) {
-                renderScene(&renderer, &scene);
-                scaleBuffer(&renderer, 1.0 / (i + 1));
-                if (!writePNGFile(argv[2], renderer.buffer, WIDTH, HEIGHT)) {
-                    fprintf(stderr, "failed to write '%s': %s\n", argv[2], strerror(errno));
+        }
+        Scene scene;
+        if (animation) {
+            char obj_frame[PATH_MAX];
+            char out_frame[PATH_MAX];
+            for (int frame = first_frame; frame <= last_frame; frame++) {
+                snprintf(obj_frame, PATH_MAX, obj_filename, frame);
+                snprintf(out_frame, PATH_MAX, out_filename, frame);
+                bool loaded = frame == first_frame ? loadScene(&scene, obj_frame, &bvh_settings) : loadSceneFrame(&scene, obj_frame, REBUILD_THRESHOLD);
+                if (!loaded) {
+                    if (frame != first_frame) {
+                        freeScene(&scene);
+                    }
+                    freeRenderer(&renderer);
+                    return EXIT_FAILURE;
+                }
+                if (bvh_stats) {
+                    printSceneBvhStats(&scene);
                 }
-                scaleBuffer(&renderer, (i + 1));
+                renderToFile(&renderer, &scene, passes, time_limit, out_frame, &png_settings);
             }
-            freeRenderer(&renderer);
-            freeScene(&scene); 
-            return EXIT_SUCCESS;
+        } else {
+            if (!loadScene(&scene, obj_filename, &bvh_settings)) {
+                freeRenderer(&renderer);
+                return EXIT_FAILURE;
+            }
+            if (bvh_stats) {
+                printSceneBvhStats(&scene);
+            }
+            renderToFile(&renderer, &scene, passes, time_limit, out_filename, &png_settings);
         }
+        printTextureCacheStats();
+        printGeometryCacheStats();
+        freeRenderer(&renderer);
+        freeScene(&scene); 
+        return saveTrace(trace_filename) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 }
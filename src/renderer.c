@@ -3,10 +3,21 @@
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#include <string.h>
 
 #include "vec.h"
 #include "renderer.h"
 #include "intersection.h"
+#include "sampler.h"
+#include "bsdf.h"
+#include "wavefront.h"
+#include "light.h"
+#include "numa.h"
+#include "trace.h"
+
+#define TILE_SIZE 32
+// Probability of sampling diffuse bounces from the path guide instead of the cosine lobe
+#define GUIDED_FRACTION 0.5
 
 void initRenderer(Renderer* renderer, int width, int height, float hview, float vview) {
     renderer->width = width;
@@ -22,146 +33,609 @@ void initRenderer(Renderer* renderer, int width, int height, float hview, float
     renderer->specular_depth_cost = 20;
     renderer->diffuse_depth_cost = 30;
     renderer->transmition_depth_cost = 5;
-    renderer->buffer = (Color*)malloc(sizeof(Color) * width * height);
+    renderer->sample_index = 0;
+    renderer->integrator = INTEGRATOR_PATH;
+    renderer->sort_rays = false;
+    renderer->occlusion_samples = 16;
+    renderer->occlusion_distance = 0;
+    renderer->heatmap = HEATMAP_NODES;
+    renderer->heatmap_scale = 128;
+    renderer->primary_cache = 0;
+    renderer->primary_hits = NULL;
+    renderer->primary_hits_valid = false;
+    renderer->guiding_passes = 0;
+    renderer->guide = NULL;
+    renderer->trained_passes = 0;
+    renderer->guide_updated_passes = 0;
+    renderer->emitters = NULL;
+    atomic_init(&renderer->cancelled, false);
+    renderer->buffer = (Color*)allocateLarge(sizeof(Color) * width * height);
 }
 
 void freeRenderer(Renderer* renderer) {
     free(renderer->buffer);
+    free(renderer->primary_hits);
+    freePathGuide(renderer->guide);
+    freeEmitterList(renderer->emitters);
 }
 
 #include <assert.h>
 
-static Color computeRadiance(Ray* ray, Scene* scene, Renderer* renderer, int depth) {
+// Where a camera path is with respect to the caustic paths, i.e. the ones whose first bounce is
+// diffuse and all later ones specular or transmission. The light integrator traces them from the
+// lights instead, so camera paths do not count the emission at their end.
+typedef enum {
+    CAUSTIC_NONE,
+    // The first hit of a camera path of the light integrator
+    CAUSTIC_PRIMARY,
+    CAUSTIC_AFTER_DIFFUSE,
+    CAUSTIC_PATH,
+} CausticState;
+
+static Color computeRadiance(Ray* ray, Scene* scene, Renderer* renderer, Sampler* sampler, int depth, float travelled, CausticState caustic);
+
+// Trace a sampled direction and weight the incoming radiance with eval / pdf
+static Color traceBsdfSample(
+    Vec3 vert, Vec3 direction, Color eval, float pdf, Scene* scene, Renderer* renderer, Sampler* sampler, int depth, float travelled, CausticState caustic
+) {
+    if (pdf > 0 && !isVec3Null(eval)) {
+        Ray new_ray = createRay(vert, direction);
+        Color color = computeRadiance(&new_ray, scene, renderer, sampler, depth, travelled, caustic);
+        return mulVec3(color, scaleVec3(eval, 1 / pdf));
+    } else {
+        return createVec3(0, 0, 0);
+    }
+}
+
+// Diffuse bounce, guided by the learned incident radiance if the renderer has a path guide. The
+// guided and the cosine weighted directions are combined using one-sample multiple importance
+// sampling, and while the guide is trained the radiance arriving along the direction is recorded.
+static Color traceDiffuseSample(
+    Vec3 vert, Vec3 normal, Color albedo, Scene* scene, Renderer* renderer, Sampler* sampler, int depth, float travelled, CausticState caustic
+) {
+    float u0, u1;
+    sample2D(sampler, &u0, &u1);
+    if (renderer->guide == NULL) {
+        Vec3 direction = sampleLambert(normal, u0, u1);
+        Color eval = evalLambert(albedo, normal, direction);
+        float pdf = lambertPdf(normal, direction);
+        return traceBsdfSample(vert, direction, eval, pdf, scene, renderer, sampler, depth, travelled, caustic);
+    } else {
+        PathGuide* guide = renderer->guide;
+        int region = getGuideRegion(guide, vert);
+        float fraction = isGuideRegionTrained(guide, region) ? GUIDED_FRACTION : 0;
+        Vec3 direction;
+        if (u0 < fraction) {
+            float guide_pdf;
+            direction = sampleGuideDirection(guide, region, u0 / fraction, u1, &guide_pdf);
+        } else {
+            direction = sampleLambert(normal, (u0 - fraction) / (1 - fraction), u1);
+        }
+        float pdf = (1 - fraction) * lambertPdf(normal, direction);
+        if (fraction > 0) {
+            pdf += fraction * guideDirectionPdf(guide, region, direction);
+        }
+        Color eval = evalLambert(albedo, normal, direction);
+        if (pdf > 0 && !isVec3Null(eval)) {
+            Ray new_ray = createRay(vert, direction);
+            Color incoming = computeRadiance(&new_ray, scene, renderer, sampler, depth, travelled, caustic);
+            if (renderer->trained_passes < renderer->guiding_passes) {
+                recordGuideRadiance(guide, region, direction, (incoming.x + incoming.y + incoming.z) / (3 * pdf));
+            }
+            return mulVec3(incoming, scaleVec3(eval, 1 / pdf));
+        } else {
+            return createVec3(0, 0, 0);
+        }
+    }
+}
+
+// Glossy reflection. The random numbers are passed in, because the dielectric kernel draws them
+// before it decides between reflection and refraction.
+static Color traceSpecularSample(
+    Vec3 vert, Vec3 normal, Vec3 incoming, const MaterialProperties* material, float u0, float u1,
+    Scene* scene, Renderer* renderer, Sampler* sampler, int depth, float travelled, CausticState caustic
+) {
+    Vec3 reflection = reflectionDirection(incoming, normal);
+    Vec3 direction = samplePhong(reflection, material->specular_sharpness, u0, u1);
+    float cos_lobe = dotVec3(reflection, direction);
+    Color eval = evalPhong(material->specular_color, material->specular_sharpness, cos_lobe, -dotVec3(incoming, normal), dotVec3(normal, direction));
+    float pdf = phongPdf(reflection, material->specular_sharpness, direction);
+    return traceBsdfSample(vert, direction, eval, pdf, scene, renderer, sampler, depth, travelled, caustic);
+}
+
+// Either reflect or refract, chosen with the probability given by the Fresnel term
+static Color traceDielectricSample(
+    Vec3 vert, Vec3 normal, Vec3 incoming, bool outside, const MaterialProperties* material,
+    Scene* scene, Renderer* renderer, Sampler* sampler, int depth, float travelled, CausticState caustic
+) {
+    float eta = outside ? 1 / material->index_of_refraction : material->index_of_refraction;
+    float cosO = -dotVec3(incoming, normal);
+    float refl = fresnelReflectance(cosO, material->fresnel_r0, eta);
+    float u0, u1;
+    sample2D(sampler, &u0, &u1);
+    if (refl > sampleFloat(sampler)) {
+        if (depth - renderer->specular_depth_cost > 0) {
+            return traceSpecularSample(vert, normal, incoming, material, u0, u1, scene, renderer, sampler, depth - renderer->specular_depth_cost, travelled, caustic);
+        }
+    } else {
+        if (depth - renderer->transmition_depth_cost > 0) {
+            Color transmition_color = scaleVec3(material->transmition_color, material->transmitability);
+            Vec3 microfacet = samplePhong(normal, material->specular_sharpness, u0, u1);
+            Vec3 direction;
+            if (!refractPhongMicrofacet(incoming, microfacet, eta, &direction)) {
+                return createVec3(0, 0, 0);
+            }
+            Color eval = evalPhongTransmission(transmition_color, material->specular_sharpness, incoming, normal, eta, direction);
+            float pdf = phongTransmissionPdf(incoming, normal, eta, material->specular_sharpness, direction);
+            return traceBsdfSample(vert, direction, eval, pdf, scene, renderer, sampler, depth - renderer->transmition_depth_cost, travelled, caustic);
+        }
+    }
+    return createVec3(0, 0, 0);
+}
+
+// Radiance leaving the surface point hit by the ray towards its origin. triangle_id is the id of
+// the hit and travelled is the length of the path up to the surface point, used for the ray
+// footprint.
+static Color shadeSurface(
+    const Ray* ray, int triangle_id, const SurfacePoint* surface, Scene* scene, Renderer* renderer, Sampler* sampler,
+    int depth, float travelled, CausticState caustic
+) {
+    Vec3 vert = surface->position;
+    Vec3 normal = surface->normal;
+    bool outside = true;
+    if (dotVec3(normal, ray->direction) > 0) {
+        outside = false;
+        normal = scaleVec3(normal, -1);
+    }
+    const MaterialProperties* material = &surface->material;
+    // Light that reaches the camera this way is traced from the lights by the light integrator,
+    // unless the light paths can not start on this emitter
+    Color c = material->emission_color;
+    if (caustic == CAUSTIC_PATH && containsEmitter(renderer->emitters, triangle_id)) {
+        c = createVec3(0, 0, 0);
+    }
+    CausticState diffuse_caustic = caustic == CAUSTIC_PRIMARY ? CAUSTIC_AFTER_DIFFUSE : CAUSTIC_NONE;
+    CausticState specular_caustic = caustic == CAUSTIC_AFTER_DIFFUSE || caustic == CAUSTIC_PATH ? CAUSTIC_PATH : CAUSTIC_NONE;
+    int diffuse_depth = depth - renderer->diffuse_depth_cost;
+    int specular_depth = depth - renderer->specular_depth_cost;
+    float u0, u1;
+    switch (material->kind) {
+    case MATERIAL_EMITTER:
+        break;
+    case MATERIAL_LAMBERTIAN:
+        if (diffuse_depth > 0) {
+            c = addVec3(c, traceDiffuseSample(vert, normal, material->diffuse_color, scene, renderer, sampler, diffuse_depth, travelled, diffuse_caustic));
+        }
+        break;
+    case MATERIAL_GLOSSY:
+        if (specular_depth > 0) {
+            sample2D(sampler, &u0, &u1);
+            c = addVec3(c, traceSpecularSample(vert, normal, ray->direction, material, u0, u1, scene, renderer, sampler, specular_depth, travelled, specular_caustic));
+        }
+        break;
+    case MATERIAL_PLASTIC:
+        if (diffuse_depth > 0) {
+            c = addVec3(c, traceDiffuseSample(vert, normal, material->diffuse_color, scene, renderer, sampler, diffuse_depth, travelled, diffuse_caustic));
+        }
+        if (specular_depth > 0) {
+            sample2D(sampler, &u0, &u1);
+            c = addVec3(c, traceSpecularSample(vert, normal, ray->direction, material, u0, u1, scene, renderer, sampler, specular_depth, travelled, specular_caustic));
+        }
+        break;
+    case MATERIAL_DIELECTRIC:
+        if (diffuse_depth > 0 && !isVec3Null(material->diffuse_color)) {
+            c = addVec3(c, traceDiffuseSample(vert, normal, material->diffuse_color, scene, renderer, sampler, diffuse_depth, travelled, diffuse_caustic));
+        }
+        c = addVec3(c, traceDielectricSample(vert, normal, ray->direction, outside, material, scene, renderer, sampler, depth, travelled, specular_caustic));
+        break;
+    }
+    return c;
+}
+
+// travelled is the length of the path up to the origin of the ray, used for the ray footprint
+static Color computeRadiance(Ray* ray, Scene* scene, Renderer* renderer, Sampler* sampler, int depth, float travelled, CausticState caustic) {
     if (depth <= 0) {
         return renderer->void_color;
     } else {
         Intersection intersection = {
             .dist = INFINITY, // Maximum distance
         }; 
-        if (testRayBvhIntersection(ray, scene->bvh, &intersection)) {
-            Vec3 vert0 = scene->vertecies[scene->vertex_indices[intersection.triangle_id][0]];
-            Vec3 vert1 = scene->vertecies[scene->vertex_indices[intersection.triangle_id][1]];
-            Vec3 vert2 = scene->vertecies[scene->vertex_indices[intersection.triangle_id][2]];
-            Vec3 vert = addVec3(
-                scaleVec3(vert0, 1 - intersection.u - intersection.v),
-                addVec3(
-                    scaleVec3(vert1, intersection.u),
-                    scaleVec3(vert2, intersection.v)
-                )
-            );
-            Vec3 norm0 = scene->normals[scene->normal_indices[intersection.triangle_id][0]];
-            Vec3 norm1 = scene->normals[scene->normal_indices[intersection.triangle_id][1]];
-            Vec3 norm2 = scene->normals[scene->normal_indices[intersection.triangle_id][2]];
-            Vec3 normal = addVec3(
-                scaleVec3(norm0, 1 - intersection.u - intersection.v),
-                addVec3(
-                    scaleVec3(norm1, intersection.u),
-                    scaleVec3(norm2, intersection.v)
-                )
-            );
-            bool outside = true;
-            if (dotVec3(normal, ray->direction) > 0) {
-                outside = false;
-                normal = scaleVec3(normal, -1);
-            }
-            int object_id = scene->object_ids[intersection.triangle_id];
-            MaterialProperties* material = &scene->objects[object_id].material;
-            Color c = material->emission_color;
-            if (depth - renderer->diffuse_depth_cost > 0) {
-                if (!isVec3Null(material->diffuse_color)) {
-                    Ray new_ray = createRay(vert, randomVec3InDirection(normal, 1, 1));
-                    Color color = computeRadiance(&new_ray, scene, renderer, depth - renderer->diffuse_depth_cost);
-                    Color diffuse_color = mulVec3(color, material->diffuse_color);
-                    c = addVec3(c, diffuse_color);
-                }
-            }
-            if (material->specular_sharpness != 0) {
-                if (material->transmitability > 0.0 && !isVec3Null(material->transmition_color)) {
-                    float n1 = outside ? 1.0 : material->index_of_refraction;
-                    float n2 = outside ? material->index_of_refraction : 1.0;
-                    float cosO = -dotVec3(ray->direction, normal);
-                    float r0 = (n1 - n2) / (n1 + n2);
-                    r0 *= r0;
-                    float refl = r0 + (1 - r0) * powf(1 - cosO, 5);
-                    if (refl * (float)RAND_MAX > rand()) {
-                        if (depth - renderer->specular_depth_cost > 0) {
-                            Vec3 reflection = subVec3(ray->direction, scaleVec3(normal, 2 * dotVec3(ray->direction, normal)));
-                            Vec3 direction = randomVec3InDirection(reflection, 1, material->specular_sharpness);
-                            Ray new_ray = createRay(vert, direction);
-                            Color color = computeRadiance(&new_ray, scene, renderer, depth - renderer->specular_depth_cost);
-                            Color reflection_color = mulVec3(color, material->specular_color);
-                            c = addVec3(c, reflection_color);
-                        }
-                    } else {
-                        if (depth - renderer->transmition_depth_cost > 0) {
-                            float angle = acosf(cosO);
-                            float sinO = sinf(angle);
-                            Vec3 transmition = addVec3(scaleVec3(ray->direction, n1 / n2), scaleVec3(normal, (cosO * n1 / n2 - sqrtf(1 - sinO * sinO))));
-                            Vec3 direction = randomVec3InDirection(transmition, 1, material->specular_sharpness);
-                            Ray new_ray = createRay(vert, direction);
-                            Color color = computeRadiance(&new_ray, scene, renderer, depth - renderer->transmition_depth_cost);
-                            Color reflection_color = scaleVec3(color, material->transmitability);
-                            reflection_color = mulVec3(reflection_color, material->transmition_color);
-                            c = addVec3(c, reflection_color);
-                        }
-                    }
-                } else if (depth - renderer->specular_depth_cost > 0) {
-                    if (!isVec3Null(material->specular_color)) {
-                        Vec3 reflection = subVec3(ray->direction, scaleVec3(normal, 2 * dotVec3(ray->direction, normal)));
-                        Vec3 direction = randomVec3InDirection(reflection, 1, material->specular_sharpness);
-                        Ray new_ray = createRay(vert, direction);
-                        Color color = computeRadiance(&new_ray, scene, renderer, depth - renderer->specular_depth_cost);
-                        Color specular_color = mulVec3(color, material->specular_color);
-                        c = addVec3(c, specular_color);
+        if (testRaySceneIntersection(ray, scene, &intersection)) {
+            travelled += intersection.dist;
+            SurfacePoint surface;
+            getSurfacePoint(scene, intersection.triangle_id, intersection.u, intersection.v, travelled * pixelSpreadAngle(renderer), &surface);
+            return shadeSurface(ray, intersection.triangle_id, &surface, scene, renderer, sampler, depth, travelled, caustic);
+        } else {
+            return renderer->void_color;
+        }
+    }
+}
+
+// Fast preview shading: emission plus the unoccluded fraction of the hemisphere above the first
+// hit, estimated with a fixed number of cosine weighted any-hit rays
+static Color shadeAmbientOcclusion(
+    const Ray* ray, const SurfacePoint* surface, Scene* scene, Renderer* renderer, Sampler* sampler, float max_dist
+) {
+    Vec3 vert = surface->position;
+    Vec3 normal = surface->normal;
+    if (dotVec3(normal, ray->direction) > 0) {
+        normal = scaleVec3(normal, -1);
+    }
+    const MaterialProperties* material = &surface->material;
+    Color albedo = addVec3(material->diffuse_color, material->specular_color);
+    albedo = addVec3(albedo, scaleVec3(material->transmition_color, material->transmitability));
+    albedo = minVec3(albedo, createVec3(1, 1, 1));
+    int unoccluded = 0;
+    for (int i = 0; i < renderer->occlusion_samples; i++) {
+        float u0, u1;
+        sample2D(sampler, &u0, &u1);
+        Ray occlusion_ray = createRay(vert, sampleLambert(normal, u0, u1));
+        if (!testRaySceneOcclusion(&occlusion_ray, scene, max_dist)) {
+            unoccluded++;
+        }
+    }
+    float visibility = renderer->occlusion_samples > 0 ? unoccluded / (float)renderer->occlusion_samples : 1;
+    return addVec3(material->emission_color, scaleVec3(albedo, visibility));
+}
+
+static Color computeAmbientOcclusion(Ray* ray, Scene* scene, Renderer* renderer, Sampler* sampler, float max_dist) {
+    Intersection intersection = {
+        .dist = INFINITY,
+    };
+    if (testRaySceneIntersection(ray, scene, &intersection)) {
+        SurfacePoint surface;
+        getSurfacePoint(scene, intersection.triangle_id, intersection.u, intersection.v, intersection.dist * pixelSpreadAngle(renderer), &surface);
+        return shadeAmbientOcclusion(ray, &surface, scene, renderer, sampler, max_dist);
+    } else {
+        return renderer->void_color;
+    }
+}
+
+// Color ramp over the number of nodes visited or leaves tested by the camera ray. The color is
+// squared to cancel the gamma correction of the output.
+static Color computeHeatmap(const Ray* ray, Scene* scene, const Renderer* renderer) {
+    Intersection intersection = {
+        .dist = INFINITY,
+    };
+    TraversalCounts counts = {
+        .nodes = 0,
+        .leaves = 0,
+    };
+    countRaySceneIntersection(ray, scene, &intersection, &counts);
+    int count = renderer->heatmap == HEATMAP_NODES ? counts.nodes : counts.leaves;
+    float t = fminf(count / (float)renderer->heatmap_scale, 1);
+    Color color = t < 0.5 ? createVec3(0, 2 * t, 1 - 2 * t) : createVec3(2 * t - 1, 2 - 2 * t, 0);
+    return mulVec3(color, color);
+}
+
+void initCameraFrame(CameraFrame* camera, const Renderer* renderer) {
+    camera->position = renderer->position;
+    camera->right = normalizeVec3(crossVec3(renderer->direction, renderer->up));
+    camera->down = normalizeVec3(crossVec3(renderer->direction, camera->right));
+    camera->forward = normalizeVec3(renderer->direction);
+    camera->horizontal_scale = tanf(renderer->horizontal_view);
+    camera->vertical_scale = tanf(renderer->vertical_view);
+}
+
+float pixelSpreadAngle(const Renderer* renderer) {
+    return tanf(renderer->horizontal_view) / renderer->width;
+}
+
+Ray createCameraRay(const CameraFrame* camera, const Renderer* renderer, float x, float y) {
+    float scale_x = (x / (float)renderer->width - 0.5) * camera->horizontal_scale;
+    float scale_y = (y / (float)renderer->height - 0.5) * camera->vertical_scale;
+    Vec3 direction = normalizeVec3(addVec3(camera->forward, addVec3(scaleVec3(camera->right, scale_x), scaleVec3(camera->down, scale_y))));
+    return createRay(camera->position, direction);
+}
+
+bool projectToCamera(const CameraFrame* camera, const Renderer* renderer, Vec3 point, float* x, float* y) {
+    Vec3 offset = subVec3(point, camera->position);
+    float depth = dotVec3(offset, camera->forward);
+    if (depth <= 0) {
+        return false;
+    }
+    float scale_x = dotVec3(offset, camera->right) / depth;
+    float scale_y = dotVec3(offset, camera->down) / depth;
+    *x = (scale_x / camera->horizontal_scale + 0.5) * renderer->width;
+    *y = (scale_y / camera->vertical_scale + 0.5) * renderer->height;
+    return *x >= 0 && *x < renderer->width && *y >= 0 && *y < renderer->height;
+}
+
+void updatePrimaryHits(Renderer* renderer, const CameraFrame* camera, Scene* scene, int x0, int y0, int x1, int y1) {
+    if (renderer->primary_hits != NULL && !renderer->primary_hits_valid) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                int pixel = y * renderer->width + x;
+                for (int k = 0; k < renderer->primary_cache; k++) {
+                    PrimaryHit* primary = &renderer->primary_hits[pixel * renderer->primary_cache + k];
+                    // The positions are the ones of the first samples of an uncached render
+                    Sampler sampler;
+                    initSampler(&sampler, pixel, k);
+                    float jitter_x, jitter_y;
+                    sample2D(&sampler, &jitter_x, &jitter_y);
+                    Ray ray = createCameraRay(camera, renderer, x + jitter_x, y + jitter_y);
+                    primary->direction = ray.direction;
+                    primary->hit.dist = INFINITY;
+                    primary->hit.triangle_id = -1;
+                    if (testRaySceneIntersection(&ray, scene, &primary->hit)) {
+                        getSurfacePoint(
+                            scene, primary->hit.triangle_id, primary->hit.u, primary->hit.v,
+                            primary->hit.dist * pixelSpreadAngle(renderer), &primary->surface
+                        );
                     }
                 }
             }
-            return c;
-        } else {
-            return renderer->void_color;
         }
     }
 }
 
-void renderScene(Renderer* renderer, Scene* scene) {
-    Vec3 right = normalizeVec3(crossVec3(renderer->direction, renderer->up));
-    Vec3 down = normalizeVec3(crossVec3(renderer->direction, right));
-    Vec3 forward = normalizeVec3(renderer->direction);
-    float horizontal_scale = tanf(renderer->horizontal_view);
-    float vertical_scale = tanf(renderer->vertical_view);
-#pragma omp parallel for schedule(dynamic, 1)
-    for (int y = 0; y < renderer->height; y++) {
-        for (int x = 0; x < renderer->width; x++) {
-            float scale_x = (x / (float)renderer->width - 0.5) * horizontal_scale;
-            float scale_y = (y / (float)renderer->height - 0.5) * vertical_scale;
-            Vec3 direction = normalizeVec3(addVec3(forward, addVec3(scaleVec3(right, scale_x), scaleVec3(down, scale_y))));
+const PrimaryHit* getPrimaryHit(const Renderer* renderer, int x, int y, int s) {
+    if (renderer->primary_hits == NULL) {
+        return NULL;
+    } else {
+        int pixel = y * renderer->width + x;
+        return &renderer->primary_hits[pixel * renderer->primary_cache + (renderer->sample_index + s) % renderer->primary_cache];
+    }
+}
+
+static void renderTile(Renderer* renderer, const CameraFrame* camera, Scene* scene, int x0, int y0, int x1, int y1) {
+    float occlusion_distance = renderer->occlusion_distance;
+    if (occlusion_distance <= 0) {
+        // Default to a tenth of the scene size
+        BoundingBox bounds = getSceneBounds(scene);
+        occlusion_distance = 0.1 * magnitudeVec3(subVec3(bounds.bound[1], bounds.bound[0]));
+    }
+    CausticState first_caustic = renderer->integrator == INTEGRATOR_LIGHT ? CAUSTIC_PRIMARY : CAUSTIC_NONE;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
             Color pixel_color = createVec3(0, 0, 0);
             for (int s = 0; s < renderer->pixel_samples; s++) {
-                Vec3 actual_direction = randomVec3InDirection(direction, 1e-5, 100);
-                Ray ray = createRay(renderer->position, actual_direction);
-                Color color = computeRadiance(&ray, scene, renderer, renderer->depth);
+                Sampler sampler;
+                initSampler(&sampler, y * renderer->width + x, renderer->sample_index + s);
+                // The first two dimensions give a stratified position inside the pixel footprint
+                float jitter_x, jitter_y;
+                sample2D(&sampler, &jitter_x, &jitter_y);
+                const PrimaryHit* primary = getPrimaryHit(renderer, x, y, s);
+                Color color;
+                if (renderer->integrator == INTEGRATOR_HEATMAP) {
+                    Ray ray = createCameraRay(camera, renderer, x + jitter_x, y + jitter_y);
+                    color = computeHeatmap(&ray, scene, renderer);
+                } else if (primary != NULL) {
+                    // Continue from the cached first hit, the jitter is only drawn to keep the
+                    // remaining dimensions of the sampler the same
+                    Ray ray = createRay(camera->position, primary->direction);
+                    if (primary->hit.triangle_id < 0) {
+                        color = renderer->void_color;
+                    } else if (renderer->integrator == INTEGRATOR_AMBIENT_OCCLUSION) {
+                        color = shadeAmbientOcclusion(&ray, &primary->surface, scene, renderer, &sampler, occlusion_distance);
+                    } else if (renderer->depth <= 0) {
+                        color = renderer->void_color;
+                    } else {
+                        color = shadeSurface(&ray, primary->hit.triangle_id, &primary->surface, scene, renderer, &sampler, renderer->depth, primary->hit.dist, first_caustic);
+                    }
+                } else if (renderer->integrator == INTEGRATOR_AMBIENT_OCCLUSION) {
+                    Ray ray = createCameraRay(camera, renderer, x + jitter_x, y + jitter_y);
+                    color = computeAmbientOcclusion(&ray, scene, renderer, &sampler, occlusion_distance);
+                } else {
+                    Ray ray = createCameraRay(camera, renderer, x + jitter_x, y + jitter_y);
+                    color = computeRadiance(&ray, scene, renderer, &sampler, renderer->depth, 0, first_caustic);
+                }
                 pixel_color = addVec3(pixel_color, color);
             }
             pixel_color = scaleVec3(pixel_color, 1.0 / renderer->pixel_samples);
-            Color* pixel = renderer->buffer + (y * renderer->width + x);
-            *pixel = addVec3(*pixel, pixel_color);
+            if (renderer->integrator == INTEGRATOR_LIGHT) {
+                splatToBuffer(renderer, x, y, pixel_color);
+            } else {
+                Color* pixel = renderer->buffer + (y * renderer->width + x);
+                *pixel = addVec3(*pixel, pixel_color);
+            }
+        }
+    }
+}
+
+void splatToBuffer(Renderer* renderer, int x, int y, Color color) {
+    Color* pixel = renderer->buffer + (y * renderer->width + x);
+#pragma omp atomic
+    pixel->x += color.x;
+#pragma omp atomic
+    pixel->y += color.y;
+#pragma omp atomic
+    pixel->z += color.z;
+}
+
+static int tileCount(const Renderer* renderer) {
+    int columns = (renderer->width + TILE_SIZE - 1) / TILE_SIZE;
+    int rows = (renderer->height + TILE_SIZE - 1) / TILE_SIZE;
+    return columns * rows;
+}
+
+void renderScenes(Renderer** renderers, int count, Scene* scene) {
+    double start = beginTraceSpan();
+    CameraFrame* cameras = (CameraFrame*)malloc(sizeof(CameraFrame) * count);
+    int* first_tiles = (int*)malloc(sizeof(int) * (count + 1));
+    first_tiles[0] = 0;
+    for (int i = 0; i < count; i++) {
+        initCameraFrame(&cameras[i], renderers[i]);
+        first_tiles[i + 1] = first_tiles[i] + tileCount(renderers[i]);
+    }
+    bool wavefront = false;
+    for (int i = 0; i < count; i++) {
+        wavefront |= renderers[i]->integrator == INTEGRATOR_WAVEFRONT;
+        Renderer* renderer = renderers[i];
+        if (renderer->primary_cache > 0 && renderer->primary_hits == NULL) {
+            renderer->primary_hits = (PrimaryHit*)allocateLarge(sizeof(PrimaryHit) * renderer->width * renderer->height * renderer->primary_cache);
+            renderer->primary_hits_valid = false;
+        }
+        if (renderer->guiding_passes > 0 && renderer->integrator == INTEGRATOR_PATH && renderer->guide == NULL) {
+            renderer->guide = createPathGuide(getSceneBounds(scene));
+            renderer->trained_passes = 0;
+            renderer->guide_updated_passes = 0;
+        }
+        if (renderer->integrator == INTEGRATOR_LIGHT && renderer->emitters == NULL) {
+            renderer->emitters = createEmitterList(scene);
         }
     }
+#pragma omp parallel
+    {
+        pinCurrentThread();
+        WavefrontState* state = wavefront ? createWavefrontState() : NULL;
+        // All tiles of all views share one queue, so that no thread idles at the end of a view
+#pragma omp for schedule(dynamic, 1)
+        for (int tile = 0; tile < first_tiles[count]; tile++) {
+            int view = 0;
+            while (tile >= first_tiles[view + 1]) {
+                view++;
+            }
+            Renderer* renderer = renderers[view];
+            if (isRenderingCancelled(renderer)) {
+                continue;
+            }
+            int columns = (renderer->width + TILE_SIZE - 1) / TILE_SIZE;
+            int x0 = ((tile - first_tiles[view]) % columns) * TILE_SIZE;
+            int y0 = ((tile - first_tiles[view]) / columns) * TILE_SIZE;
+            int x1 = x0 + TILE_SIZE < renderer->width ? x0 + TILE_SIZE : renderer->width;
+            int y1 = y0 + TILE_SIZE < renderer->height ? y0 + TILE_SIZE : renderer->height;
+            double tile_start = beginTraceSpan();
+            updatePrimaryHits(renderer, &cameras[view], scene, x0, y0, x1, y1);
+            if (renderer->integrator == INTEGRATOR_WAVEFRONT) {
+                renderTileWavefront(state, renderer, &cameras[view], scene, x0, y0, x1, y1);
+            } else if (renderer->integrator == INTEGRATOR_LIGHT) {
+                renderTile(renderer, &cameras[view], scene, x0, y0, x1, y1);
+                renderTileLight(renderer, &cameras[view], scene, x0, y0, x1, y1);
+            } else {
+                renderTile(renderer, &cameras[view], scene, x0, y0, x1, y1);
+            }
+            endTraceSpanArgs("tile", tile_start, "x", x0, "y", y0);
+        }
+        freeWavefrontState(state);
+    }
+    for (int i = 0; i < count; i++) {
+        Renderer* renderer = renderers[i];
+        renderer->sample_index += renderer->pixel_samples;
+        // A cancelled pass may have skipped some of the tiles
+        renderer->primary_hits_valid = renderer->primary_hits != NULL && !isRenderingCancelled(renderer);
+        if (renderer->guide != NULL && renderer->trained_passes < renderer->guiding_passes) {
+            // The guide is updated after the passes 1, 2, 4, 8, ... and after the last training
+            // pass, so that the number of recorded passes doubles with each update
+            int passes = renderer->trained_passes + 1;
+            if ((passes & (passes - 1)) == 0 || passes == renderer->guiding_passes) {
+                double update_start = beginTraceSpan();
+                updatePathGuide(renderer->guide, passes - renderer->guide_updated_passes);
+                endTraceSpan("update path guide", update_start);
+                renderer->guide_updated_passes = passes;
+            }
+            renderer->trained_passes = passes;
+        }
+    }
+    free(first_tiles);
+    free(cameras);
+    endTraceSpan("render pass", start);
+}
+
+void renderScene(Renderer* renderer, Scene* scene) {
+    renderScenes(&renderer, 1, scene);
 }
 
 void scaleBuffer(Renderer* renderer, float scale) {
+    double start = beginTraceSpan();
     for (int i = 0; i < renderer->height; i++) {
         for (int j = 0; j < renderer->width; j++) {
             Color* pixel = renderer->buffer + (i * renderer->width + j);
             *pixel = scaleVec3(*pixel, scale);
         }
     }
+    endTraceSpan("scale buffer", start);
 }
 
 void clearBuffer(Renderer* renderer) {
+    double start = beginTraceSpan();
     for (int i = 0; i < renderer->height; i++) {
         for (int j = 0; j < renderer->width; j++) {
             renderer->buffer[i * renderer->width + j] = createVec3(0, 0, 0);
         }
     }
+    renderer->sample_index = 0;
+    // The camera or the scene may change before the next pass
+    renderer->primary_hits_valid = false;
+    freePathGuide(renderer->guide);
+    renderer->guide = NULL;
+    freeEmitterList(renderer->emitters);
+    renderer->emitters = NULL;
+    endTraceSpan("clear buffer", start);
+}
+
+void cancelRendering(Renderer* renderer) {
+    atomic_store(&renderer->cancelled, true);
+}
+
+bool isRenderingCancelled(Renderer* renderer) {
+    return atomic_load_explicit(&renderer->cancelled, memory_order_relaxed);
+}
+
+static bool parseVec3(const char* value, Vec3* out) {
+    return sscanf(value, "%f,%f,%f", &out->x, &out->y, &out->z) == 3;
+}
+
+bool setRendererOption(Renderer* renderer, const char* name, const char* value) {
+    renderer->primary_hits_valid = false;
+    if (strcmp(name, "position") == 0) {
+        return parseVec3(value, &renderer->position);
+    } else if (strcmp(name, "direction") == 0) {
+        return parseVec3(value, &renderer->direction) && !isVec3Null(renderer->direction);
+    } else if (strcmp(name, "up") == 0) {
+        return parseVec3(value, &renderer->up) && !isVec3Null(renderer->up);
+    } else if (strcmp(name, "void") == 0) {
+        return parseVec3(value, &renderer->void_color);
+    } else if (strcmp(name, "view") == 0) {
+        return sscanf(value, "%f,%f", &renderer->horizontal_view, &renderer->vertical_view) == 2;
+    } else if (strcmp(name, "samples") == 0) {
+        return sscanf(value, "%i", &renderer->pixel_samples) == 1 && renderer->pixel_samples > 0;
+    } else if (strcmp(name, "depth") == 0) {
+        return sscanf(value, "%i", &renderer->depth) == 1;
+    } else if (strcmp(name, "sort_rays") == 0) {
+        int sort;
+        bool valid = sscanf(value, "%i", &sort) == 1;
+        renderer->sort_rays = sort != 0;
+        return valid;
+    } else if (strcmp(name, "occlusion_samples") == 0) {
+        return sscanf(value, "%i", &renderer->occlusion_samples) == 1 && renderer->occlusion_samples >= 0;
+    } else if (strcmp(name, "occlusion_distance") == 0) {
+        return sscanf(value, "%f", &renderer->occlusion_distance) == 1;
+    } else if (strcmp(name, "heatmap") == 0) {
+        if (strcmp(value, "nodes") == 0) {
+            renderer->heatmap = HEATMAP_NODES;
+        } else if (strcmp(value, "tests") == 0) {
+            renderer->heatmap = HEATMAP_TESTS;
+        } else {
+            return false;
+        }
+        return true;
+    } else if (strcmp(name, "heatmap_scale") == 0) {
+        return sscanf(value, "%i", &renderer->heatmap_scale) == 1 && renderer->heatmap_scale > 0;
+    } else if (strcmp(name, "primary_cache") == 0) {
+        free(renderer->primary_hits);
+        renderer->primary_hits = NULL;
+        return sscanf(value, "%i", &renderer->primary_cache) == 1 && renderer->primary_cache >= 0;
+    } else if (strcmp(name, "guiding") == 0) {
+        freePathGuide(renderer->guide);
+        renderer->guide = NULL;
+        return sscanf(value, "%i", &renderer->guiding_passes) == 1 && renderer->guiding_passes >= 0;
+    } else if (strcmp(name, "integrator") == 0) {
+        if (strcmp(value, "path") == 0) {
+            renderer->integrator = INTEGRATOR_PATH;
+        } else if (strcmp(value, "wavefront") == 0) {
+            renderer->integrator = INTEGRATOR_WAVEFRONT;
+        } else if (strcmp(value, "light") == 0) {
+            renderer->integrator = INTEGRATOR_LIGHT;
+        } else if (strcmp(value, "ao") == 0) {
+            renderer->integrator = INTEGRATOR_AMBIENT_OCCLUSION;
+        } else if (strcmp(value, "heatmap") == 0) {
+            renderer->integrator = INTEGRATOR_HEATMAP;
+        } else {
+            return false;
+        }
+        return true;
+    } else {
+        return false;
+    }
 }
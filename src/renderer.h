@@ -1,8 +1,37 @@
 #ifndef _RENDERER_H_
 #define _RENDERER_H_
 
+#include <stdatomic.h>
+
 #include "vec.h"
 #include "scene.h"
+#include "intersection.h"
+#include "guiding.h"
+#include "emitters.h"
+
+typedef enum {
+    INTEGRATOR_PATH,
+    INTEGRATOR_WAVEFRONT,
+    // Path tracing, except for caustics seen on diffuse surfaces, which are traced from the lights
+    INTEGRATOR_LIGHT,
+    INTEGRATOR_AMBIENT_OCCLUSION,
+    // Work done to find the first hit of the camera rays, for judging the bvh
+    INTEGRATOR_HEATMAP,
+} Integrator;
+
+// What the heatmap integrator shows
+typedef enum {
+    HEATMAP_NODES,
+    HEATMAP_TESTS,
+} HeatmapCount;
+
+// First hit of a camera ray through one of the cached sub-sample positions of a pixel
+typedef struct {
+    Vec3 direction;
+    // triangle_id is -1 if the ray missed the scene
+    Intersection hit;
+    SurfacePoint surface;
+} PrimaryHit;
 
 typedef struct {
     Color* buffer;
@@ -19,6 +48,28 @@ typedef struct {
     int specular_depth_cost;
     int diffuse_depth_cost;
     int transmition_depth_cost;
+    int sample_index;
+    Integrator integrator;
+    bool sort_rays;
+    int occlusion_samples;
+    float occlusion_distance;
+    HeatmapCount heatmap;
+    // Count that is shown in full red by the heatmap, lower counts go over green to blue
+    int heatmap_scale;
+    // Number of sub-sample positions per pixel whose first hits are traced once and then reused
+    // by all passes until the buffer is cleared or an option changes, 0 to disable the cache
+    int primary_cache;
+    PrimaryHit* primary_hits;
+    bool primary_hits_valid;
+    // Number of passes the path guide of the path integrator learns from, 0 to disable guiding.
+    // Later passes keep being guided by what was learned.
+    int guiding_passes;
+    PathGuide* guide;
+    int trained_passes;
+    int guide_updated_passes;
+    // Emitters of the scene the light integrator starts its paths on, created by the first pass
+    EmitterList* emitters;
+    atomic_bool cancelled;
 } Renderer;
 
 void initRenderer(Renderer* renderer, int width, int height, float hview, float vview);
@@ -27,8 +78,52 @@ void freeRenderer(Renderer* renderer);
 
 void renderScene(Renderer* renderer, Scene* scene);
 
+// Render one pass of several views of the same scene, sharing the threads between all of them
+void renderScenes(Renderer** renderers, int count, Scene* scene);
+
 void scaleBuffer(Renderer* renderer, float scale);
 
+// Add to a pixel of the buffer while other threads may add to the same pixel
+void splatToBuffer(Renderer* renderer, int x, int y, Color color);
+
 void clearBuffer(Renderer* renderer);
 
+// Stop the current and any later renderScene call as soon as possible, thread safe
+void cancelRendering(Renderer* renderer);
+
+bool isRenderingCancelled(Renderer* renderer);
+
+// Set a camera or sampling setting from its textual form, e.g. "position" and "0,1,2"
+bool setRendererOption(Renderer* renderer, const char* name, const char* value);
+
+// Orthonormal camera frame derived from the renderer settings
+typedef struct {
+    Vec3 position;
+    Vec3 right;
+    Vec3 down;
+    Vec3 forward;
+    float horizontal_scale;
+    float vertical_scale;
+} CameraFrame;
+
+void initCameraFrame(CameraFrame* camera, const Renderer* renderer);
+
+// Create the ray through the (continuous) pixel coordinates x and y
+Ray createCameraRay(const CameraFrame* camera, const Renderer* renderer, float x, float y);
+
+// Continuous pixel coordinates the point is seen at, false if it is behind the camera or outside
+// of the image
+bool projectToCamera(const CameraFrame* camera, const Renderer* renderer, Vec3 point, float* x, float* y);
+
+// Trace the camera rays of the cached sub-sample positions in the tile, unless the cache is valid
+void updatePrimaryHits(Renderer* renderer, const CameraFrame* camera, Scene* scene, int x0, int y0, int x1, int y1);
+
+// The cached first hit for sample s of the current pass of the pixel, NULL if there is no cache.
+// The samples of every pass cycle through the cached positions.
+const PrimaryHit* getPrimaryHit(const Renderer* renderer, int x, int y, int s);
+
+// Angle covered by one pixel. Multiplied by the length of a path it gives the width of the ray
+// cone, which is used to filter textures.
+float pixelSpreadAngle(const Renderer* renderer);
+
 #endif
\ No newline at end of file
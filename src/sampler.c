@@ -0,0 +1,81 @@
+
+#include "sampler.h"
+
+static uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash based Owen scrambling (Burley 2020, with the constants proposed by Vegdahl)
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x = laineKarrasPermutation(x, seed);
+    return reverseBits(x);
+}
+
+// The first Sobol dimension is the van der Corput sequence
+static uint32_t sobolDimension0(uint32_t index) {
+    return reverseBits(index);
+}
+
+// The second Sobol dimension has the direction numbers v_i = v_{i-1} ^ (v_{i-1} >> 1)
+static uint32_t sobolDimension1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1U << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+uint32_t hashUint32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hashCombine(uint32_t seed, uint32_t v) {
+    return seed ^ (hashUint32(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+static float toUnitFloat(uint32_t x) {
+    return (x >> 8) * (1.0f / (1 << 24)); // Strictly less than one
+}
+
+void initSampler(Sampler* sampler, uint32_t pixel, uint32_t index) {
+    sampler->seed = hashUint32(pixel);
+    sampler->index = index;
+    sampler->dimension = 0;
+}
+
+float sampleFloat(Sampler* sampler) {
+    uint32_t seed = hashCombine(sampler->seed, sampler->dimension);
+    uint32_t index = nestedUniformScramble(sampler->index, seed);
+    sampler->dimension++;
+    return toUnitFloat(nestedUniformScramble(sobolDimension0(index), hashCombine(seed, 0)));
+}
+
+void sample2D(Sampler* sampler, float* u0, float* u1) {
+    uint32_t seed = hashCombine(sampler->seed, sampler->dimension);
+    uint32_t index = nestedUniformScramble(sampler->index, seed);
+    sampler->dimension++;
+    *u0 = toUnitFloat(nestedUniformScramble(sobolDimension0(index), hashCombine(seed, 0)));
+    *u1 = toUnitFloat(nestedUniformScramble(sobolDimension1(index), hashCombine(seed, 1)));
+}
+
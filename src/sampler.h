@@ -0,0 +1,22 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include <stdint.h>
+
+// Owen-scrambled Sobol sampler. Each pair of dimensions is a scrambled and shuffled copy of the
+// first two Sobol dimensions (padded 2D sampling), decorrelated per pixel and per dimension.
+typedef struct {
+    uint32_t seed;
+    uint32_t index;
+    uint32_t dimension;
+} Sampler;
+
+void initSampler(Sampler* sampler, uint32_t pixel, uint32_t index);
+
+float sampleFloat(Sampler* sampler);
+
+void sample2D(Sampler* sampler, float* u0, float* u1);
+
+uint32_t hashUint32(uint32_t x);
+
+#endif
@@ -3,8 +3,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
 
 #include "scene.h"
+#include "numa.h"
+#include "texture.h"
+#include "paging.h"
+#include "trace.h"
 
 MaterialProperties createDefaultMaterial() {
     MaterialProperties ret = {
@@ -15,18 +20,296 @@ MaterialProperties createDefaultMaterial() {
         .specular_sharpness = 1,
         .transmitability = 0.0,
         .index_of_refraction = 1.5,
+        .diffuse_texture = -1,
+        .specular_texture = -1,
+        .emission_texture = -1,
     };
+    classifyMaterial(&ret);
     return ret;
 }
 
+// Textures only scale the colors, so a texel can make a lobe black but never add one
+void classifyMaterial(MaterialProperties* material) {
+    bool diffuse = !isVec3Null(material->diffuse_color);
+    bool specular = material->specular_sharpness != 0 && !isVec3Null(material->specular_color);
+    bool dielectric = material->specular_sharpness != 0 && material->transmitability > 0.0 && !isVec3Null(material->transmition_color);
+    if (dielectric) {
+        material->kind = MATERIAL_DIELECTRIC;
+    } else if (diffuse && specular) {
+        material->kind = MATERIAL_PLASTIC;
+    } else if (specular) {
+        material->kind = MATERIAL_GLOSSY;
+    } else if (diffuse) {
+        material->kind = MATERIAL_LAMBERTIAN;
+    } else {
+        material->kind = MATERIAL_EMITTER;
+    }
+    float r0 = (1 - material->index_of_refraction) / (1 + material->index_of_refraction);
+    material->fresnel_r0 = r0 * r0;
+}
+
+static void replicateSceneBvh(Scene* scene) {
+    scene->bvh_replicas = NULL;
+    int node_count = getNumaNodeCount();
+    // Lazy trees keep changing while they are used, so there is no fixed tree to copy
+    if (scene->bvh_settings.numa_replicas && !scene->bvh_settings.lazy && node_count > 1 && scene->bvh != NULL) {
+        BvhNode** replicas = (BvhNode**)calloc(node_count, sizeof(BvhNode*));
+        bool* claimed = (bool*)calloc(node_count, sizeof(bool));
+        // The first thread on each node makes the copy, so that first touch places it on that node
+#pragma omp parallel
+        {
+            pinCurrentThread();
+            int node = getCurrentNumaNode();
+            bool copy = false;
+#pragma omp critical
+            {
+                copy = !claimed[node];
+                claimed[node] = true;
+            }
+            if (copy) {
+                replicas[node] = copyBvhCompact(scene->bvh);
+            }
+        }
+        for (int i = 0; i < node_count; i++) {
+            if (!claimed[i]) {
+                // No thread runs on this node, share the original tree
+                replicas[i] = scene->bvh;
+            }
+        }
+        free(claimed);
+        scene->bvh_replicas = replicas;
+    }
+}
+
+static void freeSceneBvhReplicas(Scene* scene) {
+    if (scene->bvh_replicas != NULL) {
+        for (int i = 0; i < getNumaNodeCount(); i++) {
+            if (scene->bvh_replicas[i] != scene->bvh) {
+                free(scene->bvh_replicas[i]);
+            }
+        }
+        free(scene->bvh_replicas);
+        scene->bvh_replicas = NULL;
+    }
+}
+
+BvhNode* getSceneBvh(const Scene* scene) {
+    if (scene->bvh_replicas != NULL) {
+        return scene->bvh_replicas[getCurrentNumaNode()];
+    } else {
+        return scene->bvh;
+    }
+}
+
+BoundingBox getSceneBounds(const Scene* scene) {
+    BoundingBox ret;
+    if (scene->paged != NULL) {
+        ret = getPagedGeometryBounds(scene->paged);
+    } else if (scene->bvh != NULL) {
+        ret = getBvhBounds(scene->bvh);
+    } else {
+        ret.bound[0] = createVec3(INFINITY, INFINITY, INFINITY);
+        ret.bound[1] = createVec3(-INFINITY, -INFINITY, -INFINITY);
+    }
+    if (scene->primitive_bvh != NULL) {
+        BoundingBox primitives = getBvhBounds(scene->primitive_bvh);
+        ret.bound[0] = minVec3(ret.bound[0], primitives.bound[0]);
+        ret.bound[1] = maxVec3(ret.bound[1], primitives.bound[1]);
+    }
+    return ret;
+}
+
+bool testRaySceneIntersection(const Ray* ray, Scene* scene, Intersection* out) {
+    bool hit = false;
+    if (scene->paged != NULL) {
+        hit = testRayPagedIntersection(ray, scene->paged, out);
+    } else {
+        BvhNode* bvh = getSceneBvh(scene);
+        hit = bvh != NULL && testRayBvhIntersection(ray, bvh, out);
+    }
+    // The closest hit so far limits the traversal of the primitives
+    if (scene->primitive_bvh != NULL && testRayBvhIntersection(ray, scene->primitive_bvh, out)) {
+        hit = true;
+    }
+    return hit;
+}
+
+bool countRaySceneIntersection(const Ray* ray, Scene* scene, Intersection* out, TraversalCounts* counts) {
+    bool hit = false;
+    if (scene->paged != NULL) {
+        hit = testRayPagedIntersection(ray, scene->paged, out);
+    } else {
+        BvhNode* bvh = getSceneBvh(scene);
+        hit = bvh != NULL && countRayBvhIntersection(ray, bvh, out, counts);
+    }
+    if (scene->primitive_bvh != NULL && countRayBvhIntersection(ray, scene->primitive_bvh, out, counts)) {
+        hit = true;
+    }
+    return hit;
+}
+
+bool testRaySceneOcclusion(const Ray* ray, Scene* scene, float max_dist) {
+    if (scene->primitive_bvh != NULL && testRayBvhOcclusion(ray, scene->primitive_bvh, max_dist)) {
+        return true;
+    } else if (scene->paged != NULL) {
+        return testRayPagedOcclusion(ray, scene->paged, max_dist);
+    } else {
+        BvhNode* bvh = getSceneBvh(scene);
+        return bvh != NULL && testRayBvhOcclusion(ray, bvh, max_dist);
+    }
+}
+
 void freeScene(Scene* scene) {
+    freeSceneBvhReplicas(scene);
+    freePagedGeometry(scene->paged);
     free(scene->vertecies);
     free(scene->normals);
     free(scene->vertex_indices);
     free(scene->normal_indices);
     free(scene->object_ids);
+    free(scene->vertex_order);
+    free(scene->normal_order);
     free(scene->objects);
+    free(scene->texcoords);
+    free(scene->texcoord_indices);
+    for (int i = 0; i < scene->texture_count; i++) {
+        releaseTexture(scene->textures[i]);
+    }
+    free(scene->textures);
     freeBvh(scene->bvh);
+    free(scene->primitives);
+    free(scene->primitive_materials);
+    freeBvh(scene->primitive_bvh);
+}
+
+void interpolateTriangle(const Scene* scene, int triangle_id, float u, float v, Vec3* position, Vec3* normal) {
+    Vec3 vert0 = scene->vertecies[scene->vertex_indices[triangle_id][0]];
+    Vec3 vert1 = scene->vertecies[scene->vertex_indices[triangle_id][1]];
+    Vec3 vert2 = scene->vertecies[scene->vertex_indices[triangle_id][2]];
+    *position = addVec3(
+        scaleVec3(vert0, 1 - u - v),
+        addVec3(
+            scaleVec3(vert1, u),
+            scaleVec3(vert2, v)
+        )
+    );
+    if (scene->normal_indices[triangle_id][0] < 0) {
+        // Faces given without normals are flat
+        *normal = normalizeVec3(crossVec3(subVec3(vert1, vert0), subVec3(vert2, vert0)));
+    } else {
+        Vec3 norm0 = scene->normals[scene->normal_indices[triangle_id][0]];
+        Vec3 norm1 = scene->normals[scene->normal_indices[triangle_id][1]];
+        Vec3 norm2 = scene->normals[scene->normal_indices[triangle_id][2]];
+        *normal = normalizeVec3(addVec3(
+            scaleVec3(norm0, 1 - u - v),
+            addVec3(
+                scaleVec3(norm1, u),
+                scaleVec3(norm2, v)
+            )
+        ));
+    }
+}
+
+static float parseNumber(const char* content, int* offset) {
+    char tmp[128];
+    while (content[*offset] == ' ') {
+        (*offset)++;
+    }
+    int num_start = *offset;
+    while (isdigit(content[*offset]) || content[*offset] == '.' || content[*offset] == '-' || content[*offset] == '+' || content[*offset] == 'e' || content[*offset] == 'E') {
+        (*offset)++;
+    }
+    int len = *offset - num_start < 127 ? *offset - num_start : 127;
+    memcpy(tmp, content + num_start, len);
+    tmp[len] = 0;
+    return atof(tmp);
+}
+
+// Texture space footprint of a surface relative to its world space size, in texels
+static float texelDensity(float world_area, float texture_area, int texture) {
+    int width, height;
+    getTextureSize(texture, &width, &height);
+    return world_area > 0 ? sqrtf(texture_area * width * height / world_area) : 0;
+}
+
+static Color applyTexture(float world_area, float texture_area, int texture, Vec3 texcoord, float footprint, Color color) {
+    if (texture < 0) {
+        return color;
+    } else {
+        float lod = log2f(footprint * texelDensity(world_area, texture_area, texture));
+        return mulVec3(color, sampleTexture(texture, texcoord.x, texcoord.y, lod));
+    }
+}
+
+static void applyTextures(float world_area, float texture_area, Vec3 texcoord, float footprint, MaterialProperties* material) {
+    material->diffuse_color = applyTexture(world_area, texture_area, material->diffuse_texture, texcoord, footprint, material->diffuse_color);
+    material->specular_color = applyTexture(world_area, texture_area, material->specular_texture, texcoord, footprint, material->specular_color);
+    material->emission_color = applyTexture(world_area, texture_area, material->emission_texture, texcoord, footprint, material->emission_color);
+}
+
+// The surface parameters are the ones computed by the intersection of the primitive leaf
+static void getPrimitiveSurfacePoint(const Scene* scene, int primitive_id, float u, float v, float footprint, SurfacePoint* out) {
+    const Primitive* primitive = &scene->primitives[primitive_id];
+    float world_area;
+    float texture_area = 1;
+    switch (primitive->kind) {
+    case BVH_NODE_SPHERE: {
+        // u is the longitude and v the latitude
+        float azimuthal = (u - 0.5) * 2 * PI;
+        float incline = (v - 0.5) * PI;
+        out->normal = createVec3(cosf(incline) * cosf(azimuthal), sinf(incline), cosf(incline) * sinf(azimuthal));
+        out->position = addVec3(primitive->position, scaleVec3(out->normal, primitive->radius));
+        out->texcoord = createVec3(u, v, 0);
+        world_area = 4 * PI * primitive->radius * primitive->radius;
+    } break;
+    case BVH_NODE_DISK: {
+        Vec3 cross = crossVec3(primitive->edges[0], primitive->edges[1]);
+        out->normal = normalizeVec3(cross);
+        out->position = addVec3(primitive->position, addVec3(scaleVec3(primitive->edges[0], u), scaleVec3(primitive->edges[1], v)));
+        // The disk is inscribed into the unit texture square
+        out->texcoord = createVec3((u + 1) / 2, (v + 1) / 2, 0);
+        world_area = PI * magnitudeVec3(cross);
+        texture_area = PI / 4;
+    } break;
+    default: {
+        Vec3 cross = crossVec3(primitive->edges[0], primitive->edges[1]);
+        out->normal = normalizeVec3(cross);
+        out->position = addVec3(primitive->position, addVec3(scaleVec3(primitive->edges[0], u), scaleVec3(primitive->edges[1], v)));
+        out->texcoord = createVec3(u, v, 0);
+        world_area = magnitudeVec3(cross);
+    } break;
+    }
+    out->material = scene->primitive_materials[primitive_id];
+    applyTextures(world_area, texture_area, out->texcoord, footprint, &out->material);
+}
+
+void getSurfacePoint(const Scene* scene, int triangle_id, float u, float v, float footprint, SurfacePoint* out) {
+    if (triangle_id >= scene->triangle_count) {
+        getPrimitiveSurfacePoint(scene, triangle_id - scene->triangle_count, u, v, footprint, out);
+        return;
+    } else if (scene->paged != NULL) {
+        getPagedSurfacePoint(scene->paged, triangle_id, u, v, footprint, out);
+        return;
+    }
+    interpolateTriangle(scene, triangle_id, u, v, &out->position, &out->normal);
+    out->material = scene->objects[scene->object_ids[triangle_id]].material;
+    if (
+        scene->texcoord_indices != NULL && scene->texcoord_indices[triangle_id][0] >= 0
+        && scene->texcoord_indices[triangle_id][1] >= 0 && scene->texcoord_indices[triangle_id][2] >= 0
+    ) {
+        Vec3 tex0 = scene->texcoords[scene->texcoord_indices[triangle_id][0]];
+        Vec3 tex1 = scene->texcoords[scene->texcoord_indices[triangle_id][1]];
+        Vec3 tex2 = scene->texcoords[scene->texcoord_indices[triangle_id][2]];
+        out->texcoord = addVec3(scaleVec3(tex0, 1 - u - v), addVec3(scaleVec3(tex1, u), scaleVec3(tex2, v)));
+        Vec3 vert0 = scene->vertecies[scene->vertex_indices[triangle_id][0]];
+        Vec3 vert1 = scene->vertecies[scene->vertex_indices[triangle_id][1]];
+        Vec3 vert2 = scene->vertecies[scene->vertex_indices[triangle_id][2]];
+        float world_area = magnitudeVec3(crossVec3(subVec3(vert1, vert0), subVec3(vert2, vert0)));
+        float texture_area = fabsf((tex1.x - tex0.x) * (tex2.y - tex0.y) - (tex2.x - tex0.x) * (tex1.y - tex0.y));
+        applyTextures(world_area, texture_area, out->texcoord, footprint, &out->material);
+    } else {
+        out->texcoord = createVec3(0, 0, 0);
+    }
 }
 
 typedef struct {
@@ -57,6 +340,7 @@ static void addMaterial(MaterialList* list, char* name, MaterialProperties mat)
         list->names = (char**)realloc(list->names, sizeof(char*) * list->capacity);
         list->props = (MaterialProperties*)realloc(list->props, sizeof(MaterialProperties) * list->capacity);
     }
+    classifyMaterial(&mat);
     list->names[list->count] = name;
     list->props[list->count] = mat;
     list->count++;
@@ -71,7 +355,44 @@ static MaterialProperties getMaterial(MaterialList* list, const char* name) {
     return createDefaultMaterial();
 }
 
-static void loadMaterials(MaterialList* list, const char* mtl_content) {
+static void addSceneTexture(Scene* scene, int texture) {
+    scene->textures = (int*)realloc(scene->textures, sizeof(int) * (scene->texture_count + 1));
+    scene->textures[scene->texture_count] = texture;
+    scene->texture_count++;
+}
+
+// Load the texture map named at the end of the line, options in front of the name are ignored
+static int loadTextureMap(Scene* scene, const char* mtl_content, int offset, const char* directory) {
+    int line_end = offset;
+    while (mtl_content[line_end] != 0 && mtl_content[line_end] != '\n' && mtl_content[line_end] != '\r') {
+        line_end++;
+    }
+    while (line_end > offset && mtl_content[line_end - 1] == ' ') {
+        line_end--;
+    }
+    int name_start = line_end;
+    while (name_start > offset && mtl_content[name_start - 1] != ' ') {
+        name_start--;
+    }
+    int dir_len = directory != NULL && mtl_content[name_start] != '/' ? strlen(directory) : 0;
+    int len = line_end - name_start;
+    char* filename = (char*)malloc(sizeof(char) * (dir_len + len + 1));
+    if (dir_len > 0) {
+        memcpy(filename, directory, dir_len);
+    }
+    memcpy(filename + dir_len, mtl_content + name_start, len);
+    filename[dir_len + len] = 0;
+    int texture = loadTexture(filename);
+    if (texture < 0) {
+        fprintf(stderr, "failed to load texture '%s'\n", filename);
+    } else {
+        addSceneTexture(scene, texture);
+    }
+    free(filename);
+    return texture;
+}
+
+static void loadMaterials(MaterialList* list, const char* mtl_content, Scene* scene, const char* directory) {
     char tmp[128];
     MaterialProperties props = createDefaultMaterial();
     char* last_name = NULL;
@@ -176,6 +497,14 @@ static void loadMaterials(MaterialList* list, const char* mtl_content) {
                         props.transmition_color.v[k] = atof(tmp);
                     }
                 }
+            } else if (strncmp(mtl_content + offset, "map_K", 5) == 0 && mtl_content[offset + 6] == ' ') {
+                if (mtl_content[offset + 5] == 'd') {
+                    props.diffuse_texture = loadTextureMap(scene, mtl_content, offset + 7, directory);
+                } else if (mtl_content[offset + 5] == 's') {
+                    props.specular_texture = loadTextureMap(scene, mtl_content, offset + 7, directory);
+                } else if (mtl_content[offset + 5] == 'e') {
+                    props.emission_texture = loadTextureMap(scene, mtl_content, offset + 7, directory);
+                }
             } else if (strncmp(mtl_content + offset, "newmtl ", 7) == 0) {
                 if (last_name != NULL) {
                     addMaterial(list, last_name, props);
@@ -204,60 +533,222 @@ static void loadMaterials(MaterialList* list, const char* mtl_content) {
     }
 }
 
-void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content) {
-    MaterialList mtl_list;
-    initMaterialList(&mtl_list);
-    loadMaterials(&mtl_list, mtl_content);
-    char tmp[128];
-    int vertex_count = 0;
-    int normal_count = 0;
-    int triangle_count = 0;
-    int object_count = 0;
+// Read the name at offset up to the end of the line into name, which has room for len characters
+static void parseName(const char* content, int* offset, char* name, int len) {
+    while (content[*offset] == ' ') {
+        (*offset)++;
+    }
+    int name_start = *offset;
+    while (content[*offset] != 0 && content[*offset] != '\n' && content[*offset] != '\r') {
+        (*offset)++;
+    }
+    int name_len = *offset - name_start < len - 1 ? *offset - name_start : len - 1;
+    memcpy(name, content + name_start, name_len);
+    name[name_len] = 0;
+}
+
+static void loadPrimitives(Scene* scene, const char* prim_content, MaterialList* mtl_list) {
+    int count = 0;
     int offset = 0;
-    // Count the number of vertecies, normals and triangles
-    while (obj_content[offset] != 0) {
-        if (obj_content[offset] != '#') {
-            if (obj_content[offset] == 'v') {
-                if (obj_content[offset + 1] == ' ') {
-                    vertex_count++;
-                } else if (obj_content[offset + 1] == 'n') {
-                    normal_count++;
-                }
-            } else if (obj_content[offset] == 'f' && obj_content[offset + 1] == ' ') {
-                int face_vert_count = 0;
-                for (int i = offset; obj_content[i] != '\n' && obj_content[i] != 0; i++) {
-                    if (obj_content[i] == ' ' && obj_content[i + 1] >= '0' && obj_content[i + 1] <= '9') {
-                        face_vert_count++;
-                    }
+    while (prim_content[offset] != 0) {
+        if (
+            strncmp(prim_content + offset, "sphere ", 7) == 0 || strncmp(prim_content + offset, "disk ", 5) == 0
+            || strncmp(prim_content + offset, "quad ", 5) == 0
+        ) {
+            count++;
+        }
+        while (prim_content[offset] != '\n' && prim_content[offset] != 0) {
+            offset++;
+        }
+        if (prim_content[offset] == '\n') {
+            offset++;
+        }
+    }
+    Primitive* primitives = (Primitive*)malloc(sizeof(Primitive) * count);
+    MaterialProperties* materials = (MaterialProperties*)malloc(sizeof(MaterialProperties) * count);
+    MaterialProperties material = createDefaultMaterial();
+    int primitive_id = 0;
+    offset = 0;
+    while (prim_content[offset] != 0) {
+        Primitive* primitive = &primitives[primitive_id];
+        if (strncmp(prim_content + offset, "sphere ", 7) == 0) {
+            offset += 7;
+            primitive->kind = BVH_NODE_SPHERE;
+            for (int k = 0; k < 3; k++) {
+                primitive->position.v[k] = parseNumber(prim_content, &offset);
+            }
+            primitive->radius = parseNumber(prim_content, &offset);
+            materials[primitive_id] = material;
+            primitive_id++;
+        } else if (strncmp(prim_content + offset, "disk ", 5) == 0) {
+            offset += 5;
+            primitive->kind = BVH_NODE_DISK;
+            Vec3 normal;
+            for (int k = 0; k < 3; k++) {
+                primitive->position.v[k] = parseNumber(prim_content, &offset);
+            }
+            for (int k = 0; k < 3; k++) {
+                normal.v[k] = parseNumber(prim_content, &offset);
+            }
+            float radius = parseNumber(prim_content, &offset);
+            // Two orthogonal half axes of the length of the radius, with the normal as their cross product
+            normal = normalizeVec3(normal);
+            Vec3 other = fabsf(normal.x) > 0.9 ? createVec3(0, 1, 0) : createVec3(1, 0, 0);
+            Vec3 tangent = normalizeVec3(crossVec3(other, normal));
+            primitive->edges[0] = scaleVec3(tangent, radius);
+            primitive->edges[1] = scaleVec3(crossVec3(normal, tangent), radius);
+            materials[primitive_id] = material;
+            primitive_id++;
+        } else if (strncmp(prim_content + offset, "quad ", 5) == 0) {
+            offset += 5;
+            primitive->kind = BVH_NODE_QUAD;
+            for (int k = 0; k < 3; k++) {
+                primitive->position.v[k] = parseNumber(prim_content, &offset);
+            }
+            for (int i = 0; i < 2; i++) {
+                for (int k = 0; k < 3; k++) {
+                    primitive->edges[i].v[k] = parseNumber(prim_content, &offset);
                 }
-                triangle_count += face_vert_count - 2;
-            } else if (obj_content[offset] == 'o' && obj_content[offset + 1] == ' ') {
-                object_count++;
             }
+            materials[primitive_id] = material;
+            primitive_id++;
+        } else if (strncmp(prim_content + offset, "usemtl ", 7) == 0) {
+            char name[128];
+            offset += 7;
+            parseName(prim_content, &offset, name, sizeof(name));
+            material = getMaterial(mtl_list, name);
         }
-        while (obj_content[offset] != '\n' && obj_content[offset] != 0) {
+        while (prim_content[offset] != '\n' && prim_content[offset] != 0) {
             offset++;
         }
-        if (obj_content[offset] == '\n') {
+        if (prim_content[offset] == '\n') {
             offset++;
         }
     }
-    Vec3* vertecies = (Vec3*)malloc(sizeof(Vec3) * vertex_count);
-    Vec3* normals = (Vec3*)malloc(sizeof(Vec3) * normal_count);
-    int (*vertex_indices)[3] = (int(*)[3])malloc(sizeof(int[3]) * triangle_count);
-    int (*normal_indices)[3] = (int(*)[3])malloc(sizeof(int[3]) * triangle_count);
-    int* object_ids = (int*)malloc(sizeof(int) * triangle_count);
-    Object* objects = (Object*)malloc(sizeof(Object) * object_count);
+    scene->primitives = primitives;
+    scene->primitive_materials = materials;
+    scene->primitive_count = count;
+    scene->primitive_bvh = count > 0 ? buildPrimitiveBvh(primitives, count, scene->triangle_count) : NULL;
+}
+
+static void* permuteArray(void* array, size_t size, const int* order, int count) {
+    char* ret = (char*)allocateLarge(size * count);
+    for (int i = 0; i < count; i++) {
+        memcpy(ret + size * i, (char*)array + size * order[i], size);
+    }
+    free(array);
+    return ret;
+}
+
+// Number the values in the order the triangles first use them, unused ones go to the end. Indices
+// outside of the array, like the -1 of missing texture coordinates, are kept. Returns the new index
+// of every value.
+static int* reorderAttribute(int (*indices)[3], int triangle_count, Vec3** values, int count) {
+    int* new_ids = (int*)malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        new_ids[i] = -1;
+    }
+    int next_id = 0;
+    for (int i = 0; i < triangle_count; i++) {
+        for (int k = 0; k < 3; k++) {
+            int id = indices[i][k];
+            if (id >= 0 && id < count) {
+                if (new_ids[id] < 0) {
+                    new_ids[id] = next_id;
+                    next_id++;
+                }
+                indices[i][k] = new_ids[id];
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (new_ids[i] < 0) {
+            new_ids[i] = next_id;
+            next_id++;
+        }
+    }
+    Vec3* reordered = (Vec3*)allocateLarge(sizeof(Vec3) * count);
+    for (int i = 0; i < count; i++) {
+        reordered[new_ids[i]] = (*values)[i];
+    }
+    free(*values);
+    *values = reordered;
+    return new_ids;
+}
+
+// Bring the triangles into the order of the leaves of the bvh, and the vertecies, normals and
+// texture coordinates into the order they are first used by them
+static void reorderScene(Scene* scene) {
+    int* order = (int*)malloc(sizeof(int) * scene->triangle_count);
+    renumberBvhTriangles(scene->bvh, scene->triangle_count, order);
+    scene->vertex_indices = (int(*)[3])permuteArray(scene->vertex_indices, sizeof(int[3]), order, scene->triangle_count);
+    scene->normal_indices = (int(*)[3])permuteArray(scene->normal_indices, sizeof(int[3]), order, scene->triangle_count);
+    scene->object_ids = (int*)permuteArray(scene->object_ids, sizeof(int), order, scene->triangle_count);
+    scene->vertex_order = reorderAttribute(scene->vertex_indices, scene->triangle_count, &scene->vertecies, scene->vertex_count);
+    scene->normal_order = reorderAttribute(scene->normal_indices, scene->triangle_count, &scene->normals, scene->normal_count);
+    if (scene->texcoord_indices != NULL) {
+        scene->texcoord_indices = (int(*)[3])permuteArray(scene->texcoord_indices, sizeof(int[3]), order, scene->triangle_count);
+        free(reorderAttribute(scene->texcoord_indices, scene->triangle_count, &scene->texcoords, scene->texcoord_count));
+    }
+    free(order);
+}
+
+// Move the elements of an array that grows while the obj file is read to a larger allocation
+static void* growArray(void* array, size_t element_size, int count, int capacity) {
+    void* grown = allocateLarge(element_size * capacity);
+    if (array != NULL) {
+        memcpy(grown, array, element_size * count);
+        free(array);
+    }
+    return grown;
+}
+
+void loadFromObj(Scene* scene, TextStream* obj_stream, const char* mtl_content, const char* prim_content, const char* directory, const BvhBuildSettings* bvh_settings) {
+    scene->textures = NULL;
+    scene->texture_count = 0;
+    double start = beginTraceSpan();
+    MaterialList mtl_list;
+    initMaterialList(&mtl_list);
+    if (mtl_content != NULL) {
+        loadMaterials(&mtl_list, mtl_content, scene, directory);
+    }
+    endTraceSpan("load materials", start);
+    start = beginTraceSpan();
+    char tmp[128];
+    // The file is read only once, so the arrays grow as the lines come in
+    int vertex_capacity = 0;
+    int normal_capacity = 0;
+    int texcoord_capacity = 0;
+    int triangle_capacity = 0;
+    int object_capacity = 0;
+    Vec3* vertecies = NULL;
+    Vec3* normals = NULL;
+    Vec3* texcoords = NULL;
+    int (*vertex_indices)[3] = NULL;
+    int (*normal_indices)[3] = NULL;
+    int (*texcoord_indices)[3] = NULL;
+    int* object_ids = NULL;
+    Object* objects = NULL;
     int vertex_id = 0;
     int normal_id = 0;
+    int texcoord_id = 0;
     int triangle_id = 0;
     int object_id = 0;
-    offset = 0;
-    while (obj_content[offset] != 0) {
+    // Out-of-core scenes write the geometry to the page file as it comes in
+    PageBuilder* builder = NULL;
+    if (bvh_settings->cluster_size > 0) {
+        builder = createPageBuilder(bvh_settings->cluster_size, bvh_settings);
+        if (builder == NULL) {
+            fprintf(stderr, "failed to create the geometry pages, keeping the scene in memory\n");
+        }
+    }
+    char* obj_content;
+    while ((obj_content = readLine(obj_stream)) != NULL) {
+        int offset = 0;
         if (obj_content[offset] != '#') {
             if (obj_content[offset] == 'v') {
                 if (obj_content[offset + 1] == ' ') {
-                    Vec3* vertex = vertecies + vertex_id;
+                    Vec3 vertex;
                     offset += 2;
                     for (int k = 0; k < 3; k++) {
                         while (obj_content[offset] == ' ') {
@@ -269,11 +760,20 @@ void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content)
                         }
                         memcpy(tmp, obj_content + num_start, offset - num_start);
                         tmp[offset - num_start] = 0;
-                        vertex->v[k] = atof(tmp);
+                        vertex.v[k] = atof(tmp);
+                    }
+                    if (builder != NULL) {
+                        addPagedVertex(builder, vertex);
+                    } else {
+                        if (vertex_id == vertex_capacity) {
+                            vertex_capacity = 2 * vertex_capacity + 64;
+                            vertecies = (Vec3*)growArray(vertecies, sizeof(Vec3), vertex_id, vertex_capacity);
+                        }
+                        vertecies[vertex_id] = vertex;
                     }
                     vertex_id++;
                 } else if (obj_content[offset + 1] == 'n') {
-                    Vec3* normal = normals + normal_id;
+                    Vec3 normal;
                     offset += 3;
                     for (int k = 0; k < 3; k++) {
                         while (obj_content[offset] == ' ') {
@@ -285,16 +785,42 @@ void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content)
                         }
                         memcpy(tmp, obj_content + num_start, offset - num_start);
                         tmp[offset - num_start] = 0;
-                        normal->v[k] = atof(tmp);
+                        normal.v[k] = atof(tmp);
+                    }
+                    if (builder != NULL) {
+                        addPagedNormal(builder, normal);
+                    } else {
+                        if (normal_id == normal_capacity) {
+                            normal_capacity = 2 * normal_capacity + 64;
+                            normals = (Vec3*)growArray(normals, sizeof(Vec3), normal_id, normal_capacity);
+                        }
+                        normals[normal_id] = normal;
                     }
                     normal_id++;
+                } else if (obj_content[offset + 1] == 't') {
+                    offset += 3;
+                    Vec3 texcoord;
+                    texcoord.x = parseNumber(obj_content, &offset);
+                    texcoord.y = parseNumber(obj_content, &offset);
+                    texcoord.z = 0;
+                    if (builder != NULL) {
+                        addPagedTexcoord(builder, texcoord);
+                    } else {
+                        if (texcoord_id == texcoord_capacity) {
+                            texcoord_capacity = 2 * texcoord_capacity + 64;
+                            texcoords = (Vec3*)growArray(texcoords, sizeof(Vec3), texcoord_id, texcoord_capacity);
+                        }
+                        texcoords[texcoord_id] = texcoord;
+                    }
+                    texcoord_id++;
                 }
             } else if (obj_content[offset] == 'f' && obj_content[offset + 1] == ' ') {
                 int face_vert_count = 0;
                 int face_verts[3];
                 int face_norms[3];
+                int face_texcoords[3];
                 offset += 2;
-                while (obj_content[offset] != 0 && obj_content[offset] != '\n') {
+                while (obj_content[offset] != 0) {
                     while (obj_content[offset] == ' ') {
                         offset++;
                     }
@@ -305,11 +831,19 @@ void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content)
                     memcpy(tmp, obj_content + num_start, offset - num_start);
                     tmp[offset - num_start] = 0;
                     face_verts[face_vert_count] = atoi(tmp);
+                    face_norms[face_vert_count] = 0;
+                    face_texcoords[face_vert_count] = 0;
                     if (obj_content[offset] == '/') {
                         offset++;
+                        int num_start = offset;
                         while (isdigit(obj_content[offset])) {
                             offset++;
                         }
+                        if (offset > num_start) {
+                            memcpy(tmp, obj_content + num_start, offset - num_start);
+                            tmp[offset - num_start] = 0;
+                            face_texcoords[face_vert_count] = atoi(tmp);
+                        }
                         if (obj_content[offset] == '/') {
                             offset++;
                             int num_start = offset;
@@ -323,18 +857,43 @@ void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content)
                     }
                     face_vert_count++;
                     if (face_vert_count == 3) {
-                        object_ids[triangle_id] = object_id - 1;
+                        int triangle_verts[3];
+                        int triangle_norms[3];
+                        int triangle_texcoords[3];
+                        // Negative indices are relative to the elements read so far
                         for (int k = 0; k < 3; k++) {
-                            vertex_indices[triangle_id][k] = face_verts[k] + (face_verts[k] < 0 ? vertex_count : -1);
-                            normal_indices[triangle_id][k] = face_norms[k] + (face_norms[k] < 0 ? normal_count : -1);
+                            triangle_verts[k] = face_verts[k] + (face_verts[k] < 0 ? vertex_id : -1);
+                            triangle_norms[k] = face_norms[k] + (face_norms[k] < 0 ? normal_id : -1);
+                            // Vertecies without texture coordinates are marked with -1
+                            triangle_texcoords[k] = face_texcoords[k] == 0 ? -1 : face_texcoords[k] + (face_texcoords[k] < 0 ? texcoord_id : -1);
+                        }
+                        if (builder != NULL) {
+                            addPagedTriangle(builder, triangle_verts, triangle_norms, triangle_texcoords, object_id - 1);
+                        } else {
+                            if (triangle_id == triangle_capacity) {
+                                triangle_capacity = 2 * triangle_capacity + 64;
+                                vertex_indices = (int(*)[3])growArray(vertex_indices, sizeof(int[3]), triangle_id, triangle_capacity);
+                                normal_indices = (int(*)[3])growArray(normal_indices, sizeof(int[3]), triangle_id, triangle_capacity);
+                                texcoord_indices = (int(*)[3])growArray(texcoord_indices, sizeof(int[3]), triangle_id, triangle_capacity);
+                                object_ids = (int*)growArray(object_ids, sizeof(int), triangle_id, triangle_capacity);
+                            }
+                            object_ids[triangle_id] = object_id - 1;
+                            memcpy(vertex_indices[triangle_id], triangle_verts, sizeof(int[3]));
+                            memcpy(normal_indices[triangle_id], triangle_norms, sizeof(int[3]));
+                            memcpy(texcoord_indices[triangle_id], triangle_texcoords, sizeof(int[3]));
                         }
                         face_vert_count--;
                         face_verts[1] = face_verts[2];
                         face_norms[1] = face_norms[2];
+                        face_texcoords[1] = face_texcoords[2];
                         triangle_id++;
                     }
                 }
             } else if (obj_content[offset] == 'o' && obj_content[offset + 1] == ' ') {
+                if (object_id == object_capacity) {
+                    object_capacity = 2 * object_capacity + 64;
+                    objects = (Object*)growArray(objects, sizeof(Object), object_id, object_capacity);
+                }
                 objects[object_id].material = createDefaultMaterial();
                 objects[object_id].starting_triangle = triangle_id;
                 object_id++;
@@ -342,7 +901,7 @@ void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content)
                 if (object_id > 0) {
                     offset += 7;
                     int name_start = offset;
-                    while (obj_content[offset] != 0 && obj_content[offset] != '\n') {
+                    while (obj_content[offset] != 0) {
                         offset++;
                     }
                     memcpy(tmp, obj_content + name_start, offset - name_start);
@@ -351,22 +910,156 @@ void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content)
                 }
             }
         }
-        while (obj_content[offset] != '\n' && obj_content[offset] != 0) {
-            offset++;
-        }
-        if (obj_content[offset] == '\n') {
-            offset++;
-        }
     }
-    freeMaterialList(&mtl_list);
+    endTraceSpan("parse obj", start);
+    int vertex_count = vertex_id;
+    int normal_count = normal_id;
+    int texcoord_count = texcoord_id;
+    int triangle_count = triangle_id;
+    int object_count = object_id;
+    // Texture coordinates are only stored if the file contains any
+    if (texcoord_count == 0) {
+        free(texcoords);
+        free(texcoord_indices);
+        texcoords = NULL;
+        texcoord_indices = NULL;
+    }
     scene->vertecies = vertecies;
+    scene->vertex_count = vertex_count;
     scene->normals = normals;
+    scene->normal_count = normal_count;
     scene->vertex_indices = vertex_indices;
     scene->normal_indices = normal_indices;
+    scene->texcoords = texcoords;
+    scene->texcoord_count = texcoord_count;
+    scene->texcoord_indices = texcoord_indices;
     scene->object_ids = object_ids;
     scene->triangle_count = triangle_count;
+    scene->vertex_order = NULL;
+    scene->normal_order = NULL;
     scene->objects = objects;
     scene->object_count = object_count;
-    scene->bvh = buildBvh(vertex_indices, vertecies, triangle_count);
+    scene->bvh_settings = *bvh_settings;
+    scene->primitives = NULL;
+    scene->primitive_materials = NULL;
+    scene->primitive_count = 0;
+    scene->primitive_bvh = NULL;
+    scene->paged = NULL;
+    if (builder != NULL) {
+        start = beginTraceSpan();
+        scene->paged = finishPageBuilder(builder, objects, object_count);
+        endTraceSpan("write geometry pages", start);
+        if (scene->paged != NULL) {
+            scene->triangle_count = getPagedTriangleCount(scene->paged);
+        } else {
+            // The geometry was never kept in memory, so there is nothing to fall back to
+            fprintf(stderr, "failed to write the geometry pages, the scene has no triangles\n");
+            scene->vertex_count = 0;
+            scene->normal_count = 0;
+            scene->texcoord_count = 0;
+            scene->triangle_count = 0;
+        }
+    }
+    // The ids of the primitives follow the ones of the triangles
+    if (prim_content != NULL) {
+        start = beginTraceSpan();
+        loadPrimitives(scene, prim_content, &mtl_list);
+        endTraceSpan("load primitives", start);
+    }
+    freeMaterialList(&mtl_list);
+    if (builder != NULL) {
+        // Everything but the objects lives in the page file
+        scene->bvh = NULL;
+        scene->bvh_cost = 0;
+        scene->bvh_replicas = NULL;
+    } else {
+        start = beginTraceSpan();
+        scene->bvh = buildBvh(vertex_indices, vertecies, triangle_count, bvh_settings);
+        endTraceSpan("build bvh", start);
+        if (bvh_settings->reorder && !bvh_settings->lazy) {
+            start = beginTraceSpan();
+            reorderScene(scene);
+            endTraceSpan("reorder scene", start);
+        }
+        scene->bvh_cost = computeBvhCost(scene->bvh);
+        start = beginTraceSpan();
+        replicateSceneBvh(scene);
+        endTraceSpan("replicate bvh", start);
+    }
+}
+
+bool loadFrameFromObj(Scene* scene, TextStream* obj_stream) {
+    if (scene->paged != NULL) {
+        // There are no vertex arrays to replace, out-of-core scenes are always loaded again
+        return false;
+    }
+    Vec3* vertecies = (Vec3*)allocateLarge(sizeof(Vec3) * scene->vertex_count);
+    Vec3* normals = (Vec3*)allocateLarge(sizeof(Vec3) * scene->normal_count);
+    int vertex_id = 0;
+    int normal_id = 0;
+    bool matches = true;
+    char* obj_content;
+    while (matches && (obj_content = readLine(obj_stream)) != NULL) {
+        int offset = 0;
+        if (obj_content[offset] == 'v') {
+            if (obj_content[offset + 1] == ' ') {
+                if (vertex_id < scene->vertex_count) {
+                    Vec3* vertex = vertecies + (scene->vertex_order != NULL ? scene->vertex_order[vertex_id] : vertex_id);
+                    offset += 2;
+                    for (int k = 0; k < 3; k++) {
+                        vertex->v[k] = parseNumber(obj_content, &offset);
+                    }
+                }
+                vertex_id++;
+            } else if (obj_content[offset + 1] == 'n') {
+                if (normal_id < scene->normal_count) {
+                    Vec3* normal = normals + (scene->normal_order != NULL ? scene->normal_order[normal_id] : normal_id);
+                    offset += 3;
+                    for (int k = 0; k < 3; k++) {
+                        normal->v[k] = parseNumber(obj_content, &offset);
+                    }
+                }
+                normal_id++;
+            }
+            matches = vertex_id <= scene->vertex_count && normal_id <= scene->normal_count;
+        }
+    }
+    // A frame cut short by a broken file is not used, the full reload then reports the error
+    if (
+        matches && vertex_id == scene->vertex_count && (normal_id == 0 || normal_id == scene->normal_count)
+        && !hasTextStreamFailed(obj_stream)
+    ) {
+        free(scene->vertecies);
+        scene->vertecies = vertecies;
+        if (normal_id != 0) {
+            free(scene->normals);
+            scene->normals = normals;
+        } else {
+            // Keep the normals of the base mesh if the frame does not contain any
+            free(normals);
+        }
+        return true;
+    } else {
+        free(vertecies);
+        free(normals);
+        return false;
+    }
+}
+
+void updateSceneBvh(Scene* scene, float rebuild_threshold) {
+    freeSceneBvhReplicas(scene);
+    double start = beginTraceSpan();
+    refitBvh(scene->bvh, scene->vertex_indices, scene->vertecies);
+    endTraceSpan("refit bvh", start);
+    if (computeBvhCost(scene->bvh) > rebuild_threshold * scene->bvh_cost) {
+        start = beginTraceSpan();
+        freeBvh(scene->bvh);
+        scene->bvh = buildBvh(scene->vertex_indices, scene->vertecies, scene->triangle_count, &scene->bvh_settings);
+        scene->bvh_cost = computeBvhCost(scene->bvh);
+        endTraceSpan("build bvh", start);
+    }
+    start = beginTraceSpan();
+    replicateSceneBvh(scene);
+    endTraceSpan("replicate bvh", start);
 }
 
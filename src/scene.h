@@ -5,6 +5,22 @@
 
 #include "vec.h"
 #include "bvh.h"
+#include "intersection.h"
+#include "stream.h"
+
+// Which lobes a material has, decided once when it is loaded. Every kind has its own shading
+// kernel, so the per-hit code does not have to look at the material properties again.
+typedef enum {
+    // Only emits light, if at all
+    MATERIAL_EMITTER,
+    MATERIAL_LAMBERTIAN,
+    // Phong lobe around the mirror direction, very sharp lobes behave like mirrors
+    MATERIAL_GLOSSY,
+    // Lambertian lobe together with a glossy one
+    MATERIAL_PLASTIC,
+    // Fresnel weighted reflection and refraction, possibly with a Lambertian lobe
+    MATERIAL_DIELECTRIC,
+} MaterialKind;
 
 typedef struct {
     Color emission_color;
@@ -14,29 +30,112 @@ typedef struct {
     float transmitability;
     float specular_sharpness;
     float index_of_refraction;
+    // Textures multiplied with the colors, -1 if there is none
+    int diffuse_texture;
+    int specular_texture;
+    int emission_texture;
+    // Set by classifyMaterial
+    MaterialKind kind;
+    // Reflectance of the dielectric at normal incidence, the same from both sides
+    float fresnel_r0;
 } MaterialProperties;
 
 MaterialProperties createDefaultMaterial();
 
+// Decide the kind of the material and precompute the values its kernel needs. Must be called
+// again whenever the properties of the material are changed.
+void classifyMaterial(MaterialProperties* material);
+
 typedef struct {
     int starting_triangle;
     MaterialProperties material;
 } Object;
 
+typedef struct PagedGeometry PagedGeometry;
+
 typedef struct {
     Vec3* vertecies;
+    int vertex_count;
     Vec3* normals;
+    int normal_count;
     int (*vertex_indices)[3];
     int (*normal_indices)[3];
+    // NULL if the file has no texture coordinates, indices of -1 mark vertecies without any
+    Vec3* texcoords;
+    int texcoord_count;
+    int (*texcoord_indices)[3];
     int* object_ids;
     int triangle_count;
+    // New index of every vertex and normal of the file if the scene was reordered, NULL if they
+    // are stored in file order
+    int* vertex_order;
+    int* normal_order;
     Object* objects;
     int object_count;
+    // References to the textures used by the materials, released with the scene
+    int* textures;
+    int texture_count;
     BvhNode* bvh;
+    // One copy of the bvh per numa node, NULL if the tree is not replicated
+    BvhNode** bvh_replicas;
+    BvhBuildSettings bvh_settings;
+    float bvh_cost;
+    // Geometry of out-of-core scenes. If set, the vertex and index arrays and the bvh are NULL and
+    // triangle ids refer to the paged geometry.
+    PagedGeometry* paged;
+    // Analytic spheres, disks and quads. Their ids follow the triangle ids, i.e. the hit with
+    // triangle id triangle_count + i is on primitive i. They are always kept in memory.
+    Primitive* primitives;
+    MaterialProperties* primitive_materials;
+    int primitive_count;
+    BvhNode* primitive_bvh;
 } Scene;
 
 void freeScene(Scene* scene);
 
-void loadFromObj(Scene* scene, const char* obj_content, const char* mtl_content);
+// Interpolated position and normalized shading normal at the barycentric coordinates u and v
+void interpolateTriangle(const Scene* scene, int triangle_id, float u, float v, Vec3* position, Vec3* normal);
+
+typedef struct {
+    Vec3 position;
+    // Normalized shading normal, not flipped towards the incoming ray
+    Vec3 normal;
+    Vec3 texcoord;
+    // Material of the triangle with its textures applied
+    MaterialProperties material;
+} SurfacePoint;
+
+// Everything needed to shade a hit. footprint is the width of the ray cone at the hit, which
+// selects the mip level of the textures.
+void getSurfacePoint(const Scene* scene, int triangle_id, float u, float v, float footprint, SurfacePoint* out);
+
+// The bvh to traverse from the calling thread, i.e. the replica on its numa node if there is one
+BvhNode* getSceneBvh(const Scene* scene);
+
+BoundingBox getSceneBounds(const Scene* scene);
+
+// Closest hit of the ray with the scene, loading the clusters of out-of-core scenes as needed
+bool testRaySceneIntersection(const Ray* ray, Scene* scene, Intersection* out);
+
+bool testRaySceneOcclusion(const Ray* ray, Scene* scene, float max_dist);
+
+// Like testRaySceneIntersection, also counting the work done in the trees. The clusters of
+// out-of-core scenes are traversed without being counted.
+bool countRaySceneIntersection(const Ray* ray, Scene* scene, Intersection* out, TraversalCounts* counts);
+
+// Texture maps named in the mtl file are resolved relative to directory, which may be NULL. The
+// primitives are given one per line as "sphere x y z r", "disk x y z nx ny nz r" or
+// "quad x y z ax ay az bx by bz", using the material of the last "usemtl" line of prim_content.
+// mtl_content and prim_content may be NULL. The obj file is parsed line by line as it is read.
+void loadFromObj(Scene* scene, TextStream* obj_stream, const char* mtl_content, const char* prim_content, const char* directory, const BvhBuildSettings* bvh_settings);
+
+// Replace the vertex positions and normals with the ones in obj_stream, keeping the topology,
+// materials and bvh structure. Fails if the number of vertecies does not match, or if the frame
+// has normals and their number does not match. A frame without normals keeps the old ones.
+bool loadFrameFromObj(Scene* scene, TextStream* obj_stream);
+
+// Update the bvh after the vertecies changed. The tree is refitted, and only rebuilt if the
+// refitted tree got more than rebuild_threshold times as expensive as after the last build.
+void updateSceneBvh(Scene* scene, float rebuild_threshold);
 
 #endif
\ No newline at end of file
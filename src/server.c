@@ -0,0 +1,456 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <omp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "scene.h"
+#include "renderer.h"
+#include "image.h"
+#include "loader.h"
+#include "texture.h"
+#include "paging.h"
+
+#define DEFAULT_WIDTH 1250
+#define DEFAULT_HEIGHT 1250
+#define DEFAULT_VIEW 0.5
+#define DEFAULT_PASSES 1
+
+#define MAX_LINE 4096
+#define MAX_OPTIONS 32
+
+typedef struct Job {
+    char* id;
+    char* obj_filename;
+    char* out_filename;
+    int width;
+    int height;
+    int passes;
+    int option_count;
+    char* options[MAX_OPTIONS];
+    atomic_bool cancelled;
+    struct Job* next;
+} Job;
+
+typedef struct {
+    char* filename;
+    uint64_t stamp;
+    unsigned long last_used;
+    Scene scene;
+} CachedScene;
+
+typedef struct {
+    CachedScene* entries;
+    int count;
+    int capacity;
+    unsigned long clock;
+    BvhBuildSettings bvh_settings;
+} SceneCache;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    Job* queue_head;
+    Job* queue_tail;
+    Job* running;
+    Renderer* running_renderer;
+    bool stopping;
+    FILE* out;
+    SceneCache cache;
+    atomic_int cached_scenes;
+    PngSettings png_settings;
+} Server;
+
+static void respond(Server* server, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void respond(Server* server, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    flockfile(server->out);
+    vfprintf(server->out, format, args);
+    fputc('\n', server->out);
+    fflush(server->out);
+    funlockfile(server->out);
+    va_end(args);
+}
+
+static void freeJob(Job* job) {
+    free(job->id);
+    free(job->obj_filename);
+    free(job->out_filename);
+    for (int i = 0; i < job->option_count; i++) {
+        free(job->options[i]);
+    }
+    free(job);
+}
+
+static void initSceneCache(SceneCache* cache, int capacity, const BvhBuildSettings* bvh_settings) {
+    cache->count = 0;
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->entries = (CachedScene*)malloc(sizeof(CachedScene) * cache->capacity);
+    cache->clock = 0;
+    cache->bvh_settings = *bvh_settings;
+}
+
+static void evictCachedScene(SceneCache* cache, int i) {
+    free(cache->entries[i].filename);
+    freeScene(&cache->entries[i].scene);
+    cache->count--;
+    cache->entries[i] = cache->entries[cache->count];
+}
+
+static void freeSceneCache(SceneCache* cache) {
+    while (cache->count > 0) {
+        evictCachedScene(cache, 0);
+    }
+    free(cache->entries);
+}
+
+// Scenes are identified by their path and the stamp of the files they were loaded from, so that
+// scenes with changed files are loaded again. Returns NULL if the scene can not be loaded.
+static Scene* getCachedScene(SceneCache* cache, const char* filename, bool* was_cached) {
+    cache->clock++;
+    for (int i = 0; i < cache->count; i++) {
+        CachedScene* entry = &cache->entries[i];
+        if (strcmp(entry->filename, filename) == 0) {
+            if (entry->stamp == sceneFilesStamp(&entry->scene, filename)) {
+                entry->last_used = cache->clock;
+                *was_cached = true;
+                return &entry->scene;
+            } else {
+                evictCachedScene(cache, i);
+                break;
+            }
+        }
+    }
+    *was_cached = false;
+    if (cache->count == cache->capacity) {
+        int oldest = 0;
+        for (int i = 1; i < cache->count; i++) {
+            if (cache->entries[i].last_used < cache->entries[oldest].last_used) {
+                oldest = i;
+            }
+        }
+        evictCachedScene(cache, oldest);
+    }
+    CachedScene* entry = &cache->entries[cache->count];
+    if (!loadScene(&entry->scene, filename, &cache->bvh_settings)) {
+        return NULL;
+    }
+    entry->filename = strdup(filename);
+    entry->stamp = sceneFilesStamp(&entry->scene, filename);
+    entry->last_used = cache->clock;
+    cache->count++;
+    return &entry->scene;
+}
+
+static void runJob(Server* server, Job* job) {
+    respond(server, "started %s", job->id);
+    double start = omp_get_wtime();
+    bool was_cached;
+    Scene* scene = getCachedScene(&server->cache, job->obj_filename, &was_cached);
+    atomic_store(&server->cached_scenes, server->cache.count);
+    if (scene == NULL) {
+        respond(server, "error %s failed to load '%s'", job->id, job->obj_filename);
+        return;
+    }
+    if (was_cached) {
+        respond(server, "loaded %s cached", job->id);
+    } else {
+        respond(server, "loaded %s loaded %g", job->id, omp_get_wtime() - start);
+    }
+    Renderer renderer;
+    initRenderer(&renderer, job->width, job->height, DEFAULT_VIEW, DEFAULT_VIEW);
+    for (int i = 0; i < job->option_count; i++) {
+        char* value = strchr(job->options[i], '=');
+        *value = 0;
+        setRendererOption(&renderer, job->options[i], value + 1);
+        *value = '=';
+    }
+    pthread_mutex_lock(&server->lock);
+    server->running_renderer = &renderer;
+    if (atomic_load(&job->cancelled)) {
+        cancelRendering(&renderer);
+    }
+    pthread_mutex_unlock(&server->lock);
+    clearBuffer(&renderer);
+    for (int i = 0; i < job->passes && !isRenderingCancelled(&renderer); i++) {
+        renderScene(&renderer, scene);
+        if (!isRenderingCancelled(&renderer)) {
+            respond(server, "progress %s %d %d", job->id, i + 1, job->passes);
+        }
+    }
+    pthread_mutex_lock(&server->lock);
+    server->running_renderer = NULL;
+    pthread_mutex_unlock(&server->lock);
+    if (isRenderingCancelled(&renderer)) {
+        respond(server, "cancelled %s", job->id);
+    } else {
+        if (writePNGFile(job->out_filename, renderer.buffer, renderer.width, renderer.height, 1.0 / job->passes, &server->png_settings)) {
+            respond(server, "done %s %g", job->id, omp_get_wtime() - start);
+        } else {
+            respond(server, "error %s failed to write '%s': %s", job->id, job->out_filename, strerror(errno));
+        }
+    }
+    freeRenderer(&renderer);
+}
+
+static void* runWorker(void* data) {
+    Server* server = (Server*)data;
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (server->queue_head == NULL && !server->stopping) {
+            pthread_cond_wait(&server->changed, &server->lock);
+        }
+        if (server->queue_head == NULL) {
+            break;
+        }
+        Job* job = server->queue_head;
+        server->queue_head = job->next;
+        if (server->queue_head == NULL) {
+            server->queue_tail = NULL;
+        }
+        server->running = job;
+        pthread_mutex_unlock(&server->lock);
+        runJob(server, job);
+        pthread_mutex_lock(&server->lock);
+        server->running = NULL;
+        freeJob(job);
+        pthread_cond_broadcast(&server->changed);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+static Job* parseRenderRequest(Server* server, char** save) {
+    char* id = strtok_r(NULL, " \t\n", save);
+    char* obj_filename = strtok_r(NULL, " \t\n", save);
+    char* out_filename = strtok_r(NULL, " \t\n", save);
+    if (out_filename == NULL) {
+        respond(server, "error %s usage: render ID OBJ-FILE OUT-FILE [OPTION=VALUE...]", id != NULL ? id : "-");
+        return NULL;
+    }
+    Job* job = (Job*)malloc(sizeof(Job));
+    job->id = strdup(id);
+    job->obj_filename = strdup(obj_filename);
+    job->out_filename = strdup(out_filename);
+    job->width = DEFAULT_WIDTH;
+    job->height = DEFAULT_HEIGHT;
+    job->passes = DEFAULT_PASSES;
+    job->option_count = 0;
+    atomic_init(&job->cancelled, false);
+    job->next = NULL;
+    Renderer probe; // Used only to validate the options
+    char* option;
+    while ((option = strtok_r(NULL, " \t\n", save)) != NULL) {
+        char* value = strchr(option, '=');
+        bool valid = value != NULL;
+        if (valid) {
+            *value = 0;
+            value++;
+            if (strcmp(option, "size") == 0) {
+                valid = sscanf(value, "%ix%i", &job->width, &job->height) == 2 && job->width > 0 && job->height > 0;
+            } else if (strcmp(option, "passes") == 0) {
+                valid = sscanf(value, "%i", &job->passes) == 1 && job->passes > 0;
+            } else if (job->option_count < MAX_OPTIONS && setRendererOption(&probe, option, value)) {
+                value[-1] = '=';
+                job->options[job->option_count] = strdup(option);
+                job->option_count++;
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            respond(server, "error %s invalid option '%s'", job->id, option);
+            freeJob(job);
+            return NULL;
+        }
+    }
+    return job;
+}
+
+static void cancelJob(Server* server, const char* id) {
+    bool found = false;
+    pthread_mutex_lock(&server->lock);
+    if (server->running != NULL && strcmp(server->running->id, id) == 0) {
+        atomic_store(&server->running->cancelled, true);
+        if (server->running_renderer != NULL) {
+            cancelRendering(server->running_renderer);
+        }
+        found = true;
+    } else {
+        Job** link = &server->queue_head;
+        Job* previous = NULL;
+        while (*link != NULL && strcmp((*link)->id, id) != 0) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        if (*link != NULL) {
+            Job* job = *link;
+            *link = job->next;
+            if (server->queue_tail == job) {
+                server->queue_tail = previous;
+            }
+            freeJob(job);
+            respond(server, "cancelled %s", id);
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+    if (!found) {
+        respond(server, "error %s no such job", id);
+    }
+}
+
+static void printStatus(Server* server) {
+    pthread_mutex_lock(&server->lock);
+    int queued = 0;
+    for (Job* job = server->queue_head; job != NULL; job = job->next) {
+        queued++;
+    }
+    TextureCacheStats textures;
+    getTextureCacheStats(&textures);
+    GeometryCacheStats geometry;
+    getGeometryCacheStats(&geometry);
+    respond(
+        server, "status running %s queued %d cached %d textures %d tiles %lu/%lu hits %lu misses %lu evictions %lu"
+        " clusters %d pages %lu/%lu hits %lu faults %lu evictions %lu",
+        server->running != NULL ? server->running->id : "-", queued, atomic_load(&server->cached_scenes), textures.textures,
+        (unsigned long)textures.resident_bytes, (unsigned long)textures.budget_bytes, textures.hits, textures.misses,
+        textures.evictions, geometry.clusters, (unsigned long)geometry.resident_bytes, (unsigned long)geometry.budget_bytes,
+        geometry.hits, geometry.faults, geometry.evictions
+    );
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Handle requests until the end of the input or a quit request. Returns true on quit.
+static bool serveRequests(Server* server, FILE* in) {
+    char line[MAX_LINE];
+    bool quit = false;
+    while (!quit && fgets(line, MAX_LINE, in) != NULL) {
+        char* save;
+        char* command = strtok_r(line, " \t\n", &save);
+        if (command == NULL || command[0] == '#') {
+            continue;
+        } else if (strcmp(command, "render") == 0) {
+            Job* job = parseRenderRequest(server, &save);
+            if (job != NULL) {
+                pthread_mutex_lock(&server->lock);
+                if (server->queue_tail == NULL) {
+                    server->queue_head = job;
+                } else {
+                    server->queue_tail->next = job;
+                }
+                server->queue_tail = job;
+                respond(server, "queued %s", job->id);
+                pthread_cond_broadcast(&server->changed);
+                pthread_mutex_unlock(&server->lock);
+            }
+        } else if (strcmp(command, "cancel") == 0) {
+            char* id = strtok_r(NULL, " \t\n", &save);
+            if (id != NULL) {
+                cancelJob(server, id);
+            } else {
+                respond(server, "error - usage: cancel ID");
+            }
+        } else if (strcmp(command, "status") == 0) {
+            printStatus(server);
+        } else if (strcmp(command, "quit") == 0) {
+            quit = true;
+        } else {
+            respond(server, "error - unknown request '%s'", command);
+        }
+    }
+    // Finish the remaining requests before the output goes away
+    pthread_mutex_lock(&server->lock);
+    while (server->queue_head != NULL || server->running != NULL) {
+        pthread_cond_wait(&server->changed, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+    respond(server, "ok");
+    return quit;
+}
+
+static bool serveSocket(Server* server, const char* socket_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+        return false;
+    }
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 4) != 0) {
+        fprintf(stderr, "failed to listen on '%s': %s\n", socket_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    bool ok = true;
+    bool quit = false;
+    while (!quit) {
+        int connection = accept(fd, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "failed to accept connection: %s\n", strerror(errno));
+            ok = false;
+            break;
+        }
+        FILE* in = fdopen(connection, "r");
+        FILE* out = fdopen(dup(connection), "w");
+        server->out = out;
+        quit = serveRequests(server, in);
+        server->out = stdout;
+        fclose(out);
+        fclose(in);
+    }
+    close(fd);
+    unlink(socket_path);
+    return ok;
+}
+
+bool runServer(const char* socket_path, int cache_size, const BvhBuildSettings* bvh_settings, const PngSettings* png_settings) {
+    Server server = {
+        .queue_head = NULL,
+        .queue_tail = NULL,
+        .running = NULL,
+        .running_renderer = NULL,
+        .stopping = false,
+        .out = stdout,
+        .png_settings = *png_settings,
+    };
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.changed, NULL);
+    initSceneCache(&server.cache, cache_size, bvh_settings);
+    atomic_init(&server.cached_scenes, 0);
+    pthread_t worker;
+    pthread_create(&worker, NULL, runWorker, &server);
+    bool ok = true;
+    if (socket_path != NULL) {
+        ok = serveSocket(&server, socket_path);
+    } else {
+        serveRequests(&server, stdin);
+    }
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.changed);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(worker, NULL);
+    freeSceneCache(&server.cache);
+    pthread_cond_destroy(&server.changed);
+    pthread_mutex_destroy(&server.lock);
+    return ok;
+}
+
@@ -0,0 +1,26 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdbool.h>
+
+#include "bvh.h"
+#include "image.h"
+
+// Serve render requests read line by line from stdin, or from the connections to a unix socket if
+// socket_path is not NULL. Up to cache_size scenes are kept loaded, together with their bvh, and
+// reused by later requests for the same file. Their bvh is built according to bvh_settings, and
+// the images are written using png_settings.
+//
+// Requests:
+//   render ID OBJ-FILE OUT-FILE [size=WxH] [passes=N] [samples=N] [position=X,Y,Z]
+//          [direction=X,Y,Z] [up=X,Y,Z] [view=H,V] [depth=N] [void=R,G,B]
+//   cancel ID
+//   status
+//   quit
+// Responses:
+//   queued ID, started ID, loaded ID cached|loaded SECONDS, progress ID PASS PASSES,
+//   done ID SECONDS, cancelled ID, error ID MESSAGE, ok,
+//   status running ID queued N cached N textures N tiles BYTES/BUDGET hits N misses N evictions N
+bool runServer(const char* socket_path, int cache_size, const BvhBuildSettings* bvh_settings, const PngSettings* png_settings);
+
+#endif
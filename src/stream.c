@@ -0,0 +1,174 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "stream.h"
+
+#define BLOCK_SIZE (1 << 20)
+#define BLOCK_COUNT 4
+
+struct TextStream {
+    gzFile file;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char* blocks[BLOCK_COUNT];
+    int sizes[BLOCK_COUNT];
+    // Number of blocks filled by the reader thread and released by the parser so far, block i is
+    // stored in blocks[i % BLOCK_COUNT]
+    long produced;
+    long consumed;
+    bool finished;
+    bool failed;
+    bool closing;
+    // Block the parser is in, -1 if it has to wait for the next one
+    int current;
+    int position;
+    // Lines that continue in the next block are joined here
+    char* line;
+    int line_length;
+    int line_capacity;
+};
+
+static void* readBlocks(void* data) {
+    TextStream* stream = (TextStream*)data;
+    bool done = false;
+    while (!done) {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->produced - stream->consumed == BLOCK_COUNT && !stream->closing) {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        done = stream->closing;
+        int block = stream->produced % BLOCK_COUNT;
+        pthread_mutex_unlock(&stream->lock);
+        if (!done) {
+            // The parser does not touch the block until it is counted as produced
+            int size = gzread(stream->file, stream->blocks[block], BLOCK_SIZE);
+            pthread_mutex_lock(&stream->lock);
+            if (size > 0) {
+                stream->sizes[block] = size;
+                stream->produced++;
+            } else {
+                // A truncated compressed file ends with Z_BUF_ERROR
+                int error;
+                gzerror(stream->file, &error);
+                stream->failed = size < 0 || error != Z_OK;
+                stream->finished = true;
+                done = true;
+            }
+            pthread_cond_broadcast(&stream->changed);
+            pthread_mutex_unlock(&stream->lock);
+        }
+    }
+    return NULL;
+}
+
+TextStream* openTextStream(const char* filename) {
+    // Files that are not compressed are read unchanged
+    gzFile file = gzopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    gzbuffer(file, 1 << 17);
+    TextStream* stream = (TextStream*)malloc(sizeof(TextStream));
+    stream->file = file;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    for (int i = 0; i < BLOCK_COUNT; i++) {
+        stream->blocks[i] = (char*)malloc(BLOCK_SIZE);
+        stream->sizes[i] = 0;
+    }
+    stream->produced = 0;
+    stream->consumed = 0;
+    stream->finished = false;
+    stream->failed = false;
+    stream->closing = false;
+    stream->current = -1;
+    stream->position = 0;
+    stream->line_capacity = 256;
+    stream->line = (char*)malloc(stream->line_capacity);
+    stream->line_length = 0;
+    pthread_create(&stream->reader, NULL, readBlocks, stream);
+    return stream;
+}
+
+static void appendToLine(TextStream* stream, const char* text, int length) {
+    if (stream->line_length + length + 1 > stream->line_capacity) {
+        while (stream->line_length + length + 1 > stream->line_capacity) {
+            stream->line_capacity *= 2;
+        }
+        stream->line = (char*)realloc(stream->line, stream->line_capacity);
+    }
+    memcpy(stream->line + stream->line_length, text, length);
+    stream->line_length += length;
+    stream->line[stream->line_length] = 0;
+}
+
+char* readLine(TextStream* stream) {
+    stream->line_length = 0;
+    for (;;) {
+        if (stream->current < 0) {
+            pthread_mutex_lock(&stream->lock);
+            while (stream->produced == stream->consumed && !stream->finished) {
+                pthread_cond_wait(&stream->changed, &stream->lock);
+            }
+            bool available = stream->produced > stream->consumed;
+            pthread_mutex_unlock(&stream->lock);
+            if (!available) {
+                // The last line of the file may not end with a newline
+                return stream->line_length > 0 ? stream->line : NULL;
+            }
+            stream->current = stream->consumed % BLOCK_COUNT;
+            stream->position = 0;
+        }
+        char* block = stream->blocks[stream->current];
+        int size = stream->sizes[stream->current];
+        char* start = block + stream->position;
+        char* end = (char*)memchr(start, '\n', size - stream->position);
+        if (end != NULL) {
+            stream->position = end - block + 1;
+            if (stream->line_length == 0) {
+                // The line is entirely inside of the block and can be used in place
+                *end = 0;
+                return start;
+            } else {
+                appendToLine(stream, start, end - start);
+                return stream->line;
+            }
+        } else {
+            appendToLine(stream, start, size - stream->position);
+            pthread_mutex_lock(&stream->lock);
+            stream->consumed++;
+            pthread_cond_broadcast(&stream->changed);
+            pthread_mutex_unlock(&stream->lock);
+            stream->current = -1;
+        }
+    }
+}
+
+bool hasTextStreamFailed(const TextStream* stream) {
+    return stream->failed;
+}
+
+void closeTextStream(TextStream* stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->closing = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->reader, NULL);
+    gzclose(stream->file);
+    for (int i = 0; i < BLOCK_COUNT; i++) {
+        free(stream->blocks[i]);
+    }
+    free(stream->line);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->changed);
+    free(stream);
+}
+
+bool isCompressedFilename(const char* filename) {
+    int length = strlen(filename);
+    return length >= 3 && strcmp(filename + length - 3, ".gz") == 0;
+}
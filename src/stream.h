@@ -0,0 +1,26 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stdbool.h>
+
+// Text file read line by line, either plain or gzip compressed. The file is read and decompressed
+// by a separate thread into a small queue of blocks, so that decompression overlaps with parsing
+// and only a few blocks are ever in memory, no matter how large the file is.
+typedef struct TextStream TextStream;
+
+// Returns NULL with errno set if the file can not be opened
+TextStream* openTextStream(const char* filename);
+
+// The next line without its newline, NULL at the end of the file. The line may be modified by the
+// caller and stays valid until the next call.
+char* readLine(TextStream* stream);
+
+// Whether reading stopped early because of a read error or corrupt compressed data
+bool hasTextStreamFailed(const TextStream* stream);
+
+void closeTextStream(TextStream* stream);
+
+// Whether the name ends in .gz
+bool isCompressedFilename(const char* filename);
+
+#endif
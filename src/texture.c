@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <png.h>
+
+#include "texture.h"
+
+#define TEXTURE_TILE_SIZE 64
+#define TILE_BYTES (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3)
+#define MAX_TEXTURES 4096
+#define MAX_MIP_LEVELS 24
+#define CACHE_SHARDS 64
+#define DEFAULT_CACHE_BUDGET (256 << 20)
+
+typedef struct {
+    char* filename;
+    // Of the png file when it was read
+    time_t modified;
+    off_t size;
+    int references;
+    int levels;
+    int widths[MAX_MIP_LEVELS];
+    int heights[MAX_MIP_LEVELS];
+    int tiles_x[MAX_MIP_LEVELS];
+    long first_tile[MAX_MIP_LEVELS];
+    FILE* tile_file;
+} Texture;
+
+// The cache is split into shards with their own lock, so that threads sampling different tiles
+// rarely wait for each other. Each shard evicts using the clock algorithm.
+typedef struct {
+    pthread_mutex_t lock;
+    int capacity;
+    int used;
+    int hand;
+    uint64_t* keys;
+    bool* referenced;
+    int* next;
+    int* buckets;
+    int bucket_count;
+    uint8_t* data;
+} CacheShard;
+
+static pthread_mutex_t textures_lock = PTHREAD_MUTEX_INITIALIZER;
+static Texture* textures[MAX_TEXTURES];
+static int texture_count = 0;
+static size_t cache_budget = DEFAULT_CACHE_BUDGET;
+static bool cache_initialized = false;
+static CacheShard shards[CACHE_SHARDS];
+static atomic_ulong cache_hits;
+static atomic_ulong cache_misses;
+static atomic_ulong cache_evictions;
+// Texels are stored gamma encoded like the output images, i.e. linear = encoded^2
+static float decode_table[256];
+
+void setTextureCacheBudget(size_t bytes) {
+    pthread_mutex_lock(&textures_lock);
+    if (!cache_initialized) {
+        cache_budget = bytes;
+    }
+    pthread_mutex_unlock(&textures_lock);
+}
+
+static void initTextureCache() {
+    int capacity = cache_budget / TILE_BYTES / CACHE_SHARDS;
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard* shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = capacity;
+        shard->used = 0;
+        shard->hand = 0;
+        shard->keys = (uint64_t*)malloc(sizeof(uint64_t) * capacity);
+        shard->referenced = (bool*)malloc(sizeof(bool) * capacity);
+        shard->next = (int*)malloc(sizeof(int) * capacity);
+        shard->bucket_count = capacity;
+        shard->buckets = (int*)malloc(sizeof(int) * shard->bucket_count);
+        for (int j = 0; j < shard->bucket_count; j++) {
+            shard->buckets[j] = -1;
+        }
+        // Pages are only touched once tiles are loaded into them
+        shard->data = (uint8_t*)malloc((size_t)TILE_BYTES * capacity);
+    }
+    for (int k = 0; k < 256; k++) {
+        decode_table[k] = (k / 255.0) * (k / 255.0);
+    }
+    atomic_init(&cache_hits, 0);
+    atomic_init(&cache_misses, 0);
+    atomic_init(&cache_evictions, 0);
+    cache_initialized = true;
+}
+
+static uint8_t* readPNGImage(const char* filename, int* width, int* height) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png == NULL ? NULL : png_create_info_struct(png);
+    if (info == NULL) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        fclose(file);
+        return NULL;
+    }
+    uint8_t* volatile image = NULL;
+    png_bytepp volatile rows = NULL;
+    if (setjmp(png_jmpbuf(png))) {
+        free(image);
+        free(rows);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(file);
+        return NULL;
+    }
+    png_init_io(png, file);
+    png_read_info(png, info);
+    // Convert everything to 8-bit RGB
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    png_set_gray_to_rgb(png);
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    *width = png_get_image_width(png, info);
+    *height = png_get_image_height(png, info);
+    image = (uint8_t*)malloc((size_t)*width * *height * 3);
+    rows = (png_bytepp)malloc(sizeof(png_bytep) * *height);
+    for (int i = 0; i < *height; i++) {
+        rows[i] = image + (size_t)i * *width * 3;
+    }
+    png_read_image(png, rows);
+    png_read_end(png, NULL);
+    free(rows);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(file);
+    return image;
+}
+
+// Average 2x2 blocks in linear space
+static uint8_t* downsampleImage(const uint8_t* image, int width, int height, int next_width, int next_height) {
+    uint8_t* ret = (uint8_t*)malloc((size_t)next_width * next_height * 3);
+    for (int y = 0; y < next_height; y++) {
+        for (int x = 0; x < next_width; x++) {
+            for (int k = 0; k < 3; k++) {
+                float sum = 0;
+                for (int dy = 0; dy < 2; dy++) {
+                    for (int dx = 0; dx < 2; dx++) {
+                        int sx = 2 * x + dx < width ? 2 * x + dx : width - 1;
+                        int sy = 2 * y + dy < height ? 2 * y + dy : height - 1;
+                        sum += decode_table[image[((size_t)sy * width + sx) * 3 + k]];
+                    }
+                }
+                ret[((size_t)y * next_width + x) * 3 + k] = (uint8_t)(sqrtf(sum / 4) * 255 + 0.5);
+            }
+        }
+    }
+    return ret;
+}
+
+// Write all tiles of one level, tiles at the border are padded by repeating the edge
+static void writeTiles(FILE* file, const uint8_t* image, int width, int height) {
+    uint8_t tile[TILE_BYTES];
+    for (int ty = 0; ty * TEXTURE_TILE_SIZE < height; ty++) {
+        for (int tx = 0; tx * TEXTURE_TILE_SIZE < width; tx++) {
+            for (int y = 0; y < TEXTURE_TILE_SIZE; y++) {
+                int sy = ty * TEXTURE_TILE_SIZE + y < height ? ty * TEXTURE_TILE_SIZE + y : height - 1;
+                for (int x = 0; x < TEXTURE_TILE_SIZE; x++) {
+                    int sx = tx * TEXTURE_TILE_SIZE + x < width ? tx * TEXTURE_TILE_SIZE + x : width - 1;
+                    memcpy(tile + (y * TEXTURE_TILE_SIZE + x) * 3, image + ((size_t)sy * width + sx) * 3, 3);
+                }
+            }
+            fwrite(tile, 1, TILE_BYTES, file);
+        }
+    }
+}
+
+static Texture* createTexture(const char* filename, const struct stat* info) {
+    int width, height;
+    uint8_t* image = readPNGImage(filename, &width, &height);
+    if (image == NULL) {
+        return NULL;
+    }
+    FILE* tile_file = tmpfile();
+    if (tile_file == NULL) {
+        free(image);
+        return NULL;
+    }
+    Texture* tex = (Texture*)malloc(sizeof(Texture));
+    tex->filename = strdup(filename);
+    tex->modified = info->st_mtime;
+    tex->size = info->st_size;
+    tex->references = 1;
+    tex->tile_file = tile_file;
+    tex->levels = 0;
+    long tiles = 0;
+    for (;;) {
+        int level = tex->levels;
+        tex->widths[level] = width;
+        tex->heights[level] = height;
+        tex->tiles_x[level] = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        tex->first_tile[level] = tiles;
+        tiles += (long)tex->tiles_x[level] * ((height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE);
+        writeTiles(tile_file, image, width, height);
+        tex->levels++;
+        if ((width == 1 && height == 1) || tex->levels == MAX_MIP_LEVELS) {
+            break;
+        }
+        int next_width = width > 1 ? width / 2 : 1;
+        int next_height = height > 1 ? height / 2 : 1;
+        uint8_t* next = downsampleImage(image, width, height, next_width, next_height);
+        free(image);
+        image = next;
+        width = next_width;
+        height = next_height;
+    }
+    free(image);
+    fflush(tile_file);
+    return tex;
+}
+
+int loadTexture(const char* filename) {
+    int ret = -1;
+    pthread_mutex_lock(&textures_lock);
+    if (!cache_initialized) {
+        initTextureCache();
+    }
+    struct stat info;
+    if (stat(filename, &info) != 0) {
+        pthread_mutex_unlock(&textures_lock);
+        return -1;
+    }
+    // A file changed since it was read is read again, scenes still using the old one keep it
+    for (int i = 0; i < texture_count; i++) {
+        if (
+            textures[i] != NULL && strcmp(textures[i]->filename, filename) == 0
+            && textures[i]->modified == info.st_mtime && textures[i]->size == info.st_size
+        ) {
+            textures[i]->references++;
+            ret = i;
+            break;
+        }
+    }
+    // Ids are never reused, so that stale tiles in the cache can not be mistaken for new ones
+    if (ret == -1 && texture_count < MAX_TEXTURES) {
+        Texture* tex = createTexture(filename, &info);
+        if (tex != NULL) {
+            ret = texture_count;
+            textures[ret] = tex;
+            texture_count++;
+        }
+    }
+    pthread_mutex_unlock(&textures_lock);
+    return ret;
+}
+
+void releaseTexture(int texture) {
+    pthread_mutex_lock(&textures_lock);
+    Texture* tex = textures[texture];
+    tex->references--;
+    if (tex->references == 0) {
+        textures[texture] = NULL;
+        fclose(tex->tile_file);
+        free(tex->filename);
+        free(tex);
+    }
+    pthread_mutex_unlock(&textures_lock);
+}
+
+const char* getTextureFilename(int texture) {
+    return textures[texture]->filename;
+}
+
+void getTextureSize(int texture, int* width, int* height) {
+    *width = textures[texture]->widths[0];
+    *height = textures[texture]->heights[0];
+}
+
+static uint64_t hashKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    return key;
+}
+
+static void fetchTexel(int texture, const Texture* tex, int level, int x, int y, float out[3]) {
+    int tx = x / TEXTURE_TILE_SIZE;
+    int ty = y / TEXTURE_TILE_SIZE;
+    uint64_t key = ((uint64_t)texture << 44) | ((uint64_t)level << 38) | ((uint64_t)ty << 19) | (uint64_t)tx;
+    uint64_t hash = hashKey(key);
+    CacheShard* shard = &shards[hash % CACHE_SHARDS];
+    int bucket = (hash / CACHE_SHARDS) % shard->bucket_count;
+    pthread_mutex_lock(&shard->lock);
+    int slot = shard->buckets[bucket];
+    while (slot != -1 && shard->keys[slot] != key) {
+        slot = shard->next[slot];
+    }
+    if (slot != -1) {
+        atomic_fetch_add_explicit(&cache_hits, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&cache_misses, 1, memory_order_relaxed);
+        if (shard->used < shard->capacity) {
+            slot = shard->used;
+            shard->used++;
+        } else {
+            while (shard->referenced[shard->hand]) {
+                shard->referenced[shard->hand] = false;
+                shard->hand = (shard->hand + 1) % shard->capacity;
+            }
+            slot = shard->hand;
+            shard->hand = (shard->hand + 1) % shard->capacity;
+            // Unlink the evicted tile from its bucket
+            int old_bucket = (hashKey(shard->keys[slot]) / CACHE_SHARDS) % shard->bucket_count;
+            int* link = &shard->buckets[old_bucket];
+            while (*link != slot) {
+                link = &shard->next[*link];
+            }
+            *link = shard->next[slot];
+            atomic_fetch_add_explicit(&cache_evictions, 1, memory_order_relaxed);
+        }
+        uint8_t* data = shard->data + (size_t)slot * TILE_BYTES;
+        off_t offset = (tex->first_tile[level] + (long)ty * tex->tiles_x[level] + tx) * (off_t)TILE_BYTES;
+        if (pread(fileno(tex->tile_file), data, TILE_BYTES, offset) != TILE_BYTES) {
+            memset(data, 0, TILE_BYTES);
+        }
+        shard->keys[slot] = key;
+        shard->next[slot] = shard->buckets[bucket];
+        shard->buckets[bucket] = slot;
+    }
+    shard->referenced[slot] = true;
+    const uint8_t* texel = shard->data + (size_t)slot * TILE_BYTES
+        + ((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE) * 3;
+    for (int k = 0; k < 3; k++) {
+        out[k] = decode_table[texel[k]];
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static int wrapCoordinate(int x, int size) {
+    x %= size;
+    return x < 0 ? x + size : x;
+}
+
+static Color sampleLevel(int texture, const Texture* tex, int level, float u, float v) {
+    int width = tex->widths[level];
+    int height = tex->heights[level];
+    float x = u * width - 0.5;
+    float y = (1 - v) * height - 0.5;
+    int x0 = (int)floorf(x);
+    int y0 = (int)floorf(y);
+    float fx = x - x0;
+    float fy = y - y0;
+    Color ret = createVec3(0, 0, 0);
+    for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+            float texel[3];
+            fetchTexel(texture, tex, level, wrapCoordinate(x0 + dx, width), wrapCoordinate(y0 + dy, height), texel);
+            float weight = (dx == 0 ? 1 - fx : fx) * (dy == 0 ? 1 - fy : fy);
+            for (int k = 0; k < 3; k++) {
+                ret.v[k] += weight * texel[k];
+            }
+        }
+    }
+    return ret;
+}
+
+Color sampleTexture(int texture, float u, float v, float lod) {
+    const Texture* tex = textures[texture];
+    // Only the fractional part matters, this also keeps the texel coordinates small
+    u = isfinite(u) ? u - floorf(u) : 0;
+    v = isfinite(v) ? v - floorf(v) : 0;
+    if (!(lod > 0)) {
+        return sampleLevel(texture, tex, 0, u, v);
+    } else if (lod >= tex->levels - 1) {
+        return sampleLevel(texture, tex, tex->levels - 1, u, v);
+    } else {
+        int level = (int)lod;
+        float t = lod - level;
+        Color fine = sampleLevel(texture, tex, level, u, v);
+        Color coarse = sampleLevel(texture, tex, level + 1, u, v);
+        return addVec3(scaleVec3(fine, 1 - t), scaleVec3(coarse, t));
+    }
+}
+
+void getTextureCacheStats(TextureCacheStats* stats) {
+    stats->hits = atomic_load(&cache_hits);
+    stats->misses = atomic_load(&cache_misses);
+    stats->evictions = atomic_load(&cache_evictions);
+    stats->budget_bytes = cache_budget;
+    stats->resident_bytes = 0;
+    stats->textures = 0;
+    pthread_mutex_lock(&textures_lock);
+    if (cache_initialized) {
+        for (int i = 0; i < CACHE_SHARDS; i++) {
+            pthread_mutex_lock(&shards[i].lock);
+            stats->resident_bytes += (size_t)shards[i].used * TILE_BYTES;
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+        for (int i = 0; i < texture_count; i++) {
+            stats->textures += textures[i] != NULL;
+        }
+    }
+    pthread_mutex_unlock(&textures_lock);
+}
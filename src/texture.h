@@ -0,0 +1,42 @@
+#ifndef _TEXTURE_H_
+#define _TEXTURE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vec.h"
+
+// Textures are shared by all scenes of the process. When loaded, the png file is converted into a
+// mip map made of 64x64 tiles, stored in a temporary tile file. Only a bounded number of tiles is
+// kept in memory, they are loaded lazily when first sampled and evicted when the cache is full.
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t resident_bytes;
+    size_t budget_bytes;
+    int textures;
+} TextureCacheStats;
+
+// Set the memory budget of the tile cache. Only has an effect before the first texture is loaded.
+void setTextureCacheBudget(size_t bytes);
+
+// Load the png file, or reference it again if it is already loaded and has not changed since.
+// Returns the texture id, or -1 if the file could not be read.
+int loadTexture(const char* filename);
+
+// Release a reference returned by loadTexture
+void releaseTexture(int texture);
+
+void getTextureSize(int texture, int* width, int* height);
+
+const char* getTextureFilename(int texture);
+
+// Trilinearly filtered, linear color of the texture at the texture coordinates (repeating). lod is
+// the mip level, i.e. the base 2 logarithm of the footprint in texels.
+Color sampleTexture(int texture, float u, float v, float lod);
+
+void getTextureCacheStats(TextureCacheStats* stats);
+
+#endif
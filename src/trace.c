@@ -0,0 +1,126 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <omp.h>
+
+#include "trace.h"
+
+#define MAX_TRACE_THREADS 1024
+
+typedef struct {
+    const char* name;
+    double start;
+    double end;
+    const char* arg_names[2];
+    int args[2];
+} TraceEvent;
+
+typedef struct {
+    // Number of events recorded so far, event i is stored at events[i % TRACE_EVENTS]. Only the
+    // owning thread writes, so the count only has to be published for the writer of the trace.
+    atomic_ulong count;
+    TraceEvent events[TRACE_EVENTS];
+} TraceBuffer;
+
+static atomic_bool tracing_enabled = false;
+static double trace_origin;
+
+static _Atomic(TraceBuffer*) trace_buffers[MAX_TRACE_THREADS];
+static atomic_int trace_thread_count = 0;
+
+static _Thread_local TraceBuffer* thread_buffer = NULL;
+static _Thread_local bool thread_registered = false;
+
+// The buffer of the calling thread, NULL if there are too many threads
+static TraceBuffer* getThreadBuffer() {
+    if (!thread_registered) {
+        thread_registered = true;
+        int id = atomic_fetch_add(&trace_thread_count, 1);
+        if (id < MAX_TRACE_THREADS) {
+            thread_buffer = (TraceBuffer*)malloc(sizeof(TraceBuffer));
+            atomic_init(&thread_buffer->count, 0);
+            atomic_store(&trace_buffers[id], thread_buffer);
+        }
+    }
+    return thread_buffer;
+}
+
+void enableTracing() {
+    trace_origin = omp_get_wtime();
+    // The thread enabling the trace is shown first
+    getThreadBuffer();
+    atomic_store(&tracing_enabled, true);
+}
+
+bool isTracingEnabled() {
+    return atomic_load_explicit(&tracing_enabled, memory_order_relaxed);
+}
+
+double beginTraceSpan() {
+    return isTracingEnabled() ? omp_get_wtime() : 0;
+}
+
+void endTraceSpanArgs(const char* name, double start, const char* arg0_name, int arg0, const char* arg1_name, int arg1) {
+    if (isTracingEnabled()) {
+        TraceBuffer* buffer = getThreadBuffer();
+        if (buffer != NULL) {
+            unsigned long count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+            TraceEvent* event = &buffer->events[count % TRACE_EVENTS];
+            event->name = name;
+            event->start = start;
+            event->end = omp_get_wtime();
+            event->arg_names[0] = arg0_name;
+            event->arg_names[1] = arg1_name;
+            event->args[0] = arg0;
+            event->args[1] = arg1;
+            atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+        }
+    }
+}
+
+void endTraceSpan(const char* name, double start) {
+    endTraceSpanArgs(name, start, NULL, 0, NULL, 0);
+}
+
+bool writeTrace(const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"raytrace\"}}");
+    int threads = atomic_load(&trace_thread_count);
+    if (threads > MAX_TRACE_THREADS) {
+        threads = MAX_TRACE_THREADS;
+    }
+    for (int i = 0; i < threads; i++) {
+        TraceBuffer* buffer = atomic_load(&trace_buffers[i]);
+        if (buffer == NULL) {
+            continue;
+        }
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", i, i);
+        unsigned long count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+        unsigned long first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+        for (unsigned long j = first; j < count; j++) {
+            const TraceEvent* event = &buffer->events[j % TRACE_EVENTS];
+            // Chrome traces are in microseconds
+            fprintf(
+                file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                event->name, i, (event->start - trace_origin) * 1e6, (event->end - event->start) * 1e6
+            );
+            if (event->arg_names[0] != NULL) {
+                fprintf(file, ",\"args\":{\"%s\":%d", event->arg_names[0], event->args[0]);
+                if (event->arg_names[1] != NULL) {
+                    fprintf(file, ",\"%s\":%d", event->arg_names[1], event->args[1]);
+                }
+                fprintf(file, "}");
+            }
+            fprintf(file, "}");
+        }
+    }
+    fprintf(file, "\n]}\n");
+    bool ok = !ferror(file);
+    ok &= fclose(file) == 0;
+    return ok;
+}
@@ -0,0 +1,30 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+
+// Timeline of the spans of work done by every thread, written in the Chrome trace event format
+// that chrome://tracing and Perfetto open. Every thread records into its own ring buffer without
+// any locking, so only the latest TRACE_EVENTS spans of a thread are kept. Until tracing is
+// enabled recording does nothing but check a flag.
+#define TRACE_EVENTS (1 << 14)
+
+// Start recording, times in the trace are relative to this call
+void enableTracing();
+
+bool isTracingEnabled();
+
+// Start time of a span, 0 if tracing is not enabled
+double beginTraceSpan();
+
+// Record the span from start until now for the calling thread. name has to stay valid until the
+// trace is written, e.g. a string literal.
+void endTraceSpan(const char* name, double start);
+
+// Like endTraceSpan, with two integer arguments shown with the span, e.g. the position of a tile
+void endTraceSpanArgs(const char* name, double start, const char* arg0_name, int arg0, const char* arg1_name, int arg1);
+
+// Write the recorded spans as a JSON trace. May not run while other threads record spans.
+bool writeTrace(const char* filename);
+
+#endif
@@ -1,6 +1,8 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "vec.h"
 
@@ -93,15 +95,126 @@ Vec3 randomVec3() {
 Vec3 randomVec3InDirection(Vec3 v, float off, float pow) {
     float r0 = rand() / (float)RAND_MAX; // two uniformly random values from 0 to 1
     float r1 = rand() / (float)RAND_MAX;
+    return sampleVec3InDirection(v, off, pow, r0, r1);
+}
+
+// v should be normalized, r0 and r1 should be in [0, 1)
+Vec3 sampleVec3InDirection(Vec3 v, float off, float pow, float r0, float r1) {
     float O = 2 * PI * r0;
     float z = 1 - powf(r1, pow) * off;
-    Vec3 any_up = normalizeVec3(crossVec3(v, addVec3(v, createVec3(1, 1, 1)))); // any vector othogonal to v
-    Vec3 right = crossVec3(v, any_up);
-    Vec3 zero_inc = addVec3(scaleVec3(any_up, cosf(O)), scaleVec3(right, sinf(O)));
-    Vec3 ret = addVec3(scaleVec3(zero_inc, sqrtf(1 - z*z)), scaleVec3(v, z));
+    return fromCosineAndAzimuthal(v, z, O);
+}
+
+// v should be normalized, the incline is measured from v
+Vec3 fromCosineAndAzimuthal(Vec3 v, float cos_incline, float azimuthal) {
+    // Comparisons instead of fminf and fmaxf, which keeps batched loops free of branches
+    float z = cos_incline < 1 ? (cos_incline > -1 ? cos_incline : -1) : 1;
+    Vec3 tangent, bitangent;
+    createOrthonormalBasis(v, &tangent, &bitangent);
+    float sin_azimuthal, cos_azimuthal;
+    fastSinCos(azimuthal, &sin_azimuthal, &cos_azimuthal);
+    float r = sqrtf(1 - z * z);
+    return addVec3(addVec3(scaleVec3(tangent, r * cos_azimuthal), scaleVec3(bitangent, r * sin_azimuthal)), scaleVec3(v, z));
+}
+
+// Frisvad's basis with the sign trick of Duff et al., which is continuous everywhere but on the
+// plane z = 0 and has no singularity
+void createOrthonormalBasis(Vec3 n, Vec3* tangent, Vec3* bitangent) {
+    float sign = copysignf(1, n.z);
+    float a = -1 / (sign + n.z);
+    float b = n.x * n.y * a;
+    *tangent = createVec3(1 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    *bitangent = createVec3(b, sign + n.y * n.y * a, -n.y);
+}
+
+// The angle is reduced to [-pi/4, pi/4] plus a number of quarter turns, where Taylor polynomials
+// of degree 7 and 8 are accurate to 3e-7. Together with the rounding of the reduction the error
+// stays below 1e-6 for angles in [-2pi, 2pi].
+static inline void sinCosPolynomial(float angle, float* sin, float* cos) {
+    float turns = angle * (float)(2 / PI);
+    float quadrant = rintf(turns);
+    float x = (turns - quadrant) * (float)(PI / 2);
+    float x2 = x * x;
+    float s = x * (1 + x2 * (-1.0f / 6 + x2 * (1.0f / 120 + x2 * (-1.0f / 5040))));
+    float c = 1 + x2 * (-1.0f / 2 + x2 * (1.0f / 24 + x2 * (-1.0f / 720 + x2 * (1.0f / 40320))));
+    // Rotate by the quarter turns, an odd number swaps sine and cosine
+    int q = (int)quadrant;
+    float sin_q = (q & 1) ? c : s;
+    float cos_q = (q & 1) ? s : c;
+    *sin = (q & 2) ? -sin_q : sin_q;
+    *cos = ((q + 1) & 2) ? -cos_q : cos_q;
+}
+
+static float floatFromBits(uint32_t bits) {
+    float ret;
+    memcpy(&ret, &bits, sizeof(float));
     return ret;
 }
 
+static uint32_t bitsFromFloat(float value) {
+    uint32_t ret;
+    memcpy(&ret, &value, sizeof(float));
+    return ret;
+}
+
+// The mantissa is moved to [sqrt(1/2), sqrt(2)), where the series of atanh converges quickly
+static float fastLog2(float x) {
+    int32_t exponent = (int32_t)(bitsFromFloat(x) - 0x3f3504f3) >> 23;
+    float m = floatFromBits(bitsFromFloat(x) - ((uint32_t)exponent << 23));
+    float s = (m - 1) / (m + 1);
+    float s2 = s * s;
+    float ln = 2 * s * (1 + s2 * (1.0f / 3 + s2 * (1.0f / 5 + s2 * (1.0f / 7 + s2 * (1.0f / 9)))));
+    return exponent + ln * (float)(1 / M_LN2);
+}
+
+// Results that would be denormal are flushed to zero
+static float fastExp2(float x) {
+    x = x < 127 ? x : 127;
+    float n = rintf(x);
+    float f = (x - n) * (float)M_LN2;
+    float p = 1 + f * (1 + f * (1.0f / 2 + f * (1.0f / 6 + f * (1.0f / 24 + f * (1.0f / 120 + f * (1.0f / 720))))));
+    float ret = floatFromBits(bitsFromFloat(p) + ((uint32_t)(int32_t)n << 23));
+    return x < -125 ? 0 : ret;
+}
+
+// The relative error is below 3e-6 as long as |y * log2(x)| stays below 16, and grows with it
+static inline float powPolynomial(float x, float y) {
+    // Computed unconditionally, so that the result is only selected and no branch is needed
+    float ret = fastExp2(y * fastLog2(x));
+    return x > 0 ? ret : 0;
+}
+
+void fastSinCos(float angle, float* sin, float* cos) {
+    sinCosPolynomial(angle, sin, cos);
+}
+
+float fastPow(float x, float y) {
+    return powPolynomial(x, y);
+}
+
+static inline Vec3 cosinePowerDirection(Vec3 axis, float exponent, float u0, float u1) {
+    float z = powPolynomial(1 - u1, 1 / (exponent + 1));
+    Vec3 tangent, bitangent;
+    createOrthonormalBasis(axis, &tangent, &bitangent);
+    float sin_azimuthal, cos_azimuthal;
+    sinCosPolynomial(2 * PI * u0, &sin_azimuthal, &cos_azimuthal);
+    // The approximated cosine may end up slightly above one
+    float r2 = 1 - z * z;
+    float r = sqrtf(r2 > 0 ? r2 : 0);
+    return addVec3(addVec3(scaleVec3(tangent, r * cos_azimuthal), scaleVec3(bitangent, r * sin_azimuthal)), scaleVec3(axis, z));
+}
+
+Vec3 sampleCosinePowerDirection(Vec3 axis, float exponent, float u0, float u1) {
+    return cosinePowerDirection(axis, exponent, u0, u1);
+}
+
+void sampleCosinePowerDirections(const Vec3* axes, const float* exponents, const float* u0, const float* u1, Vec3* out, int count) {
+#pragma omp simd
+    for (int i = 0; i < count; i++) {
+        out[i] = cosinePowerDirection(axes[i], exponents[i], u0[i], u1[i]);
+    }
+}
+
 Mat3x3 createNullMat3x3() {
     Mat3x3 ret = { .v = {
         { 0, 0, 0, },
@@ -46,6 +46,26 @@ Vec3 fromInclineAndAzimuthal(Vec3 up, Vec3 zero, float incline, float azimuthal)
 
 Vec3 randomVec3InDirection(Vec3 v, float off, float pow);
 
+Vec3 sampleVec3InDirection(Vec3 v, float off, float pow, float r0, float r1);
+
+Vec3 fromCosineAndAzimuthal(Vec3 v, float cos_incline, float azimuthal);
+
+// Complete the normalized n to an orthonormal basis without any branches
+void createOrthonormalBasis(Vec3 n, Vec3* tangent, Vec3* bitangent);
+
+// Polynomial approximations of sinf, cosf and powf for sampling directions. They have no
+// branches, so that loops over them can be vectorized. fastPow expects x >= 0 and y > 0.
+void fastSinCos(float angle, float* sin, float* cos);
+
+float fastPow(float x, float y);
+
+// Direction distributed proportional to cos^exponent of the angle to the axis, the axis has to
+// be normalized and u0 and u1 be in [0, 1)
+Vec3 sampleCosinePowerDirection(Vec3 axis, float exponent, float u0, float u1);
+
+// sampleCosinePowerDirection for a whole batch, vectorized where the compiler can
+void sampleCosinePowerDirections(const Vec3* axes, const float* exponents, const float* u0, const float* u1, Vec3* out, int count);
+
 typedef struct {
     float v[3][3];
 } Mat3x3;
@@ -0,0 +1,449 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "wavefront.h"
+#include "intersection.h"
+#include "sampler.h"
+#include "bsdf.h"
+#include "paging.h"
+
+#define QUEUE_CAPACITY (1 << 16)
+
+// Paths are stored as a structure of arrays
+typedef struct {
+    int count;
+    Vec3* origins;
+    Vec3* directions;
+    Color* throughputs;
+    int* pixels;
+    int* depths;
+    float* travelled;
+    Sampler* samplers;
+} PathQueue;
+
+struct WavefrontState {
+    PathQueue queues[2];
+    Intersection* hits;
+    uint64_t* ray_keys[2];
+    int* ray_order[2];
+    int* keys;
+    int* order;
+    int* buckets;
+    int bucket_count;
+    Color* pixels;
+    int pixel_count;
+    // Lobes chosen while shading a queue, their directions are sampled in one batch
+    BsdfLobeChoice* choices;
+    int* chosen_paths;
+    Vec3* chosen_positions;
+    Vec3* lobe_axes;
+    float* lobe_exponents;
+    float* lobe_u0;
+    float* lobe_u1;
+    Vec3* lobe_directions;
+    // Rays waiting for clusters of out-of-core scenes
+    DeferredRays deferred;
+};
+
+static void initPathQueue(PathQueue* queue) {
+    queue->count = 0;
+    queue->origins = (Vec3*)malloc(sizeof(Vec3) * QUEUE_CAPACITY);
+    queue->directions = (Vec3*)malloc(sizeof(Vec3) * QUEUE_CAPACITY);
+    queue->throughputs = (Color*)malloc(sizeof(Color) * QUEUE_CAPACITY);
+    queue->pixels = (int*)malloc(sizeof(int) * QUEUE_CAPACITY);
+    queue->depths = (int*)malloc(sizeof(int) * QUEUE_CAPACITY);
+    queue->travelled = (float*)malloc(sizeof(float) * QUEUE_CAPACITY);
+    queue->samplers = (Sampler*)malloc(sizeof(Sampler) * QUEUE_CAPACITY);
+}
+
+static void freePathQueue(PathQueue* queue) {
+    free(queue->origins);
+    free(queue->directions);
+    free(queue->throughputs);
+    free(queue->pixels);
+    free(queue->depths);
+    free(queue->travelled);
+    free(queue->samplers);
+}
+
+WavefrontState* createWavefrontState() {
+    WavefrontState* state = (WavefrontState*)malloc(sizeof(WavefrontState));
+    initPathQueue(&state->queues[0]);
+    initPathQueue(&state->queues[1]);
+    state->hits = (Intersection*)malloc(sizeof(Intersection) * QUEUE_CAPACITY);
+    for (int i = 0; i < 2; i++) {
+        state->ray_keys[i] = (uint64_t*)malloc(sizeof(uint64_t) * QUEUE_CAPACITY);
+        state->ray_order[i] = (int*)malloc(sizeof(int) * QUEUE_CAPACITY);
+    }
+    state->keys = (int*)malloc(sizeof(int) * QUEUE_CAPACITY);
+    state->order = (int*)malloc(sizeof(int) * QUEUE_CAPACITY);
+    state->buckets = NULL;
+    state->bucket_count = 0;
+    state->pixels = NULL;
+    state->pixel_count = 0;
+    state->choices = (BsdfLobeChoice*)malloc(sizeof(BsdfLobeChoice) * QUEUE_CAPACITY);
+    state->chosen_paths = (int*)malloc(sizeof(int) * QUEUE_CAPACITY);
+    state->chosen_positions = (Vec3*)malloc(sizeof(Vec3) * QUEUE_CAPACITY);
+    state->lobe_axes = (Vec3*)malloc(sizeof(Vec3) * QUEUE_CAPACITY);
+    state->lobe_exponents = (float*)malloc(sizeof(float) * QUEUE_CAPACITY);
+    state->lobe_u0 = (float*)malloc(sizeof(float) * QUEUE_CAPACITY);
+    state->lobe_u1 = (float*)malloc(sizeof(float) * QUEUE_CAPACITY);
+    state->lobe_directions = (Vec3*)malloc(sizeof(Vec3) * QUEUE_CAPACITY);
+    initDeferredRays(&state->deferred);
+    return state;
+}
+
+void freeWavefrontState(WavefrontState* state) {
+    if (state != NULL) {
+        freePathQueue(&state->queues[0]);
+        freePathQueue(&state->queues[1]);
+        free(state->hits);
+        for (int i = 0; i < 2; i++) {
+            free(state->ray_keys[i]);
+            free(state->ray_order[i]);
+        }
+        free(state->keys);
+        free(state->order);
+        free(state->buckets);
+        free(state->pixels);
+        free(state->choices);
+        free(state->chosen_paths);
+        free(state->chosen_positions);
+        free(state->lobe_axes);
+        free(state->lobe_exponents);
+        free(state->lobe_u0);
+        free(state->lobe_u1);
+        free(state->lobe_directions);
+        freeDeferredRays(&state->deferred);
+        free(state);
+    }
+}
+
+// Spread the lower 10 bits of x apart, leaving two zero bits between each of them
+static uint64_t spreadBits(uint32_t x) {
+    uint64_t v = x & 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+static uint32_t quantize(float value, float min, float extent, int bits) {
+    float scaled = extent > 0 ? (value - min) / extent : 0;
+    uint32_t max = (1 << bits) - 1;
+    return (uint32_t)fminf(fmaxf(scaled * (max + 1), 0), max);
+}
+
+#define RAY_KEY_BITS 48
+#define RADIX_BITS 8
+
+// Order the rays by direction octant, then by the Morton code of their origin inside the scene
+// bounds and finally by a coarsely quantized direction, using a least significant digit radix sort.
+static void sortRays(WavefrontState* state, Scene* scene, PathQueue* queue) {
+    BoundingBox bounds = getSceneBounds(scene);
+    Vec3 extent = subVec3(bounds.bound[1], bounds.bound[0]);
+    uint64_t* keys = state->ray_keys[0];
+    int* order = state->ray_order[0];
+    for (int i = 0; i < queue->count; i++) {
+        Vec3 origin = queue->origins[i];
+        Vec3 direction = queue->directions[i];
+        uint64_t octant = (direction.x < 0) | ((direction.y < 0) << 1) | ((direction.z < 0) << 2);
+        uint64_t position = spreadBits(quantize(origin.x, bounds.bound[0].x, extent.x, 10))
+            | (spreadBits(quantize(origin.y, bounds.bound[0].y, extent.y, 10)) << 1)
+            | (spreadBits(quantize(origin.z, bounds.bound[0].z, extent.z, 10)) << 2);
+        uint64_t angle = spreadBits(quantize(direction.x, -1, 2, 4))
+            | (spreadBits(quantize(direction.y, -1, 2, 4)) << 1)
+            | (spreadBits(quantize(direction.z, -1, 2, 4)) << 2);
+        keys[i] = (octant << 42) | (position << 12) | angle;
+        order[i] = i;
+    }
+    for (int shift = 0; shift < RAY_KEY_BITS; shift += RADIX_BITS) {
+        uint64_t* keys_in = state->ray_keys[(shift / RADIX_BITS) % 2];
+        int* order_in = state->ray_order[(shift / RADIX_BITS) % 2];
+        uint64_t* keys_out = state->ray_keys[(shift / RADIX_BITS + 1) % 2];
+        int* order_out = state->ray_order[(shift / RADIX_BITS + 1) % 2];
+        int counts[(1 << RADIX_BITS) + 1];
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < queue->count; i++) {
+            counts[((keys_in[i] >> shift) & ((1 << RADIX_BITS) - 1)) + 1]++;
+        }
+        for (int i = 0; i < (1 << RADIX_BITS); i++) {
+            counts[i + 1] += counts[i];
+        }
+        for (int i = 0; i < queue->count; i++) {
+            int digit = (keys_in[i] >> shift) & ((1 << RADIX_BITS) - 1);
+            keys_out[counts[digit]] = keys_in[i];
+            order_out[counts[digit]] = order_in[i];
+            counts[digit]++;
+        }
+    }
+}
+
+static void intersectPath(WavefrontState* state, Scene* scene, PathQueue* queue, int i) {
+    Ray ray = createRay(queue->origins[i], queue->directions[i]);
+    Intersection* hit = &state->hits[i];
+    hit->dist = INFINITY;
+    hit->triangle_id = -1;
+    if (scene->paged != NULL) {
+        // Clusters that are not resident are only tested once all rays of the queue are traced
+        testRayResidentClusters(&ray, i, scene->paged, hit, &state->deferred);
+        if (scene->primitive_bvh != NULL) {
+            testRayBvhIntersection(&ray, scene->primitive_bvh, hit);
+        }
+    } else {
+        testRaySceneIntersection(&ray, scene, hit);
+    }
+}
+
+// If sort is set the rays are traced in a spatially coherent order, but the results are still
+// stored at the index of the path they belong to. For out-of-core scenes the rays that have to
+// wait for a cluster to be loaded are collected, and each missing cluster is loaded only once.
+static void intersectPaths(WavefrontState* state, Scene* scene, PathQueue* queue, bool sort) {
+    if (sort) {
+        sortRays(state, scene, queue);
+        // RAY_KEY_BITS / RADIX_BITS is even, so the sorted order ends up in the first buffer
+        int* order = state->ray_order[0];
+        for (int k = 0; k < queue->count; k++) {
+            intersectPath(state, scene, queue, order[k]);
+        }
+    } else {
+        for (int i = 0; i < queue->count; i++) {
+            intersectPath(state, scene, queue, i);
+        }
+    }
+    if (scene->paged != NULL) {
+        resolveDeferredRays(&state->deferred, scene->paged, queue->origins, queue->directions, state->hits);
+    }
+}
+
+// Paths are shaded in groups by the object they hit. For out-of-core scenes the object is not
+// known without loading the cluster, so they are grouped by cluster instead. All analytic
+// primitives share the last group.
+static int shadingGroupCount(const Scene* scene) {
+    return (scene->paged != NULL ? getClusterCount(scene->paged) : scene->object_count) + 1;
+}
+
+static int shadingGroup(const Scene* scene, int triangle_id) {
+    if (triangle_id >= scene->triangle_count) {
+        return shadingGroupCount(scene) - 1;
+    } else {
+        return scene->paged != NULL ? getTriangleCluster(scene->paged, triangle_id) : scene->object_ids[triangle_id];
+    }
+}
+
+// Bin the paths by material (the shading group of the hit) and direction octant using a counting
+// sort. Paths that missed the scene all go into the first bin.
+static void sortPaths(WavefrontState* state, Scene* scene, PathQueue* queue) {
+    int bucket_count = 1 + 8 * (shadingGroupCount(scene) + 1);
+    if (bucket_count > state->bucket_count) {
+        state->bucket_count = bucket_count;
+        state->buckets = (int*)realloc(state->buckets, sizeof(int) * (bucket_count + 1));
+    }
+    memset(state->buckets, 0, sizeof(int) * (bucket_count + 1));
+    for (int i = 0; i < queue->count; i++) {
+        int key = 0;
+        int triangle_id = state->hits[i].triangle_id;
+        if (triangle_id >= 0) {
+            Vec3 direction = queue->directions[i];
+            int octant = (direction.x < 0) | ((direction.y < 0) << 1) | ((direction.z < 0) << 2);
+            key = 1 + 8 * (shadingGroup(scene, triangle_id) + 1) + octant;
+        }
+        state->keys[i] = key;
+        state->buckets[key + 1]++;
+    }
+    for (int i = 0; i < bucket_count; i++) {
+        state->buckets[i + 1] += state->buckets[i];
+    }
+    for (int i = 0; i < queue->count; i++) {
+        state->order[state->buckets[state->keys[i]]] = i;
+        state->buckets[state->keys[i]]++;
+    }
+}
+
+static int lobeDepthCost(const Renderer* renderer, BsdfLobe lobe) {
+    switch (lobe) {
+    case BSDF_LOBE_DIFFUSE:
+        return renderer->diffuse_depth_cost;
+    case BSDF_LOBE_SPECULAR:
+        return renderer->specular_depth_cost;
+    case BSDF_LOBE_TRANSMISSION:
+        return renderer->transmition_depth_cost;
+    default:
+        return 0;
+    }
+}
+
+// Shade the paths in sorted order, accumulating emission and writing the continuing paths into
+// the next queue, which keeps the next intersection stage coherent as well. The lobes are chosen
+// path by path, but the directions of all of them are sampled in one vectorized batch.
+static void shadePaths(WavefrontState* state, Scene* scene, Renderer* renderer, PathQueue* queue, PathQueue* next) {
+    next->count = 0;
+    int chosen = 0;
+    // For out-of-core scenes the cluster of the current group is kept resident until all of its
+    // paths are shaded, so that other threads can not evict it in between
+    int cluster = -1;
+    for (int k = 0; k < queue->count; k++) {
+        int i = state->order[k];
+        Intersection* hit = &state->hits[i];
+        Color* pixel = &state->pixels[queue->pixels[i]];
+        Color throughput = queue->throughputs[i];
+        if (hit->triangle_id < 0) {
+            *pixel = addVec3(*pixel, mulVec3(throughput, renderer->void_color));
+            continue;
+        }
+        if (scene->paged != NULL && hit->triangle_id < scene->triangle_count && shadingGroup(scene, hit->triangle_id) != cluster) {
+            if (cluster >= 0) {
+                releaseCluster(scene->paged, cluster);
+            }
+            cluster = shadingGroup(scene, hit->triangle_id);
+            acquireCluster(scene->paged, cluster);
+        }
+        float travelled = queue->travelled[i] + hit->dist;
+        SurfacePoint surface;
+        getSurfacePoint(scene, hit->triangle_id, hit->u, hit->v, travelled * pixelSpreadAngle(renderer), &surface);
+        Vec3 vert = surface.position;
+        Vec3 normal = surface.normal;
+        Vec3 incoming = queue->directions[i];
+        bool outside = true;
+        if (dotVec3(normal, incoming) > 0) {
+            outside = false;
+            normal = scaleVec3(normal, -1);
+        }
+        MaterialProperties* material = &surface.material;
+        *pixel = addVec3(*pixel, mulVec3(throughput, material->emission_color));
+        int depth = queue->depths[i];
+        int allowed_lobes = 0;
+        if (depth - renderer->diffuse_depth_cost > 0) {
+            allowed_lobes |= BSDF_LOBE_DIFFUSE;
+        }
+        if (depth - renderer->specular_depth_cost > 0) {
+            allowed_lobes |= BSDF_LOBE_SPECULAR;
+        }
+        if (depth - renderer->transmition_depth_cost > 0) {
+            allowed_lobes |= BSDF_LOBE_TRANSMISSION;
+        }
+        BsdfLobeChoice* choice = &state->choices[chosen];
+        if (allowed_lobes != 0 && chooseBsdfLobe(material, incoming, normal, outside, allowed_lobes, &queue->samplers[i], choice)) {
+            state->chosen_paths[chosen] = i;
+            state->chosen_positions[chosen] = vert;
+            state->lobe_axes[chosen] = choice->axis;
+            state->lobe_exponents[chosen] = choice->exponent;
+            state->lobe_u0[chosen] = choice->u0;
+            state->lobe_u1[chosen] = choice->u1;
+            chosen++;
+        }
+    }
+    if (cluster >= 0) {
+        releaseCluster(scene->paged, cluster);
+    }
+    sampleCosinePowerDirections(state->lobe_axes, state->lobe_exponents, state->lobe_u0, state->lobe_u1, state->lobe_directions, chosen);
+    for (int k = 0; k < chosen; k++) {
+        int i = state->chosen_paths[k];
+        BsdfSample sample;
+        if (finishBsdfSample(&state->choices[k], state->lobe_directions[k], &sample)) {
+            int j = next->count;
+            next->origins[j] = state->chosen_positions[k];
+            next->directions[j] = sample.direction;
+            next->throughputs[j] = mulVec3(queue->throughputs[i], sample.weight);
+            next->pixels[j] = queue->pixels[i];
+            next->depths[j] = queue->depths[i] - lobeDepthCost(renderer, sample.lobe);
+            next->travelled[j] = queue->travelled[i] + state->hits[i].dist;
+            next->samplers[j] = queue->samplers[i];
+            next->count++;
+        }
+    }
+}
+
+// If the renderer caches the first hits, the hits of the generated paths are taken from the cache
+// and true is returned, so that the first intersection stage can be skipped
+static bool generatePaths(
+    WavefrontState* state, PathQueue* queue, Renderer* renderer, const CameraFrame* camera, int x0, int y0, int x1, int y1,
+    int first_sample, int sample_count
+) {
+    bool cached = renderer->primary_hits != NULL;
+    int tile_width = x1 - x0;
+    queue->count = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            for (int s = first_sample; s < first_sample + sample_count; s++) {
+                int i = queue->count;
+                Sampler* sampler = &queue->samplers[i];
+                initSampler(sampler, y * renderer->width + x, renderer->sample_index + s);
+                float jitter_x, jitter_y;
+                sample2D(sampler, &jitter_x, &jitter_y);
+                const PrimaryHit* primary = getPrimaryHit(renderer, x, y, s);
+                if (primary != NULL) {
+                    queue->origins[i] = camera->position;
+                    queue->directions[i] = primary->direction;
+                    state->hits[i] = primary->hit;
+                } else {
+                    Ray ray = createCameraRay(camera, renderer, x + jitter_x, y + jitter_y);
+                    queue->origins[i] = ray.start;
+                    queue->directions[i] = ray.direction;
+                }
+                queue->throughputs[i] = createVec3(1, 1, 1);
+                queue->pixels[i] = (y - y0) * tile_width + (x - x0);
+                queue->depths[i] = renderer->depth;
+                queue->travelled[i] = 0;
+                queue->count++;
+            }
+        }
+    }
+    return cached;
+}
+
+void renderTileWavefront(
+    WavefrontState* state, Renderer* renderer, const CameraFrame* camera, Scene* scene, int x0, int y0, int x1, int y1
+) {
+    int tile_width = x1 - x0;
+    int pixel_count = tile_width * (y1 - y0);
+    if (pixel_count > state->pixel_count) {
+        state->pixel_count = pixel_count;
+        state->pixels = (Color*)realloc(state->pixels, sizeof(Color) * pixel_count);
+    }
+    for (int i = 0; i < pixel_count; i++) {
+        state->pixels[i] = createVec3(0, 0, 0);
+    }
+    if (renderer->depth > 0) {
+        // Split the samples into batches that fit into the queues
+        int batch_size = QUEUE_CAPACITY / pixel_count;
+        if (batch_size < 1) {
+            batch_size = 1;
+        }
+        for (int s = 0; s < renderer->pixel_samples; s += batch_size) {
+            int sample_count = s + batch_size < renderer->pixel_samples ? batch_size : renderer->pixel_samples - s;
+            PathQueue* queue = &state->queues[0];
+            PathQueue* next = &state->queues[1];
+            bool cached = generatePaths(state, queue, renderer, camera, x0, y0, x1, y1, s, sample_count);
+            // Camera rays are generated in pixel order and are already coherent
+            bool secondary = false;
+            while (queue->count > 0) {
+                if (secondary || !cached) {
+                    intersectPaths(state, scene, queue, secondary && renderer->sort_rays);
+                }
+                secondary = true;
+                sortPaths(state, scene, queue);
+                shadePaths(state, scene, renderer, queue, next);
+                PathQueue* tmp = queue;
+                queue = next;
+                next = tmp;
+            }
+        }
+    } else {
+        for (int i = 0; i < pixel_count; i++) {
+            state->pixels[i] = scaleVec3(renderer->void_color, renderer->pixel_samples);
+        }
+    }
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            Color pixel_color = scaleVec3(state->pixels[(y - y0) * tile_width + (x - x0)], 1.0 / renderer->pixel_samples);
+            Color* pixel = renderer->buffer + (y * renderer->width + x);
+            *pixel = addVec3(*pixel, pixel_color);
+        }
+    }
+}
+
@@ -0,0 +1,20 @@
+#ifndef _WAVEFRONT_H_
+#define _WAVEFRONT_H_
+
+#include "renderer.h"
+#include "scene.h"
+
+// Per thread storage of the wavefront integrator. Instead of following one path at a time, all
+// paths of a tile are kept in queues and advanced together one stage at a time (intersect, sort
+// by material and direction, shade and spawn).
+typedef struct WavefrontState WavefrontState;
+
+WavefrontState* createWavefrontState();
+
+void freeWavefrontState(WavefrontState* state);
+
+void renderTileWavefront(
+    WavefrontState* state, Renderer* renderer, const CameraFrame* camera, Scene* scene, int x0, int y0, int x1, int y1
+);
+
+#endif
@@ -0,0 +1,361 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <omp.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "image.h"
+
+// Equal-time image quality check. Every scene of the scene file is rendered once with many passes
+// as the ground truth, and then for a fixed time budget. The efficiency of the budget render is
+// 1 / (relMSE * seconds). It depends on the speed of the machine, so a scene is not compared to an
+// absolute value but to the efficiency of an earlier base scene of the same run, usually the path
+// integrator on the same obj file. The check fails if the ratio of the two dropped by more than the
+// tolerance below the ratio committed in the scene file. A few fireflies can change the error of a
+// single render a lot, so the median of several renders is used.
+
+#define TIME_LIMIT 2.0
+#define TOLERANCE 0.25
+#define RUNS 7
+#define MAX_RUNS 64
+
+#define MAX_LINE 4096
+#define MAX_ARGUMENTS 64
+#define MAX_BASE_SCENES 64
+
+// Keeps the relative error of pixels that are almost black from growing without bound
+#define RELATIVE_EPSILON 0.01
+// Fraction of the largest relative errors that are left out of the relative MSE
+#define OUTLIER_FRACTION 0.001
+
+typedef struct {
+    const char* renderer;
+    const char* output;
+    float time_limit;
+    float tolerance;
+    int runs;
+    bool new_references;
+} CheckSettings;
+
+// Efficiency of a base scene that later scenes of the scene file are compared to
+typedef struct {
+    char name[64];
+    double efficiency;
+} BaseScene;
+
+typedef struct {
+    BaseScene scenes[MAX_BASE_SCENES];
+    int count;
+} BaseScenes;
+
+typedef struct {
+    double rmse;
+    double relmse;
+} ImageError;
+
+typedef struct {
+    double time;
+    ImageError error;
+    double efficiency;
+} RunResult;
+
+static int compareDoubles(const void* a, const void* b) {
+    double value_a = *(const double*)a;
+    double value_b = *(const double*)b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+static int compareRunResults(const void* a, const void* b) {
+    double efficiency_a = ((const RunResult*)a)->efficiency;
+    double efficiency_b = ((const RunResult*)b)->efficiency;
+    return (efficiency_a > efficiency_b) - (efficiency_a < efficiency_b);
+}
+
+// Run the renderer with the scene options followed by the given ones, returns the wall-clock time
+// or a negative value if it failed
+static double runRenderer(const char* renderer, char** options, int option_count, char** extra, int extra_count, const char* obj_filename, const char* out_filename) {
+    char* arguments[MAX_ARGUMENTS * 2 + 4];
+    int count = 0;
+    arguments[count++] = (char*)renderer;
+    for (int i = 0; i < option_count; i++) {
+        arguments[count++] = options[i];
+    }
+    for (int i = 0; i < extra_count; i++) {
+        arguments[count++] = extra[i];
+    }
+    arguments[count++] = (char*)obj_filename;
+    arguments[count++] = (char*)out_filename;
+    arguments[count] = NULL;
+    double start = omp_get_wtime();
+    pid_t child = fork();
+    if (child < 0) {
+        return -1;
+    } else if (child == 0) {
+        execv(renderer, arguments);
+        fprintf(stderr, "failed to run '%s': %s\n", renderer, strerror(errno));
+        _exit(127);
+    }
+    int status;
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return omp_get_wtime() - start;
+}
+
+static bool compareImages(const char* candidate_filename, const char* reference_filename, ImageError* error) {
+    int width, height;
+    int reference_width, reference_height;
+    Color* candidate = readPFMFile(candidate_filename, &width, &height);
+    Color* reference = readPFMFile(reference_filename, &reference_width, &reference_height);
+    bool ok = candidate != NULL && reference != NULL && width == reference_width && height == reference_height;
+    if (ok) {
+        double squared = 0;
+        size_t count = (size_t)width * height;
+        double* relative = malloc(3 * count * sizeof(double));
+        for (size_t i = 0; i < count; i++) {
+            for (int k = 0; k < 3; k++) {
+                double difference = candidate[i].v[k] - reference[i].v[k];
+                squared += difference * difference;
+                relative[3 * i + k] = difference * difference / (reference[i].v[k] * reference[i].v[k] + RELATIVE_EPSILON);
+            }
+        }
+        // A handful of fireflies would decide the relative error of the whole image
+        qsort(relative, 3 * count, sizeof(double), compareDoubles);
+        size_t kept = 3 * count - (size_t)(3 * count * OUTLIER_FRACTION);
+        double relative_sum = 0;
+        for (size_t i = 0; i < kept; i++) {
+            relative_sum += relative[i];
+        }
+        free(relative);
+        error->rmse = sqrt(squared / (3 * count));
+        error->relmse = relative_sum / kept;
+    }
+    free(candidate);
+    free(reference);
+    return ok;
+}
+
+static const BaseScene* findBaseScene(const BaseScenes* bases, const char* name) {
+    for (int i = 0; i < bases->count; i++) {
+        if (strcmp(bases->scenes[i].name, name) == 0) {
+            return &bases->scenes[i];
+        }
+    }
+    return NULL;
+}
+
+// Check a single line of the scene file, "NAME OBJ-FILE REFERENCE-PASSES BASE RATIO
+// [RENDERER-OPTION...]". A BASE of "-" makes the scene a base scene with no ratio to check.
+static bool checkScene(const CheckSettings* settings, BaseScenes* bases, const char* directory, char* line, const char* location) {
+    char* save;
+    char* name = strtok_r(line, " \t\n", &save);
+    char* obj = strtok_r(NULL, " \t\n", &save);
+    char* reference_passes = strtok_r(NULL, " \t\n", &save);
+    char* base_name = strtok_r(NULL, " \t\n", &save);
+    char* expected = strtok_r(NULL, " \t\n", &save);
+    if (name == NULL || obj == NULL || reference_passes == NULL || base_name == NULL || expected == NULL) {
+        fprintf(stderr, "%s: expected a name, obj file, number of reference passes, base scene and ratio\n", location);
+        return false;
+    }
+    const BaseScene* base = NULL;
+    double expected_ratio = 1;
+    if (strcmp(base_name, "-") == 0) {
+        if (bases->count == MAX_BASE_SCENES) {
+            fprintf(stderr, "%s: too many base scenes\n", location);
+            return false;
+        } else if (strlen(name) >= sizeof(bases->scenes[0].name)) {
+            fprintf(stderr, "%s: the name of a base scene is too long\n", location);
+            return false;
+        }
+    } else if ((base = findBaseScene(bases, base_name)) == NULL) {
+        fprintf(stderr, "%s: '%s' is not a base scene of an earlier line\n", location, base_name);
+        return false;
+    } else if (sscanf(expected, "%lf", &expected_ratio) != 1 || expected_ratio <= 0) {
+        fprintf(stderr, "%s: invalid ratio '%s'\n", location, expected);
+        return false;
+    }
+    char* options[MAX_ARGUMENTS];
+    int option_count = 0;
+    char* option;
+    while ((option = strtok_r(NULL, " \t\n", &save)) != NULL) {
+        if (option_count == MAX_ARGUMENTS) {
+            fprintf(stderr, "%s: too many renderer options\n", location);
+            return false;
+        }
+        options[option_count++] = option;
+    }
+    char obj_filename[PATH_MAX];
+    char reference_filename[PATH_MAX];
+    char candidate_filename[PATH_MAX];
+    if (obj[0] == '/') {
+        snprintf(obj_filename, PATH_MAX, "%s", obj);
+    } else {
+        snprintf(obj_filename, PATH_MAX, "%s%s", directory, obj);
+    }
+    snprintf(reference_filename, PATH_MAX, "%s/%s.reference.pfm", settings->output, name);
+    snprintf(candidate_filename, PATH_MAX, "%s/%s.pfm", settings->output, name);
+    if (settings->new_references || access(reference_filename, R_OK) != 0) {
+        fprintf(stderr, "%s: rendering the reference with %s passes\n", name, reference_passes);
+        char* extra[] = { "-p", reference_passes };
+        if (runRenderer(settings->renderer, options, option_count, extra, 2, obj_filename, reference_filename) < 0) {
+            fprintf(stderr, "%s: failed to render the reference\n", name);
+            return false;
+        }
+    }
+    char time_limit[32];
+    snprintf(time_limit, sizeof(time_limit), "%g", settings->time_limit);
+    char* extra[] = { "-p", "1000000000", "--time", time_limit };
+    RunResult results[MAX_RUNS];
+    for (int i = 0; i < settings->runs; i++) {
+        RunResult* result = &results[i];
+        result->time = runRenderer(settings->renderer, options, option_count, extra, 4, obj_filename, candidate_filename);
+        if (result->time < 0) {
+            fprintf(stderr, "%s: failed to render\n", name);
+            return false;
+        } else if (!compareImages(candidate_filename, reference_filename, &result->error)) {
+            fprintf(stderr, "%s: failed to compare '%s' with '%s'\n", name, candidate_filename, reference_filename);
+            return false;
+        }
+        result->efficiency = 1 / (result->error.relmse * result->time);
+    }
+    qsort(results, settings->runs, sizeof(RunResult), compareRunResults);
+    const RunResult* median = &results[settings->runs / 2];
+    double efficiency = median->efficiency;
+    bool ok = true;
+    printf("%-24s %7.2f s %10.5f %10.5f %10.2f", name, median->time, median->error.rmse, median->error.relmse, efficiency);
+    if (base == NULL) {
+        BaseScene* added = &bases->scenes[bases->count++];
+        snprintf(added->name, sizeof(added->name), "%s", name);
+        added->efficiency = efficiency;
+        printf(" %8s %8s %8s  %s\n", "-", "-", "-", "base");
+    } else {
+        double ratio = efficiency / base->efficiency;
+        double change = ratio / expected_ratio - 1;
+        ok = change >= -settings->tolerance;
+        printf(" %8.3f %8.3f %+7.1f%%  %s\n", ratio, expected_ratio, 100 * change, ok ? "ok" : "FAILED");
+    }
+    fflush(stdout);
+    return ok;
+}
+
+static bool checkScenes(const CheckSettings* settings, const char* scenes_filename) {
+    FILE* file = fopen(scenes_filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "failed to open '%s': %s\n", scenes_filename, strerror(errno));
+        return false;
+    }
+    // Obj files are relative to the directory of the scene file
+    char directory[PATH_MAX];
+    snprintf(directory, PATH_MAX, "%s", scenes_filename);
+    char* last_slash = strrchr(directory, '/');
+    if (last_slash != NULL) {
+        last_slash[1] = 0;
+    } else {
+        directory[0] = 0;
+    }
+    printf("%-24s %9s %10s %10s %10s %8s %8s %8s\n", "scene", "time", "rmse", "relmse", "efficiency", "ratio", "expected", "change");
+    fflush(stdout);
+    bool ok = true;
+    BaseScenes bases = { .count = 0 };
+    char line[MAX_LINE];
+    char location[PATH_MAX + 16];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char* start = line + strspn(line, " \t\n");
+        if (start[0] != 0 && start[0] != '#') {
+            snprintf(location, sizeof(location), "%s:%d", scenes_filename, line_number);
+            ok &= checkScene(settings, &bases, directory, start, location);
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr, "Usage: %s [OPTIONS] SCENE-FILE\n", program);
+    fprintf(stderr, "Every line of SCENE-FILE is NAME OBJ-FILE REFERENCE-PASSES BASE RATIO [RENDERER-OPTION...]\n");
+    fprintf(stderr, "The efficiency of a scene divided by the one of the earlier scene BASE must not drop\n");
+    fprintf(stderr, "below RATIO by more than the tolerance, a BASE of - makes the scene a base scene\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -r, --renderer PATH      renderer to check (default ./build/bin/raytrace)\n");
+    fprintf(stderr, "  -o, --output DIR         directory of the references and renders\n");
+    fprintf(stderr, "                           (default ./build/check)\n");
+    fprintf(stderr, "  -t, --time SECONDS       time budget of every render (default %g)\n", TIME_LIMIT);
+    fprintf(stderr, "      --tolerance F        largest allowed relative drop of the ratio (default %g)\n", TOLERANCE);
+    fprintf(stderr, "  -n, --runs N             renders per scene, the median efficiency is used\n");
+    fprintf(stderr, "                           (default %d)\n", RUNS);
+    fprintf(stderr, "      --new-references     render the references again, e.g. after a scene changed\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct option long_options[] = {
+        { "renderer", required_argument, NULL, 'r' },
+        { "output", required_argument, NULL, 'o' },
+        { "time", required_argument, NULL, 't' },
+        { "tolerance", required_argument, NULL, 'T' },
+        { "runs", required_argument, NULL, 'n' },
+        { "new-references", no_argument, NULL, 'N' },
+        { NULL, 0, NULL, 0 },
+    };
+    CheckSettings settings = {
+        .renderer = "./build/bin/raytrace",
+        .output = "./build/check",
+        .time_limit = TIME_LIMIT,
+        .tolerance = TOLERANCE,
+        .runs = RUNS,
+        .new_references = false,
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:o:t:n:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+            settings.renderer = optarg;
+            break;
+        case 'o':
+            settings.output = optarg;
+            break;
+        case 't':
+            if (sscanf(optarg, "%f", &settings.time_limit) != 1 || settings.time_limit <= 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T':
+            if (sscanf(optarg, "%f", &settings.tolerance) != 1 || settings.tolerance < 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if (sscanf(optarg, "%i", &settings.runs) != 1 || settings.runs <= 0 || settings.runs > MAX_RUNS) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'N':
+            settings.new_references = true;
+            break;
+        default:
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (mkdir(settings.output, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create '%s': %s\n", settings.output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return checkScenes(&settings, argv[optind]) ? EXIT_SUCCESS : EXIT_FAILURE;
+}